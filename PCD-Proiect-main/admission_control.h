@@ -0,0 +1,94 @@
+// Admission control: bounds on open connections, jobs waiting for a worker and bytes of
+// unfinished jobs on disk. Requests over a bound are refused with a retry hint instead of
+// being buffered, so an overloaded server slows clients down rather than itself.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+class AdmissionControl {
+public:
+    // Smallest and largest retry hint handed to refused clients
+    static const int MIN_RETRY_MS = 200;
+    static const int MAX_RETRY_MS = 10000;
+
+    AdmissionControl() : max_connections(64), max_pending_jobs(256), max_inflight_bytes(1024ull * 1024 * 1024),
+                         connections_(0), pending_jobs_(0), inflight_bytes_(0), rejected_(0) {}
+
+    int max_connections;
+    int max_pending_jobs;         // jobs uploading or queued
+    uint64_t max_inflight_bytes;  // bytes of jobs that have not finished yet
+
+    bool admit_connection() {
+        return acquire(connections_, 1, max_connections);
+    }
+
+    void release_connection() {
+        connections_--;
+    }
+
+    // A new job being uploaded; released once it is dispatched or dropped
+    bool admit_job() {
+        return acquire(pending_jobs_, 1, max_pending_jobs);
+    }
+
+    void release_job() {
+        pending_jobs_--;
+    }
+
+    // Jobs restored at startup are counted even if they exceed the bounds
+    void restore_job(uint64_t bytes) {
+        pending_jobs_++;
+        inflight_bytes_ += bytes;
+    }
+
+    // Space for an announced upload; released when its job finishes
+    bool reserve_bytes(uint64_t bytes) {
+        return acquire(inflight_bytes_, bytes, max_inflight_bytes);
+    }
+
+    void release_bytes(uint64_t bytes) {
+        inflight_bytes_ -= bytes;
+    }
+
+    // Retry hint that grows with the backlog in front of the client's next attempt
+    int retry_after_ms(int queued_jobs, int worker_slots) const {
+        long long retry = MIN_RETRY_MS * (1LL + queued_jobs / std::max(worker_slots, 1));
+        return static_cast<int>(std::min<long long>(retry, MAX_RETRY_MS));
+    }
+
+    std::string busy_message(int queued_jobs, int worker_slots) {
+        rejected_++;
+        return "BUSY retry_after_ms=" + std::to_string(retry_after_ms(queued_jobs, worker_slots));
+    }
+
+    std::string to_json() const {
+        std::ostringstream out;
+        out << "{\"connections\":" << connections_ << ",\"max_connections\":" << max_connections
+            << ",\"pending_jobs\":" << pending_jobs_ << ",\"max_pending_jobs\":" << max_pending_jobs
+            << ",\"inflight_bytes\":" << inflight_bytes_ << ",\"max_inflight_bytes\":" << max_inflight_bytes
+            << ",\"rejected\":" << rejected_ << "}";
+        return out.str();
+    }
+
+private:
+    template <typename T, typename L>
+    static bool acquire(std::atomic<T>& counter, T amount, L limit) {
+        T current = counter.load();
+        do {
+            if (current + amount > static_cast<T>(limit)) {
+                return false;
+            }
+        } while (!counter.compare_exchange_weak(current, current + amount));
+        return true;
+    }
+
+    std::atomic<int> connections_;
+    std::atomic<int> pending_jobs_;
+    std::atomic<uint64_t> inflight_bytes_;
+    std::atomic<uint64_t> rejected_;
+};
@@ -1,6 +1,6 @@
 from flask import Flask, request, redirect, url_for, send_file, render_template
 import os
-import socket
+import threading
 import time
 import client  # Make sure client.py is in the same directory as app.py
 
@@ -8,6 +8,22 @@ app = Flask(__name__)
 app.config['UPLOAD_FOLDER'] = 'uploads'
 os.makedirs(app.config['UPLOAD_FOLDER'], exist_ok=True)
 
+# Replies on the connection come in request order, so each exchange holds the lock
+server_lock = threading.Lock()
+server_connection = None
+
+def get_server_connection():
+    global server_connection
+    if server_connection is None:
+        server_connection = client.JobConnection()
+    return server_connection
+
+def drop_server_connection():
+    global server_connection
+    if server_connection is not None:
+        server_connection.close()
+        server_connection = None
+
 @app.route('/')
 def index():
     return render_template('index.html')
@@ -34,31 +50,32 @@ def upload_file():
                     wav_paths.append(wav_path)
                     txt_paths.append(txt_path)
 
-        # Create a socket and connect to the server
-        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        try:
-            sock.connect((client.SERVER_IP, client.PORT))
-        except Exception as e:
-            return f"Connection failed: {e}"
-
-        # Send each pair of files
-        for wav_path, txt_path in zip(wav_paths, txt_paths):
-            if client.send_file(sock, wav_path) == -1:
-                return f"Error sending WAV file: {wav_path}"
-            if client.send_file(sock, txt_path) == -1:
-                return f"Error sending TXT file: {txt_path}"
-
-        client.send_end_of_job(sock)
+        # Jobs of all requests share one warm connection to the server
+        with server_lock:
+            connection = get_server_connection()
+            try:
+                job_id = connection.open_job()
+                for wav_path, txt_path in zip(wav_paths, txt_paths):
+                    connection.put_file(job_id, "wav", wav_path)
+                    connection.put_file(job_id, "txt", txt_path)
+                connection.submit(job_id)
+            except (OSError, RuntimeError):
+                drop_server_connection()
+                raise
 
         # Wait for server to process
+        output_path = os.path.join(app.config['UPLOAD_FOLDER'], f"done_{job_id}.wav")
         while True:
-            time.sleep(5)
-            if client.ask_server_job_status(sock):
-                client.receive_done_wav(sock)
-                break
+            time.sleep(1)
+            with server_lock:
+                state = get_server_connection().status(job_id)
+                if state == "done":
+                    get_server_connection().fetch(job_id, output_path)
+                    break
+            if state in ("failed", "cancelled"):
+                return f"Job {state}."
 
-        sock.close()
-        return send_file('done.wav', as_attachment=True)
+        return send_file(output_path, as_attachment=True)
 
     except Exception as e:
         return f"Error processing files: {e}"
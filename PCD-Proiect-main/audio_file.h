@@ -0,0 +1,142 @@
+// Sound files read through libsndfile into the float render pipeline: WAV (16/24/32-bit,
+// float), FLAC and whatever else libsndfile decodes, at the file's own resolution.
+// The file bytes go through AsyncFile (async_io.h): read ahead while decoding, written
+// behind while rendering.
+
+#pragma once
+
+#include <sndfile.h>
+#include <algorithm>
+#include <string>
+#include "async_io.h"
+#include "sample_convert.h"
+#include "sample_pool.h"
+
+// libsndfile virtual I/O over an AsyncFile
+class AsyncSoundFile {
+public:
+    // mode is SFM_READ or SFM_WRITE; nullptr if the file cannot be opened or is not a sound file
+    SNDFILE* open(const std::string& path, int mode, SF_INFO* info) {
+        if (!file_.open(path, mode == SFM_WRITE ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY)) return nullptr;
+        static SF_VIRTUAL_IO io = {&get_filelen, &seek, &read, &write, &tell};
+        SNDFILE* sound = sf_open_virtual(&io, mode, info, &file_);
+        if (!sound) file_.close();
+        return sound;
+    }
+
+    void detach() { file_.detach(); }
+
+    // After sf_close; false if some of the data did not reach the file
+    bool close() { return file_.close(); }
+
+private:
+    static sf_count_t get_filelen(void* file) { return static_cast<AsyncFile*>(file)->size(); }
+
+    static sf_count_t seek(sf_count_t offset, int whence, void* file) {
+        AsyncFile* async = static_cast<AsyncFile*>(file);
+        sf_count_t base = whence == SEEK_CUR ? async->tell() : whence == SEEK_END ? async->size() : 0;
+        if (base + offset < 0) return -1;
+        async->seek(base + offset);
+        return base + offset;
+    }
+
+    static sf_count_t read(void* out, sf_count_t count, void* file) {
+        return static_cast<AsyncFile*>(file)->read(static_cast<char*>(out), count);
+    }
+
+    static sf_count_t write(const void* data, sf_count_t count, void* file) {
+        return static_cast<AsyncFile*>(file)->write(static_cast<const char*>(data), count) ? count : 0;
+    }
+
+    static sf_count_t tell(void* file) { return static_cast<AsyncFile*>(file)->tell(); }
+
+    AsyncFile file_;
+};
+
+// Decodes a sound file block by block
+class AudioReader {
+public:
+    AudioReader() : channels(0), sample_rate(0), frames(0), file_(nullptr), pcm16_(false) {}
+    ~AudioReader() { close(); }
+
+    AudioReader(const AudioReader&) = delete;
+    AudioReader& operator=(const AudioReader&) = delete;
+
+    unsigned int channels;
+    unsigned int sample_rate;
+    uint64_t frames;
+
+    bool open(const std::string& path) {
+        close();
+        SF_INFO info = {};
+        file_ = io_.open(path, SFM_READ, &info);
+        if (!file_) return false;
+        channels = info.channels;
+        sample_rate = info.samplerate;
+        frames = info.frames;
+        pcm16_ = (info.format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_16;
+        return channels > 0;
+    }
+
+    // Decodes up to max_frames more frames into out; 0 at the end.
+    // 16-bit files are converted here (SSE2), the rest by libsndfile
+    std::size_t read(float* out, std::size_t max_frames) {
+        sf_count_t n;
+        if (pcm16_) {
+            pcm_.resize(max_frames * channels);
+            n = sf_readf_short(file_, pcm_.data(), max_frames);
+            if (n > 0) int16_to_float(pcm_.data(), out, n * channels);
+        } else {
+            n = sf_readf_float(file_, out, max_frames);
+        }
+        return n > 0 ? static_cast<std::size_t>(n) : 0;
+    }
+
+    // Same, replacing the contents of a buffer
+    std::size_t read(PooledSamples<float>& out, std::size_t max_frames) {
+        out.resize(max_frames * channels);
+        std::size_t got = read(out.data(), max_frames);
+        out.resize(got * channels);
+        return got;
+    }
+
+    // Lets another thread decode the rest (see AsyncFile::detach)
+    void detach() { io_.detach(); }
+
+    void close() {
+        if (file_) sf_close(file_);
+        file_ = nullptr;
+        io_.close();
+    }
+
+private:
+    SNDFILE* file_;
+    AsyncSoundFile io_;
+    bool pcm16_;
+    PooledSamples<int16_t> pcm_;
+};
+
+// A whole sound file in memory
+struct AudioFile {
+    unsigned int channels = 0;
+    unsigned int sample_rate = 0;
+    PooledSamples<float> samples;  // interleaved, full scale +-1.0
+
+    std::size_t frames() const { return channels ? samples.size() / channels : 0; }
+
+    bool load(const std::string& path) {
+        AudioReader reader;
+        if (!reader.open(path)) return false;
+        channels = reader.channels;
+        sample_rate = reader.sample_rate;
+        samples.resize(reader.frames * channels);
+        const std::size_t BLOCK_FRAMES = 16384;
+        std::size_t got = 0, n;
+        while (got < reader.frames &&
+               (n = reader.read(samples.data() + got * channels, std::min<std::size_t>(BLOCK_FRAMES, reader.frames - got))) > 0) {
+            got += n;
+        }
+        samples.resize(got * channels);
+        return true;
+    }
+};
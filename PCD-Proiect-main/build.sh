@@ -1,8 +1,13 @@
-g++-9 -o client client.cpp
+g++-9 -o client client.cpp -pthread
 g++-9 -o clientUNIX clientUNIX.cpp
-g++-9 -o mixer mixer.cpp -lsfml-audio -lsndfile
-g++-9 -o sequencer sequencer.cpp -lsfml-audio -lsndfile
+g++-9 -O2 -o mixer mixer.cpp -lsndfile -pthread
+g++-9 -O2 -o sequencer sequencer.cpp -lsndfile -pthread
 g++-9 -o server server.cpp -pthread
-g++-9 -o serverUNIX serverUNIX.cpp -pthread
+g++-9 -o serverUNIX serverUNIX.cpp -pthread -lsndfile
 g++-9 -o worker worker.cpp -pthread
+g++-9 -O2 -o render_node render_node.cpp -pthread
+g++-9 -O2 -o render_bench render_bench.cpp
+g++-9 -O2 -o stretch_bench stretch_bench.cpp
+g++-9 -O2 -o io_bench io_bench.cpp -pthread
+g++-9 -O2 -o slice_memo_test slice_memo_test.cpp -lsndfile -pthread
 echo build done
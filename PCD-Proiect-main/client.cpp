@@ -1,4 +1,4 @@
-// g++-9 -o client client.cpp
+// g++-9 -o client client.cpp -pthread
 
 #include <iostream>
 #include <cstring>
@@ -8,273 +8,681 @@
 #include <thread>
 #include <chrono>
 #include <vector>
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <poll.h>
+#include <sys/stat.h>
+#include "crc32c.h"
 
 const int PORT = 8080;
 const std::string SERVER_IP = "127.0.0.1";
+const uint64_t CHUNK_SIZE = 1024 * 1024; // upload chunk, each with its own CRC32C
+const uint64_t PIPELINE_BYTES = 8 * 1024 * 1024; // chunks sent ahead of their ACKs in manifest mode
+const int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+const int WAIT_TIMEOUT_MS = 30000; // each WAIT; the client asks again until the job is finished
 
+// Returns 0, or the delay in ms the server asked for when it is too busy to take the request
 int get_ack(int socket) {
     char ack_buffer[1024] = {0};
-    recv(socket, ack_buffer, sizeof(ack_buffer), 0);
+    recv(socket, ack_buffer, sizeof(ack_buffer) - 1, 0);
     std::cout << "Server: " << ack_buffer << "\n";
+    const char* busy = strstr(ack_buffer, "BUSY retry_after_ms=");
+    if (busy == ack_buffer) {
+        return std::max(1, atoi(busy + strlen("BUSY retry_after_ms=")));
+    }
     return 0;
 }
 
-int send_file(int socket, const std::string& file_path) {
-    std::ifstream file_stream(file_path, std::ios::binary | std::ios::ate);
-    if (!file_stream.is_open()) {
-        std::cerr << "Error opening file: " << file_path << std::endl;
-        return -1;
-    }
-
-    std::streamsize file_size = file_stream.tellg();
-    file_stream.seekg(0, std::ios::beg);
+// Exponential backoff with jitter, never shorter than the server's hint
+void back_off(int retry_after_ms, int attempt) {
+    static std::mt19937 rng(std::random_device{}());
+    int delay = std::min(30000, std::max(retry_after_ms, 250 << std::min(attempt, 7)));
+    delay += std::uniform_int_distribution<int>(0, delay / 4)(rng);
+    std::cout << "Server busy, retrying in " << delay << " ms..." << std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+}
 
-    // Send the file size first
-    uint32_t size_to_send = htonl(file_size);
-    send(socket, &size_to_send, sizeof(size_to_send), 0);
+// Connects, backing off while the server refuses new connections
+int connect_to_server() {
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
 
-    if (get_ack(socket) != 0) {
-        std::cerr << "Error receiving acknowledgement of " << file_path << " size.\n";
+    if (inet_pton(AF_INET, SERVER_IP.c_str(), &serv_addr.sin_addr) <= 0) {
+        std::cerr << "Invalid address/ Address not supported" << std::endl;
         return -1;
     }
 
-    char buffer[1024];
-    while (file_stream.read(buffer, sizeof(buffer))) {
-        send(socket, buffer, file_stream.gcount(), 0);
-    }
-    if (file_stream.gcount() > 0) {
-        send(socket, buffer, file_stream.gcount(), 0);
-    }
+    for (int attempt = 0; ; ++attempt) {
+        int sock;
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            std::cerr << "Socket creation error" << std::endl;
+            return -1;
+        }
 
-    if (get_ack(socket) != 0) {
-        std::cerr << "Error receiving acknowledgement of " << file_path << " file.\n";
-        return -1;
+        if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+            std::cerr << "Connection Failed" << std::endl;
+            close(sock);
+            return -1;
+        }
+
+        // The server only speaks first when it turns the connection away
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) {
+            return sock;
+        }
+        int retry_after_ms = get_ack(sock);
+        close(sock);
+        if (retry_after_ms == 0) {
+            std::cerr << "Connection closed by server" << std::endl;
+            return -1;
+        }
+        back_off(retry_after_ms, attempt);
     }
-    file_stream.close();
-    return 0;
 }
 
-void send_end_of_job(int socket) {
-    uint32_t end_signal = 0;
-    send(socket, &end_signal, sizeof(end_signal), 0);
-    get_ack(socket);
-}
 
-bool ask_server_job_status(int socket) {
-    std::string status_request = "CHECK_DONE";
-    send(socket, status_request.c_str(), status_request.size(), 0);
+// One connection speaking the tagged protocol (see serverUNIX.cpp); it is replaced when it drops
+struct ServerConnection {
+    int socket = -1;
+    std::string buffered;
 
-    char response_buffer[1024] = {0};
-    recv(socket, response_buffer, sizeof(response_buffer), 0);
-    std::string response = response_buffer;
+    bool connect() {
+        if (socket >= 0) {
+            close(socket);
+        }
+        buffered.clear();
+        socket = connect_to_server();
+        return socket >= 0;
+    }
 
-    std::cout << "Server response to CHECK_DONE: " << response << std::endl;
+    bool read_line(std::string& line) {
+        size_t end;
+        while ((end = buffered.find('\n')) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        line = buffered.substr(0, end);
+        buffered.erase(0, end + 1);
+        return true;
+    }
 
-    if (response.find("Job ready.") != std::string::npos) {
+    bool read_bytes(char* out, size_t size) {
+        while (buffered.size() < size) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        memcpy(out, buffered.data(), size);
+        buffered.erase(0, size);
         return true;
-    } else {
-        return false;
     }
-}
-int send_ack(int socket) {
-    uint32_t ack = htonl(0); // ACK value (you can adjust if you have specific ACK values)
-    ssize_t bytes_sent = send(socket, &ack, sizeof(ack), 0);
-    if (bytes_sent != sizeof(ack)) {
-        std::cerr << "Error sending ACK.\n";
-        return -1;
+
+private:
+    bool fill() {
+        char chunk[64 * 1024];
+        ssize_t n = recv(socket, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            return false;
+        }
+        buffered.append(chunk, n);
+        return true;
     }
-    std::cout << "Sending ack: " << ack << "\n";
-    return 0;
-}
+};
 
+bool send_all(int socket, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(socket, data, size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
 
+// Sends a command (and its payload) and returns the words of the reply, asking again while
+// the server is busy; empty when the connection is lost
+std::vector<std::string> request(ServerConnection& server, const std::string& command, const char* payload = nullptr, size_t size = 0) {
+    for (int attempt = 0; ; ++attempt) {
+        std::string line = command + "\n";
+        std::vector<std::string> reply;
+        if (!send_all(server.socket, line.data(), line.size()) || (size > 0 && !send_all(server.socket, payload, size)) ||
+            !server.read_line(line)) {
+            return reply;
+        }
+        std::istringstream words(line);
+        std::string word;
+        while (words >> word) {
+            reply.push_back(word);
+        }
+        if (reply.empty() || reply[0] != "BUSY") {
+            if (!reply.empty() && reply[0] == "ERROR") {
+                std::cerr << "Server: " << line << std::endl;
+            }
+            return reply;
+        }
+        const char* hint = strstr(line.c_str(), "retry_after_ms=");
+        back_off(hint ? atoi(hint + strlen("retry_after_ms=")) : 0, attempt);
+    }
+}
 
+// Steps return 0 when done, 1 when the connection was lost (run again on a new one) and -1 on errors
+const int STEP_DONE = 0;
+const int STEP_RETRY = 1;
+const int STEP_FAILED = -1;
+const int MAX_RECONNECTS = 20;
+
+template <typename Step>
+bool with_reconnect(ServerConnection& server, Step step) {
+    for (int attempt = 0; attempt < MAX_RECONNECTS; ++attempt) {
+        int result = step();
+        if (result != STEP_RETRY) {
+            return result == STEP_DONE;
+        }
+        int delay = std::min(30000, 250 << std::min(attempt, 7));
+        std::cerr << "Connection lost, reconnecting in " << delay << " ms..." << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+        server.connect();
+    }
+    std::cerr << "Giving up after " << MAX_RECONNECTS << " reconnects." << std::endl;
+    return false;
+}
 
+// Uploads a file in checksummed chunks, starting where the server's copy stops (all of it
+// for a new file, the unacknowledged rest after a dropped connection)
+int upload_file(ServerConnection& server, const std::string& job_id, const std::string& kind, const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return STEP_FAILED;
+    }
+    uint64_t size = file.tellg();
+    std::vector<std::string> reply = request(server, "UPLOAD " + job_id + " " + kind + " " + std::to_string(size));
+    if (reply.empty()) {
+        return STEP_RETRY;
+    }
+    if (reply[0] != "OFFSET" || reply.size() < 3) {
+        return STEP_FAILED;
+    }
+    uint64_t offset = std::stoull(reply[2]);
+    if (offset > 0) {
+        std::cout << "Resuming " << path << " at byte " << offset << " of " << size << std::endl;
+    }
+    std::vector<char> chunk;
+    int rejected = 0;
+    while (offset < size) {
+        size_t n = std::min<uint64_t>(CHUNK_SIZE, size - offset);
+        chunk.resize(n);
+        if (!file.seekg(offset) || !file.read(chunk.data(), n)) {
+            std::cerr << "Error reading " << path << std::endl;
+            return STEP_FAILED;
+        }
+        std::string command = "CHUNK " + job_id + " " + std::to_string(offset) + " " + std::to_string(n) + " " +
+                              crc32c_hex(crc32c(chunk.data(), n));
+        reply = request(server, command, chunk.data(), n);
+        if (reply.empty()) {
+            return STEP_RETRY;
+        }
+        if (reply[0] == "ACK" || reply[0] == "STORED") {
+            offset += n;
+            rejected = 0;
+        } else if (reply.size() > 4 && reply[2] == "expected") {
+            // "ERROR <id> expected offset <n>": carry on from the server's copy
+            offset = std::stoull(reply[4]);
+        } else if (reply.size() > 2 && (reply[2] == "crc" || reply[2] == "write") && ++rejected < 5) {
+            // Damaged on the way (or not written): the same chunk again
+        } else {
+            return STEP_FAILED;
+        }
+    }
+    std::cout << "Sent " << path << " (" << size << " bytes)" << std::endl;
+    return STEP_DONE;
+}
 
+// Like upload_file, but keeps up to PIPELINE_BYTES of chunks in flight instead of waiting for
+// each ACK. After a refused chunk the replies in flight are drained (the server refuses the
+// chunks after it too) and the upload continues from the offset UPLOAD reports, unless the
+// server found the file itself invalid
+int upload_file_pipelined(ServerConnection& server, const std::string& job_id, const std::string& kind,
+                          const std::string& path, std::atomic<uint64_t>& uploaded) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return STEP_FAILED;
+    }
+    uint64_t size = file.tellg();
+    std::vector<char> chunk;
+    for (int rejected = 0; rejected < 5; ++rejected) {
+        std::vector<std::string> reply = request(server, "UPLOAD " + job_id + " " + kind + " " + std::to_string(size));
+        if (reply.empty()) {
+            return STEP_RETRY;
+        }
+        if (reply[0] != "OFFSET" || reply.size() < 3) {
+            return STEP_FAILED;
+        }
+        uint64_t offset = std::stoull(reply[2]);
+        uint64_t next = offset;
+        std::deque<uint64_t> in_flight;  // lengths of the chunks sent and not answered yet
+        uint64_t in_flight_bytes = 0;
+        bool refused = false, invalid = false;
+        while (offset < size && !(refused && in_flight.empty())) {
+            while (!refused && next < size && in_flight_bytes < PIPELINE_BYTES) {
+                uint64_t n = std::min<uint64_t>(CHUNK_SIZE, size - next);
+                chunk.resize(n);
+                if (!file.seekg(next) || !file.read(chunk.data(), n)) {
+                    std::cerr << "Error reading " << path << std::endl;
+                    return STEP_FAILED;
+                }
+                std::string command = "CHUNK " + job_id + " " + std::to_string(next) + " " + std::to_string(n) + " " +
+                                      crc32c_hex(crc32c(chunk.data(), n)) + "\n";
+                if (!send_all(server.socket, command.data(), command.size()) || !send_all(server.socket, chunk.data(), n)) {
+                    return STEP_RETRY;
+                }
+                in_flight.push_back(n);
+                in_flight_bytes += n;
+                next += n;
+            }
+            std::string line;
+            if (!server.read_line(line)) {
+                return STEP_RETRY;
+            }
+            uint64_t n = in_flight.front();
+            in_flight.pop_front();
+            in_flight_bytes -= n;
+            if (line.compare(0, 4, "ACK ") == 0 || line.compare(0, 7, "STORED ") == 0) {
+                offset += n;
+                uploaded += n;
+            } else if (!refused) {
+                std::cerr << "Server: " << line << std::endl;
+                refused = true;
+                // "ERROR <id> invalid <kind>: ...": the file itself was rejected, sending it again will not help
+                invalid = line.find(" invalid ") != std::string::npos;
+            }
+        }
+        if (!refused) {
+            return STEP_DONE;
+        }
+        if (invalid) {
+            return STEP_FAILED;
+        }
+    }
+    return STEP_FAILED;
+}
 
-void receive_done_wav(int socket) {
-    // Tell server that you want file first
-    if (send_ack(socket) != 0) {
-        std::cerr << "Error sending acknowledgement for file size.\n";
-        return;
+// Downloads the result into <output>.<job>.part, continuing a partial download, and renames it
+// once complete; a damaged chunk ends the connection and the download resumes before it
+int fetch_result(ServerConnection& server, const std::string& job_id, const std::string& output_path) {
+    std::string partial = output_path + "." + job_id + ".part";
+    struct stat info;
+    uint64_t offset = stat(partial.c_str(), &info) == 0 ? info.st_size : 0;
+    std::vector<std::string> reply = request(server, "FETCH " + job_id + " " + std::to_string(offset));
+    if (reply.empty()) {
+        return STEP_RETRY;
+    }
+    if (reply.size() > 2 && reply[0] == "ERROR" && reply[2] == "range") {
+        std::remove(partial.c_str());  // left from a different result
+        return STEP_RETRY;
+    }
+    if (reply[0] != "RANGE" || reply.size() < 6) {
+        return STEP_FAILED;
     }
-    // Receive the file size
-    std::cout << "Receiving done.wav size...\n";
-    uint32_t file_size;
-    ssize_t bytes_received = recv(socket, &file_size, sizeof(file_size), 0);
-    if (bytes_received != sizeof(file_size)) {
-        std::cerr << "Error receiving done.wav size.\n";
-        return;
+    uint64_t size = std::stoull(reply[3]);
+    uint64_t length = std::stoull(reply[5]);
+    if (offset > 0) {
+        std::cout << "Resuming " << output_path << " at byte " << offset << " of " << size << std::endl;
+    }
+    std::ofstream out(partial, std::ios::binary | std::ios::app);
+    std::vector<char> buffer;
+    uint64_t received = 0;
+    while (received < length) {
+        std::string line, tag, crc_text;
+        size_t n = 0;
+        uint32_t crc;
+        if (!server.read_line(line)) {
+            return STEP_RETRY;
+        }
+        std::istringstream frame(line);
+        if (!(frame >> tag >> n >> crc_text) || tag != "DATA" || !parse_crc32c_hex(crc_text, crc)) {
+            std::cerr << "Unexpected reply: " << line << std::endl;
+            return STEP_RETRY;
+        }
+        buffer.resize(n);
+        if (!server.read_bytes(buffer.data(), n)) {
+            return STEP_RETRY;
+        }
+        if (crc32c(buffer.data(), n) != crc) {
+            std::cerr << "Damaged chunk at byte " << offset + received << ", fetching again from there" << std::endl;
+            close(server.socket);
+            server.socket = -1;
+            return STEP_RETRY;
+        }
+        out.write(buffer.data(), n);
+        out.flush();
+        received += n;
     }
-    std::cout << "Converting file size... " << std::endl;
-    file_size = ntohl(file_size); // ensure proper conversion
-    std::cout << "Received file size. " << file_size << std::endl;
+    out.close();
+    if (offset + received < size) {
+        return STEP_RETRY;
+    }
+    if (std::rename(partial.c_str(), output_path.c_str()) != 0) {
+        std::cerr << "Error renaming " << partial << std::endl;
+        return STEP_FAILED;
+    }
+    std::cout << "Received " << output_path << " (" << size << " bytes)" << std::endl;
+    return STEP_DONE;
+}
 
-    // Send acknowledgement for size
-    if (send_ack(socket) != 0) {
-        std::cerr << "Error sending acknowledgement for file size.\n";
-        return;
+// Asks for a path until the file is uploaded
+void upload_prompted(ServerConnection& server, const std::string& job_id, const std::string& kind, const std::string& prompt) {
+    while (true) {
+        std::string path;
+        std::cout << prompt;
+        std::getline(std::cin >> std::ws, path); // Read input with handling whitespace
+        if (with_reconnect(server, [&] { return upload_file(server, job_id, kind, path); })) {
+            return;
+        }
     }
+}
+
+bool open_job(ServerConnection& server, const std::string& options, std::string& job_id) {
+    return with_reconnect(server, [&] {
+        std::vector<std::string> reply = request(server, "OPEN" + options);
+        if (reply.empty()) return STEP_RETRY;
+        if (reply[0] != "JOB" || reply.size() < 2) return STEP_FAILED;
+        job_id = reply[1];
+        return STEP_DONE;
+    });
+}
 
-    std::ofstream done_wav("done.wav", std::ios::binary);
-    char buffer[1024];
-    size_t total_received = 0;
-    while (total_received < file_size) {
-        bytes_received = recv(socket, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                std::cerr << "Connection closed prematurely while receiving done.wav.\n";
+// Submits the job and waits until the server has finished it; its final state, or "uploading"
+// when it could not be submitted
+std::string submit_and_wait(ServerConnection& server, const std::string& job_id, bool verbose) {
+    // A SUBMIT whose reply was lost may already have queued the job
+    std::string state = "uploading";
+    bool submitted = with_reconnect(server, [&] {
+        std::vector<std::string> reply = request(server, "SUBMIT " + job_id);
+        if (reply.empty()) return STEP_RETRY;
+        if (reply[0] == "QUEUED") return STEP_DONE;
+        reply = request(server, "STATUS " + job_id);
+        if (reply.empty()) return STEP_RETRY;
+        return reply.size() > 2 && reply[2] != "uploading" ? STEP_DONE : STEP_FAILED;
+    });
+
+    // WAIT returns as soon as the job finishes; servers without it are polled with STATUS
+    bool can_wait = true;
+    while (submitted && state != "done" && state != "failed" && state != "cancelled") {
+        bool checked = with_reconnect(server, [&] {
+            std::vector<std::string> reply;
+            if (can_wait) {
+                reply = request(server, "WAIT " + job_id + " " + std::to_string(WAIT_TIMEOUT_MS));
+                if (reply.size() > 3 && reply[0] == "ERROR" && reply[2] == "unknown" && reply[3] == "command") {
+                    can_wait = false;
+                    return STEP_DONE;
+                }
             } else {
-                std::cerr << "Error receiving done.wav data.\n";
+                std::this_thread::sleep_for(std::chrono::seconds(5));
+                reply = request(server, "STATUS " + job_id);
             }
-            done_wav.close();
-            std::remove("done.wav"); // Delete partially received file
-            return;
+            if (reply.empty()) return STEP_RETRY;
+            if (reply.size() < 3) return STEP_FAILED;
+            state = reply[2];
+            return STEP_DONE;
+        });
+        if (!checked) {
+            break;
+        }
+        if (verbose) {
+            std::cout << "Job " << job_id << ": " << state << std::endl;
         }
-        done_wav.write(buffer, bytes_received);
-        total_received += bytes_received;
     }
-    done_wav.close();
-    std::cout << "Received done.wav file.\n";
+    return state;
+}
 
-    // Send acknowledgement for file
-    if (send_ack(socket) != 0) {
-        std::cerr << "Error sending acknowledgement for done.wav file.\n";
-        return;
+// Manifest mode (--manifest <file>): jobs are read from a file instead of prompts, and several
+// run at once, each on its own connection. The manifest holds
+//   job <name> [interactive|normal|batch] [flac] [pcm16|pcm24|float] [dither]
+//   <wav> <score>       a track of the job above, paths relative to the manifest
+// Lines starting with # are comments; tracks before the first job line form a job named
+// after the manifest. Results are saved as <output folder>/<name>.wav (or .flac)
+struct ManifestJob {
+    std::string name;
+    std::string options;  // OPEN options, after the client-wide ones
+    std::vector<std::pair<std::string, std::string>> tracks;
+};
+
+bool read_manifest(const std::string& path, std::vector<ManifestJob>& jobs) {
+    std::ifstream manifest(path);
+    if (!manifest) {
+        std::cerr << "Cannot read manifest " << path << std::endl;
+        return false;
+    }
+    std::string folder = path.find('/') == std::string::npos ? "" : path.substr(0, path.rfind('/') + 1);
+    std::string stem = path.substr(folder.size());
+    stem = stem.substr(0, stem.find('.'));
+    auto relative = [&](const std::string& file) { return file[0] == '/' ? file : folder + file; };
+    std::string line;
+    int line_number = 0;
+    while (std::getline(manifest, line)) {
+        ++line_number;
+        std::istringstream words(line);
+        std::string first, second, option;
+        if (!(words >> first) || first[0] == '#') {
+            continue;
+        }
+        if (first == "job") {
+            jobs.push_back(ManifestJob());
+            if (!(words >> jobs.back().name)) {
+                std::cerr << path << ":" << line_number << ": job without a name" << std::endl;
+                return false;
+            }
+            while (words >> option) {
+                jobs.back().options += " " + option;
+            }
+            continue;
+        }
+        if (!(words >> second)) {
+            std::cerr << path << ":" << line_number << ": expected <wav> <score>" << std::endl;
+            return false;
+        }
+        if (jobs.empty()) {
+            jobs.push_back(ManifestJob());
+            jobs.back().name = stem;
+        }
+        jobs.back().tracks.push_back({relative(first), relative(second)});
     }
+    for (const auto& job : jobs) {
+        if (job.tracks.empty()) {
+            std::cerr << path << ": job " << job.name << " has no tracks" << std::endl;
+            return false;
+        }
+    }
+    return true;
 }
 
+std::mutex log_mutex;
 
+void log_line(const std::string& line) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    std::cout << line << std::endl;
+}
 
-/*
-int main() { //debug main
-    int sock = 0;
-    struct sockaddr_in serv_addr;
-    int repeater;
-
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        std::cerr << "Socket creation error" << std::endl;
-        return -1;
+// Uploads, runs and downloads one manifest job on the connection; true once its result is saved
+bool run_manifest_job(ServerConnection& server, const ManifestJob& job, const std::string& options,
+                      const std::string& output_folder, std::atomic<uint64_t>& uploaded) {
+    std::string job_options = options + job.options;
+    std::string job_id;
+    if (!open_job(server, job_options, job_id)) {
+        return false;
     }
-
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-
-    if (inet_pton(AF_INET, SERVER_IP.c_str(), &serv_addr.sin_addr) <= 0) {
-        std::cerr << "Invalid address/ Address not supported" << std::endl;
-        return -1;
+    log_line("Job " + job.name + " is " + job_id + ", " + std::to_string(job.tracks.size()) + " tracks");
+    for (const auto& track : job.tracks) {
+        bool sent = with_reconnect(server, [&] { return upload_file_pipelined(server, job_id, "wav", track.first, uploaded); }) &&
+                    with_reconnect(server, [&] { return upload_file_pipelined(server, job_id, "txt", track.second, uploaded); });
+        if (!sent) {
+            log_line("Job " + job.name + ": upload of " + track.first + " failed");
+            return false;
+        }
+    }
+    std::string state = submit_and_wait(server, job_id, false);
+    if (state != "done") {
+        log_line("Job " + job.name + " (" + job_id + ") " + state);
+        return false;
+    }
+    bool flac = (" " + job_options + " ").find(" flac ") != std::string::npos;
+    std::string output_path = output_folder + "/" + job.name + (flac ? ".flac" : ".wav");
+    if (!with_reconnect(server, [&] { return fetch_result(server, job_id, output_path); })) {
+        return false;
     }
+    log_line("Job " + job.name + " (" + job_id + ") done: " + output_path);
+    return true;
+}
 
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        std::cerr << "Connection Failed" << std::endl;
+int run_manifest(const std::string& manifest_path, const std::string& options, int connections,
+                 const std::string& output_folder) {
+    std::vector<ManifestJob> jobs;
+    if (!read_manifest(manifest_path, jobs)) {
         return -1;
     }
+    mkdir(output_folder.c_str(), 0777);
+    std::atomic<uint64_t> uploaded(0);
+    std::atomic<std::size_t> next_job(0);
+    std::atomic<int> done(0), failed(0);
+    int running = 0;
+    std::mutex running_mutex;
+    std::condition_variable finished;
+    auto start = std::chrono::steady_clock::now();
+    auto seconds = [&] { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    connections = std::max(1, std::min<int>(connections, jobs.size()));
+    running = connections;  // threads still working
+    std::vector<std::thread> threads;
+    for (int c = 0; c < connections; ++c) {
+        threads.emplace_back([&] {
+            ServerConnection server;
+            std::size_t job;
+            while ((job = next_job++) < jobs.size()) {
+                if (server.socket < 0 && !server.connect()) {
+                    failed++;
+                    continue;
+                }
+                int buffer = SOCKET_BUFFER_SIZE;
+                setsockopt(server.socket, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+                setsockopt(server.socket, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+                (run_manifest_job(server, jobs[job], options, output_folder, uploaded) ? done : failed)++;
+            }
+            if (server.socket >= 0) {
+                close(server.socket);
+            }
+            std::lock_guard<std::mutex> lock(running_mutex);
+            running--;
+            finished.notify_one();
+        });
+    }
 
-    std::vector<std::string> wav_paths = {"./1/1/cymbals.wav", "./1/2/harp.wav"};
-    std::vector<std::string> txt_paths = {"./1/1/instructions.txt", "./1/2/instructions.txt"};
-
-    for (size_t i = 0; i < wav_paths.size(); ++i) {
-        repeater = 1;
-        while (repeater != 0) {
-            std::cout << "Input wav: " << wav_paths[i] << std::endl;
-            repeater = send_file(sock, wav_paths[i]);
+    // Aggregate progress once a second while uploads and jobs are running
+    uint64_t last_uploaded = 0;
+    std::unique_lock<std::mutex> lock(running_mutex);
+    while (running > 0) {
+        if (finished.wait_for(lock, std::chrono::seconds(1)) != std::cv_status::timeout) {
+            continue;
         }
-
-        repeater = 1;
-        while (repeater != 0) {
-            std::cout << "Input text: " << txt_paths[i] << std::endl;
-            repeater = send_file(sock, txt_paths[i]);
-        }
-
-        std::string add_another = (i < wav_paths.size() - 1) ? "y" : "n";
-        std::cout << "Add another sound? <y/n>: " << add_another << std::endl;
-        if (add_another != "y") {
-            send_end_of_job(sock);
-            break;
+        uint64_t now_uploaded = uploaded;
+        if (now_uploaded != last_uploaded) {
+            std::ostringstream progress;
+            progress << std::fixed << std::setprecision(1) << "Uploaded " << now_uploaded / 1048576.0 << " MB, "
+                     << now_uploaded / 1048576.0 / seconds() << " MB/s; jobs " << done << " done, " << failed
+                     << " failed of " << jobs.size();
+            log_line(progress.str());
+            last_uploaded = now_uploaded;
         }
     }
+    lock.unlock();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::ostringstream summary;
+    summary << std::fixed << std::setprecision(1) << done << " of " << jobs.size() << " jobs done, " << failed
+            << " failed; uploaded " << uploaded / 1048576.0 << " MB in " << seconds() << " s ("
+            << uploaded / 1048576.0 / seconds() << " MB/s) over " << connections << " connections";
+    log_line(summary.str());
+    return failed == 0 ? 0 : 1;
+}
 
-    // Wait for the server to mark the job as ready
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::seconds(5));
-        if (ask_server_job_status(sock)) {
-            receive_done_wav(sock);
-            break;
+int main(int argc, char* argv[]) { // main
+    // Optional scheduling class for every job sent from this client, --flac to get results as FLAC
+    // and --format <pcm16|pcm24|float> [--dither] for the sample format of the mix.
+    // --manifest <file> [--connections N] [--output folder] runs the jobs of a manifest instead
+    std::string options;
+    bool flac_result = false;
+    std::string manifest;
+    int connections = 4;
+    std::string output_folder = ".";
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--flac") {
+            flac_result = true;
+            options += " flac";
+        } else if (std::string(argv[i]) == "--format" && i + 1 < argc) {
+            options += std::string(" ") + argv[++i];
+        } else if (std::string(argv[i]) == "--dither") {
+            options += " dither";
+        } else if (std::string(argv[i]) == "--manifest" && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (std::string(argv[i]) == "--connections" && i + 1 < argc) {
+            connections = std::max(1, atoi(argv[++i]));
+        } else if (std::string(argv[i]) == "--output" && i + 1 < argc) {
+            output_folder = argv[++i];
         } else {
-            std::cout << "Server is still processing jobs. Waiting..." << std::endl;
+            options += std::string(" ") + argv[i];
         }
     }
+    if (!manifest.empty()) {
+        return run_manifest(manifest, options, connections, output_folder);
+    }
+    ServerConnection server;
+    if (!server.connect()) {
+        return -1;
+    }
 
-    close(sock);
-    return 0;
-}
-
-*/
-
-int main() { // main
+    // The connection stays open between songs. Uploads and downloads survive dropped
+    // connections: the client reconnects and continues from the last acknowledged byte
     int ask = 0;
     do {
-        int sock = 0;
-        struct sockaddr_in serv_addr;
-        int repeater;
-
-        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-            std::cerr << "Socket creation error" << std::endl;
-            return -1;
-        }
-
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(PORT);
-
-        if (inet_pton(AF_INET, SERVER_IP.c_str(), &serv_addr.sin_addr) <= 0) {
-            std::cerr << "Invalid address/ Address not supported" << std::endl;
-            return -1;
-        }
-
-        if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-            std::cerr << "Connection Failed" << std::endl;
+        std::string job_id;
+        if (!open_job(server, options, job_id)) {
             return -1;
         }
+        std::cout << "Job " << job_id << std::endl;
 
         while (true) {
-            std::string wav_path, txt_path;
-
-            repeater = 1;
-            while (repeater != 0) {
-                std::cout << "Input wav: ";
-                std::getline(std::cin >> std::ws, wav_path); // Read input with handling whitespace
-                repeater = send_file(sock, wav_path);
-            }
-
-            repeater = 1;
-            while (repeater != 0) {
-                std::cout << "Input text: ";
-                std::getline(std::cin >> std::ws, txt_path); // Read input with handling whitespace
-                repeater = send_file(sock, txt_path);
-            }
+            upload_prompted(server, job_id, "wav", "Input wav: ");
+            upload_prompted(server, job_id, "txt", "Input text: ");
 
             std::string add_another;
             std::cout << "Add another sound? <y/n>: ";
             std::getline(std::cin >> std::ws, add_another); // Read input with handling whitespace
             if (add_another != "y") {
-                send_end_of_job(sock);
                 break;
             }
         }
 
-        // Wait for the server to mark the job as ready
-        while (true) {
-            std::this_thread::sleep_for(std::chrono::seconds(5));
-            if (ask_server_job_status(sock)) {
-                receive_done_wav(sock);
-                break;
-            } else {
-                std::cout << "Server is still processing jobs. Waiting..." << std::endl;
-            }
+        // Wait for the server to finish the job
+        std::string state = submit_and_wait(server, job_id, true);
+        if (state == "done") {
+            std::string output_path = flac_result ? "done.flac" : "done.wav";
+            with_reconnect(server, [&] { return fetch_result(server, job_id, output_path); });
+        } else {
+            std::cerr << "Job was not completed by the server." << std::endl;
         }
 
-        close(sock);
-
         std::string nex;
         std::cout << "Process another song? <y/n>: ";
         std::getline(std::cin >> std::ws, nex); // Read input with handling whitespace
@@ -284,5 +692,6 @@ int main() { // main
 
     } while (ask == 0);
 
+    close(server.socket);
     return 0;
 }
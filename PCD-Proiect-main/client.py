@@ -2,22 +2,65 @@ import socket
 import os
 import struct
 import time
+import random
+import select
 
 PORT = 8080
 SERVER_IP = "127.0.0.1"
+LEGACY_SIZE_64 = 0xFFFFFFFF  # untagged size marker followed by an 8-byte size
+LEGACY_MAX_SIZE = 0x40000000
 
 def get_ack(sock):
     ack_buffer = sock.recv(1024).decode()
     print(f"Server: {ack_buffer}")
+    return ack_buffer
+
+def busy_retry_ms(reply):
+    """Delay asked for by a server too busy to take the request, or None."""
+    for token in reply.split():
+        if token.startswith("retry_after_ms="):
+            return int(token.split("=", 1)[1])
+    return None
+
+def back_off(retry_after_ms, attempt):
+    # Exponential backoff with jitter, never shorter than the server's hint
+    delay = min(30000, max(retry_after_ms, 250 << min(attempt, 7)))
+    delay += random.randint(0, delay // 4)
+    print(f"Server busy, retrying in {delay} ms...")
+    time.sleep(delay / 1000)
+
+def connect_to_server(server_ip=SERVER_IP, port=PORT):
+    attempt = 0
+    while True:
+        sock = socket.create_connection((server_ip, port))
+        # The server only speaks first when it turns the connection away
+        if not select.select([sock], [], [], 0.1)[0]:
+            return sock
+        reply = sock.recv(1024).decode()
+        sock.close()
+        if busy_retry_ms(reply) is None:
+            raise ConnectionError("Connection closed by server")
+        back_off(busy_retry_ms(reply), attempt)
+        attempt += 1
 
 def send_file(sock, file_path):
     try:
         file_size = os.path.getsize(file_path)
         with open(file_path, 'rb') as file:
-            # Send file size first
-            size_to_send = struct.pack('!I', file_size)
-            sock.send(size_to_send)
-            get_ack(sock)
+            # Send file size first; a busy server has not taken the file yet, so ask again later.
+            # From 1 GB on the size is a 0xFFFFFFFF marker and 8 bytes
+            if file_size < LEGACY_MAX_SIZE:
+                size_to_send = struct.pack('!I', file_size)
+            else:
+                size_to_send = struct.pack('!IQ', LEGACY_SIZE_64, file_size)
+            attempt = 0
+            while True:
+                sock.send(size_to_send)
+                reply = get_ack(sock)
+                if not reply.startswith("BUSY"):
+                    break
+                back_off(busy_retry_ms(reply), attempt)
+                attempt += 1
 
             # Send file contents in chunks
             while True:
@@ -44,6 +87,8 @@ def ask_server_job_status(sock):
     response = sock.recv(1024).decode()
     print(f"Server response to CHECK_DONE: {response}")
 
+    if "Job cancelled." in response or "Job failed." in response:
+        raise RuntimeError(response)
     return "Job ready." in response
 
 def send_ack(sock):
@@ -51,10 +96,21 @@ def send_ack(sock):
     sock.send(ack)
     print(f"Sending ack: {0}")
 
+def recv_exactly(sock, size):
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError("Connection closed")
+        data += chunk
+    return data
+
 def receive_done_wav(sock):
     send_ack(sock)
     print("Receiving done.wav size...")
-    file_size = struct.unpack('!I', sock.recv(4))[0]
+    file_size = struct.unpack('!I', recv_exactly(sock, 4))[0]
+    if file_size == LEGACY_SIZE_64:
+        file_size = struct.unpack('!Q', recv_exactly(sock, 8))[0]
     print(f"Received file size: {file_size}")
 
     send_ack(sock)
@@ -71,13 +127,68 @@ def receive_done_wav(sock):
     print("Received done.wav file.")
     send_ack(sock)
 
+class JobConnection:
+    """Tagged protocol: several jobs uploaded and collected over one long-lived connection."""
+
+    def __init__(self, server_ip=SERVER_IP, port=PORT):
+        self.sock = connect_to_server(server_ip, port)
+        self.reader = self.sock.makefile('rb')
+
+    def _request(self, command, payload=b""):
+        attempt = 0
+        while True:
+            self.sock.sendall(command.encode() + b"\n" + payload)
+            reply = self.reader.readline().decode().split()
+            if not reply or reply[0] != "BUSY":
+                break
+            back_off(busy_retry_ms(" ".join(reply)), attempt)
+            attempt += 1
+        if not reply or reply[0] == "ERROR":
+            raise RuntimeError(" ".join(reply) or "Connection closed")
+        return reply
+
+    def open_job(self, priority=None, flac=False, output_format=None, dither=False):
+        options = [priority] if priority else []
+        if flac:
+            options.append("flac")
+        if output_format:
+            options.append(output_format)  # pcm16, pcm24 or float
+        if dither:
+            options.append("dither")
+        return self._request(" ".join(["OPEN"] + options))[1]
+
+    def put_file(self, job_id, kind, file_path):
+        with open(file_path, 'rb') as file:
+            data = file.read()
+        self._request(f"PUT {job_id} {kind} {len(data)}", data)
+
+    def submit(self, job_id):
+        self._request(f"SUBMIT {job_id}")
+
+    def status(self, job_id):
+        return self._request(f"STATUS {job_id}")[2]
+
+    def fetch(self, job_id, output_path):
+        reply = self._request(f"FETCH {job_id}")
+        remaining = int(reply[3])
+        with open(output_path, 'wb') as file:
+            while remaining > 0:
+                chunk = self.reader.read(min(remaining, 65536))
+                if not chunk:
+                    raise RuntimeError("Connection closed")
+                file.write(chunk)
+                remaining -= len(chunk)
+        return reply[2]
+
+    def close(self):
+        self.reader.close()
+        self.sock.close()
+
 def main():
     ask = 0
     while ask == 0:
-        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-
         try:
-            sock.connect((SERVER_IP, PORT))
+            sock = connect_to_server()
         except Exception as e:
             print(f"Connection failed: {e}")
             return -1
@@ -5,22 +5,24 @@
 #include <cstring>
 
 const char *SOCKET_PATH = "/tmp/job_server_socket";
-const int BUFFER_SIZE = 1024;
+const int BUFFER_SIZE = 64 * 1024; // STATS replies can be larger than a plain LIST
 
 void send_command(int sock, const std::string& command) {
     send(sock, command.c_str(), command.size(), 0);
 }
 
 std::string receive_response(int sock) {
-    char buffer[BUFFER_SIZE] = {0};
+    static char buffer[BUFFER_SIZE];
     int valread = read(sock, buffer, BUFFER_SIZE);
+    if (valread <= 0) {
+        return "";
+    }
     return std::string(buffer, valread);
 }
 
 int main() {
     int sock = 0;
     struct sockaddr_un server_addr;
-    char buffer[BUFFER_SIZE] = {0};
 
     if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
         std::cerr << "Socket creation error\n";
@@ -40,8 +42,10 @@ int main() {
 
     while (true) {
         std::string command;
-        std::cout << "Enter command (LIST, RESTART, EXIT): ";
-        std::cin >> command;
+        std::cout << "Enter command (LIST, QUEUE, STATS [job id], PRIORITY <job id> <class>, PAUSE/RESUME/CANCEL <job id>, DRAIN, UNDRAIN, RESTART, EXIT): ";
+        if (!std::getline(std::cin >> std::ws, command)) {
+            break;
+        }
 
         send_command(sock, command);
 
@@ -0,0 +1,95 @@
+// Transport encoding for results: a small thread pool that runs libsndfile encodes
+// away from the socket and dispatcher threads.
+
+#pragma once
+
+#include <sndfile.h>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+class CodecPool {
+public:
+    void start(int threads) {
+        for (int i = 0; i < threads; ++i) {
+            std::thread codec_thread(&CodecPool::run, this);
+            codec_thread.detach();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push(task);
+        cond_.notify_one();
+    }
+
+private:
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return !tasks_.empty(); });
+                task = tasks_.front();
+                tasks_.pop();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::queue<std::function<void()>> tasks_;
+};
+
+inline bool is_flac_data(const char* data, size_t size) {
+    return size >= 4 && data[0] == 'f' && data[1] == 'L' && data[2] == 'a' && data[3] == 'C';
+}
+
+// Losslessly re-encodes any libsndfile-readable file as FLAC; the output appears atomically
+inline bool encode_flac(const std::string& source_path, const std::string& flac_path) {
+    SF_INFO in_info;
+    in_info.format = 0;
+    SNDFILE* in = sf_open(source_path.c_str(), SFM_READ, &in_info);
+    if (!in) {
+        std::cerr << "Failed to open " << source_path << " for encoding: " << sf_strerror(nullptr) << std::endl;
+        return false;
+    }
+
+    // FLAC stores 8, 16 or 24 bit integers; wider and float sources are kept at 24 bit
+    int subtype = in_info.format & SF_FORMAT_SUBMASK;
+    SF_INFO out_info = in_info;
+    out_info.format = SF_FORMAT_FLAC | (subtype == SF_FORMAT_PCM_16 ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24);
+    std::string tmp_path = flac_path + ".tmp";
+    SNDFILE* out = sf_open(tmp_path.c_str(), SFM_WRITE, &out_info);
+    if (!out) {
+        std::cerr << "Failed to create " << tmp_path << ": " << sf_strerror(nullptr) << std::endl;
+        sf_close(in);
+        return false;
+    }
+
+    const sf_count_t block_frames = 8192;
+    std::vector<int> block(block_frames * in_info.channels);
+    bool ok = true;
+    sf_count_t frames;
+    while ((frames = sf_readf_int(in, block.data(), block_frames)) > 0) {
+        if (sf_writef_int(out, block.data(), frames) != frames) {
+            std::cerr << "Failed to encode " << flac_path << ": " << sf_strerror(out) << std::endl;
+            ok = false;
+            break;
+        }
+    }
+    sf_close(in);
+    sf_close(out);
+    if (!ok || std::rename(tmp_path.c_str(), flac_path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+// Buffered reads from a client socket, so line commands and file data can arrive pipelined
+// in the same TCP segments without being lost between read() calls.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+class ConnectionReader {
+public:
+    ConnectionReader(int fd, std::atomic<uint64_t>* bytes_in) : fd_(fd), bytes_in_(bytes_in) {}
+
+    // Reads whatever the socket has into the buffer; false on disconnect or error
+    bool fill() {
+        char chunk[BUFFER_SIZE];
+        ssize_t n = read(fd_, chunk, sizeof(chunk));
+        if (n <= 0) {
+            return false;
+        }
+        if (bytes_in_) *bytes_in_ += n;
+        buffer_.append(chunk, n);
+        return true;
+    }
+
+    std::string& buffered() { return buffer_; }
+
+    // Next '\n'-terminated line without the terminator; false on disconnect or an overlong line
+    bool read_line(std::string& line) {
+        size_t end;
+        while ((end = buffer_.find('\n')) == std::string::npos) {
+            if (buffer_.size() > MAX_LINE || !fill()) {
+                return false;
+            }
+        }
+        line = buffer_.substr(0, end);
+        buffer_.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
+
+    // Up to size bytes, taken from the buffer first; 0 on disconnect
+    ssize_t read_some(char* out, size_t size) {
+        if (buffer_.empty()) {
+            ssize_t n = read(fd_, out, size);
+            if (n > 0 && bytes_in_) *bytes_in_ += n;
+            return n < 0 ? 0 : n;
+        }
+        size_t n = std::min(size, buffer_.size());
+        memcpy(out, buffer_.data(), n);
+        buffer_.erase(0, n);
+        return n;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 64 * 1024;
+    static const size_t MAX_LINE = 4096;
+
+    int fd_;
+    std::atomic<uint64_t>* bytes_in_;
+    std::string buffer_;
+};
@@ -0,0 +1,243 @@
+// Up-front memory estimate of a job, from the headers of its sounds and its instructions.
+// Mirrors how sequencer and mixer hold samples (32-bit float; sounds whole, sequenced tracks
+// as sparse regions), so the dispatcher can keep the jobs it runs together under a RAM budget.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "dsp_chain.h"
+
+struct AudioInfo {
+    uint64_t frames = 0;
+    unsigned int channels = 0;
+    unsigned int sample_rate = 0;
+};
+
+struct TrackEstimate {
+    AudioInfo input;
+    uint64_t output_samples = 0;  // length of the sequenced track, silence included
+    uint64_t content_samples = 0; // samples stored in its regions
+    uint64_t peak_bytes = 0;      // peak resident memory of the sequencer
+};
+
+struct JobEstimate {
+    std::vector<TrackEstimate> tracks;
+    uint64_t sequence_peak_bytes = 0;  // tracks sequenced at the same time by the worker
+    uint64_t mix_peak_bytes = 0;
+    uint64_t peak_bytes = 0;
+};
+
+class CostModel {
+public:
+    // Samples are rendered as floats whatever the file stores
+    static const uint64_t SAMPLE_BYTES = 4;
+    // Sounds are decoded once, straight into the float buffer
+    static const uint64_t LOADED_COPIES = 1;
+    // Resident size of a sequencer or mixer process before it loads any audio
+    static const uint64_t PROCESS_BASE_BYTES = 12 * 1024 * 1024;
+    // Output block buffers of the mixer
+    static const uint64_t MIX_BLOCK_BYTES = 4 * 1024 * 1024;
+    // Converted samples the mixer holds per track at most: LOOKAHEAD_SAMPLES ahead of the block
+    // being mixed, that block, and the region pieces being read (mixer.cpp)
+    static const uint64_t MIX_WINDOW_SAMPLES = 2 * 1024 * 1024;
+    // Sequencers the worker runs at once (MAX_ACTIVE_THREADS in worker.cpp)
+    static const int WORKER_SEQUENCERS = 3;
+
+    // Reads channels, rate and length from a RIFF/WAVE header
+    static bool read_wav_info(const std::string& path, AudioInfo& info) {
+        std::ifstream file(path, std::ios::binary);
+        char riff[12];
+        if (!file.read(riff, sizeof(riff)) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+            return false;
+        }
+        unsigned int block_align = 0;
+        char chunk[8];
+        while (file.read(chunk, sizeof(chunk))) {
+            uint32_t size = le32(chunk + 4);
+            if (memcmp(chunk, "fmt ", 4) == 0) {
+                char fmt[16];
+                if (size < sizeof(fmt) || !file.read(fmt, sizeof(fmt))) return false;
+                info.channels = le16(fmt + 2);
+                info.sample_rate = le32(fmt + 4);
+                block_align = le16(fmt + 12);
+                file.seekg(size - sizeof(fmt) + (size & 1), std::ios::cur);
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                if (block_align == 0 || info.channels == 0) return false;
+                info.frames = size / block_align;
+                return true;
+            } else {
+                file.seekg(size + (size & 1), std::ios::cur);
+            }
+        }
+        return false;
+    }
+
+    // Reads channels, rate and length from the STREAMINFO block of a FLAC file
+    static bool read_flac_info(const std::string& path, AudioInfo& info) {
+        std::ifstream file(path, std::ios::binary);
+        unsigned char header[8 + 34];
+        if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || memcmp(header, "fLaC", 4) != 0 ||
+            (header[4] & 0x7f) != 0) {
+            return false;
+        }
+        const unsigned char* s = header + 8;
+        info.sample_rate = (s[10] << 12) | (s[11] << 4) | (s[12] >> 4);
+        info.channels = ((s[12] >> 1) & 0x07) + 1;
+        info.frames = (static_cast<uint64_t>(s[13] & 0x0f) << 32) | (static_cast<uint64_t>(s[14]) << 24) |
+                      (s[15] << 16) | (s[16] << 8) | s[17];
+        return info.frames != 0;
+    }
+
+    // Replays the sequencer's slice and pitch arithmetic to size its output and peak memory
+    static TrackEstimate estimate_track(const AudioInfo& input, const std::string& instructions_path) {
+        TrackEstimate track;
+        track.input = input;
+        int64_t sample_count = input.frames * input.channels;
+        int64_t frame_count = input.frames;
+
+        std::ifstream file(instructions_path);
+        std::string line, error;
+        // Track lines apply to every event, wherever they are, so the events are sized afterwards
+        struct Event {
+            int frames_until_played;
+            int64_t start;
+            uint64_t length;
+            float pitch;
+            float volume;
+            dsp::Effects effects;
+        };
+        std::vector<Event> events;
+        dsp::Effects track_effects;
+        while (std::getline(file, line)) {
+            std::istringstream iss(line);
+            std::string first;
+            if (!(iss >> first)) {
+                continue;  // blank lines are not events
+            }
+            if (first == dsp::TRACK_KEYWORD) {
+                dsp::parse_effects(iss, track_effects, error);
+                continue;
+            }
+            iss.clear();
+            iss.seekg(0);
+            int frames_until_played = 0, start_ms = 0, end_ms = 0;
+            float pitch = 1, volume = 1;
+            iss >> frames_until_played >> pitch >> volume >> start_ms >> end_ms;
+            int64_t start = std::max<int64_t>(0, int64_t(start_ms) * input.sample_rate / 1000);
+            int64_t end = std::min(frame_count, frame_count - int64_t(end_ms) * input.sample_rate / 1000);
+            Event event = {frames_until_played, start, uint64_t(std::max<int64_t>(0, end - start)), pitch, volume, dsp::Effects()};
+            dsp::parse_effects(iss, event.effects, error);
+            events.push_back(event);
+        }
+        uint64_t stretch_bytes = 0;
+        // Occurrences of each distinct slice (SliceKey in sequencer.cpp), with its rendered samples
+        std::map<std::string, std::pair<int, uint64_t>> slices;
+        for (const Event& event : events) {
+            // Output frame k takes input frame k / pitch, so a slice shrinks when pitch < 1,
+            // unless it keeps its length (time_stretch.h)
+            uint64_t pitched = event.pitch > 0 ? std::min<uint64_t>(event.length, std::ceil(event.length * double(event.pitch))) : 0;
+            if (event.pitch > 0 && dsp::Effects::combine(track_effects, event.effects).pitch_mode != dsp::PitchMode::RESAMPLE) {
+                pitched = event.length;
+                // StretchCache holds the slice stretched to length / pitch frames, its window
+                // weights and a mono mix
+                stretch_bytes = std::max<uint64_t>(stretch_bytes, std::ceil(event.length / double(event.pitch)) *
+                                                                      (input.channels + 2) * SAMPLE_BYTES);
+            }
+            pitched *= input.channels;
+            track.output_samples += uint64_t(std::max(0, event.frames_until_played)) * input.channels + pitched;
+            track.content_samples += pitched;
+            if (pitched > 0) {
+                std::ostringstream key;
+                key.precision(9);
+                key << event.start << ' ' << event.length << ' ' << event.pitch << ' ' << event.volume << ' '
+                    << dsp::Effects::combine(track_effects, event.effects).key();
+                auto& slice = slices[key.str()];
+                slice.first++;
+                slice.second = pitched;
+            }
+        }
+        // Every slice that repeats is rendered once into the memo, which lives for the whole render
+        uint64_t repeated_slices = 0, largest_repeated = 0;
+        for (const auto& slice : slices) {
+            if (slice.second.first < 2) continue;
+            repeated_slices++;
+            largest_repeated = std::max(largest_repeated, slice.second.second * SAMPLE_BYTES);
+        }
+        uint64_t memo_bytes = repeated_slices * pool_block_bytes(largest_repeated);
+
+        // Slices are rendered into the regions, which grow through power-of-two pool blocks; the
+        // largest stretched slice is resident while it is pitched back, next to the memoized slices
+        track.peak_bytes = PROCESS_BASE_BYTES + LOADED_COPIES * sample_count * SAMPLE_BYTES +
+                           2 * track.content_samples * SAMPLE_BYTES + stretch_bytes + memo_bytes;
+        return track;
+    }
+
+    // Estimate for the tracks in <folder>/1 .. <folder>/<track_count>; sounds in known (read
+    // while they were uploaded) are not opened again
+    static JobEstimate estimate_job(const std::string& folder, int track_count,
+                                    const std::map<int, AudioInfo>& known = std::map<int, AudioInfo>()) {
+        JobEstimate job;
+        for (int i = 1; i <= track_count; ++i) {
+            std::string track_folder = folder + "/" + std::to_string(i);
+            auto sound = known.find(i);
+            AudioInfo info;
+            if (sound != known.end()) {
+                info = sound->second;
+            } else if (!read_wav_info(track_folder + "/sound.wav", info) && !read_flac_info(track_folder + "/sound.flac", info)) {
+                continue;
+            }
+            job.tracks.push_back(estimate_track(info, track_folder + "/instructions.txt"));
+        }
+        if (job.tracks.empty()) {
+            return job;
+        }
+
+        std::vector<uint64_t> peaks;
+        for (const auto& track : job.tracks) peaks.push_back(track.peak_bytes);
+        std::sort(peaks.rbegin(), peaks.rend());
+        for (std::size_t i = 0; i < peaks.size() && i < WORKER_SEQUENCERS; ++i) {
+            job.sequence_peak_bytes += peaks[i];
+        }
+
+        // The mixer converts everything to the format of whichever track it loads first; tracks
+        // are decoded and converted in pieces a bounded window ahead of the mix (a shorter track
+        // holds less), in pool blocks, and the output is mixed and written in blocks
+        for (const auto& target : job.tracks) {
+            uint64_t processed = 0;
+            for (const auto& track : job.tracks) {
+                double scale = double(target.input.sample_rate) / std::max(1u, track.input.sample_rate) *
+                               target.input.channels / std::max(1u, track.input.channels);
+                processed += 2 * std::min(uint64_t(track.content_samples * scale), MIX_WINDOW_SAMPLES) * SAMPLE_BYTES;
+            }
+            job.mix_peak_bytes = std::max(job.mix_peak_bytes, PROCESS_BASE_BYTES + processed + MIX_BLOCK_BYTES);
+        }
+        job.peak_bytes = std::max(job.sequence_peak_bytes, job.mix_peak_bytes);
+        return job;
+    }
+
+private:
+    // Size of the SamplePool block (sample_pool.h) that holds bytes: a power of two from 64 KB
+    static uint64_t pool_block_bytes(uint64_t bytes) {
+        uint64_t block = 64 * 1024;
+        while (block < bytes) block *= 2;
+        return bytes ? block : 0;
+    }
+
+    static uint32_t le32(const char* p) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        return u[0] | (u[1] << 8) | (u[2] << 16) | (uint32_t(u[3]) << 24);
+    }
+
+    static uint16_t le16(const char* p) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        return u[0] | (u[1] << 8);
+    }
+};
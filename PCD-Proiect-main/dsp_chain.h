@@ -0,0 +1,354 @@
+// Effects of a score (instructions.txt), applied by the sequencer to each slice right after it
+// is pitched, block by block while the block is still in cache.
+//
+// A score line is still the five numbers, optionally followed by effects as key=value:
+//   <frames until played> <pitch> <volume> <start ms> <end ms> [effect ...]
+// and a line starting with "track" sets effects for every event of the track:
+//   track pan=-0.3 highpass=80
+// Effects (times are milliseconds of the pitched event, from its first frame):
+//   fade_in=<ms>[:lin|exp]  fade_out=<ms>[:lin|exp]
+//   env=<ms>:<gain>,<ms>:<gain>,...     gain envelope, linear between points, held outside them
+//   pan=<-1..1>                         constant-power pan of stereo tracks; mono tracks ignore it
+//   lowpass=<Hz>[:q]  highpass=<Hz>[:q] RBJ biquads, q 0.7071 by default
+//   keep_length[=wsola|vocoder|off]     change pitch without changing length (time_stretch.h)
+// Track effects are defaults: an event's fade, envelope, pan or keep_length replaces the
+// track's, and its filters run after the track's. Each event runs filters, then one gain per
+// frame (fades times envelope), then pan. Events are processed on their own (filter state starts at zero and
+// tails end with the slice), so time regions of a score still render independently.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace dsp {
+
+// Frames of a slice rendered and processed at a time (16 KB of stereo float)
+const std::size_t BLOCK_FRAMES = 2048;
+// First word of a line holding track effects
+const char* const TRACK_KEYWORD = "track";
+// Steepness of exponential fades: gain (e^(kx) - 1) / (e^k - 1) over the fade's x = 0..1
+const double EXP_FADE_CURVE = 5.0;
+
+enum class FadeShape { LINEAR, EXPONENTIAL };
+
+struct Fade {
+    bool set = false;
+    double ms = 0;
+    FadeShape shape = FadeShape::LINEAR;
+};
+
+struct EnvelopePoint {
+    double ms;
+    float gain;
+};
+
+enum class FilterType { LOWPASS, HIGHPASS };
+
+// How pitch is changed: resampling (length changes with it, the original behaviour) or a
+// time stretch followed by resampling, which keeps the slice's length
+enum class PitchMode { RESAMPLE, WSOLA, VOCODER };
+
+struct FilterSpec {
+    FilterType type;
+    double frequency;
+    double q;
+};
+
+struct Effects {
+    Fade fade_in;
+    Fade fade_out;
+    bool has_pan = false;
+    float pan = 0;
+    std::vector<EnvelopePoint> envelope;  // sorted by time
+    std::vector<FilterSpec> filters;
+    bool has_pitch_mode = false;
+    PitchMode pitch_mode = PitchMode::RESAMPLE;
+
+    bool empty() const {
+        return !fade_in.set && !fade_out.set && !has_pan && envelope.empty() && filters.empty() && !has_pitch_mode;
+    }
+
+    // Equal for effects that process a slice the same way; empty when there are none
+    std::string key() const {
+        if (empty()) return "";
+        std::ostringstream out;
+        out.precision(17);
+        out << fade_in.set << ' ' << fade_in.ms << ' ' << int(fade_in.shape) << ' ' << fade_out.set << ' '
+            << fade_out.ms << ' ' << int(fade_out.shape) << ' ' << has_pan << ' ' << pan << ' '
+            << has_pitch_mode << ' ' << int(pitch_mode);
+        for (const EnvelopePoint& point : envelope) out << " e" << point.ms << ':' << point.gain;
+        for (const FilterSpec& filter : filters) out << " f" << int(filter.type) << ':' << filter.frequency << ':' << filter.q;
+        return out.str();
+    }
+
+    // Track defaults with an event's own effects on top
+    static Effects combine(const Effects& track, const Effects& event) {
+        Effects effects = track;
+        if (event.fade_in.set) effects.fade_in = event.fade_in;
+        if (event.fade_out.set) effects.fade_out = event.fade_out;
+        if (event.has_pan) {
+            effects.has_pan = true;
+            effects.pan = event.pan;
+        }
+        if (!event.envelope.empty()) effects.envelope = event.envelope;
+        if (event.has_pitch_mode) {
+            effects.has_pitch_mode = true;
+            effects.pitch_mode = event.pitch_mode;
+        }
+        effects.filters.insert(effects.filters.end(), event.filters.begin(), event.filters.end());
+        return effects;
+    }
+};
+
+// Whole-string number parse
+inline bool parse_number(const std::string& text, double& value) {
+    if (text.empty()) return false;
+    char* end = nullptr;
+    value = strtod(text.c_str(), &end);
+    return *end == '\0' && std::isfinite(value);
+}
+
+inline bool parse_fade(const std::string& value, Fade& fade) {
+    std::string::size_type colon = value.find(':');
+    std::string shape = colon == std::string::npos ? "lin" : value.substr(colon + 1);
+    if (!parse_number(value.substr(0, colon), fade.ms) || fade.ms < 0) return false;
+    if (shape != "lin" && shape != "exp") return false;
+    fade.shape = shape == "exp" ? FadeShape::EXPONENTIAL : FadeShape::LINEAR;
+    fade.set = true;
+    return true;
+}
+
+inline bool parse_envelope(const std::string& value, std::vector<EnvelopePoint>& envelope) {
+    envelope.clear();
+    std::string::size_type start = 0;
+    while (start <= value.size()) {
+        std::string::size_type comma = std::min(value.find(',', start), value.size());
+        std::string point = value.substr(start, comma - start);
+        std::string::size_type colon = point.find(':');
+        double ms, gain;
+        if (colon == std::string::npos || !parse_number(point.substr(0, colon), ms) ||
+            !parse_number(point.substr(colon + 1), gain) || ms < 0) {
+            return false;
+        }
+        envelope.push_back({ms, static_cast<float>(gain)});
+        start = comma + 1;
+    }
+    std::stable_sort(envelope.begin(), envelope.end(),
+                     [](const EnvelopePoint& a, const EnvelopePoint& b) { return a.ms < b.ms; });
+    return true;
+}
+
+inline bool parse_filter(FilterType type, const std::string& value, std::vector<FilterSpec>& filters) {
+    std::string::size_type colon = value.find(':');
+    FilterSpec filter = {type, 0, M_SQRT1_2};
+    if (!parse_number(value.substr(0, colon), filter.frequency) || filter.frequency <= 0) return false;
+    if (colon != std::string::npos && (!parse_number(value.substr(colon + 1), filter.q) || filter.q <= 0)) {
+        return false;
+    }
+    filters.push_back(filter);
+    return true;
+}
+
+// Reads key=value effects up to the end of a score line; false (with the offending token in
+// error) if one is unknown or malformed
+inline bool parse_effects(std::istream& in, Effects& effects, std::string& error) {
+    std::string token;
+    while (in >> token) {
+        std::string::size_type equals = token.find('=');
+        std::string key = token.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : token.substr(equals + 1);
+        double number = 0;
+        bool valid;
+        if (key == "fade_in") {
+            valid = parse_fade(value, effects.fade_in);
+        } else if (key == "fade_out") {
+            valid = parse_fade(value, effects.fade_out);
+        } else if (key == "env") {
+            valid = parse_envelope(value, effects.envelope);
+        } else if (key == "pan") {
+            valid = parse_number(value, number) && number >= -1 && number <= 1;
+            effects.has_pan = valid;
+            effects.pan = static_cast<float>(number);
+        } else if (key == "lowpass") {
+            valid = parse_filter(FilterType::LOWPASS, value, effects.filters);
+        } else if (key == "highpass") {
+            valid = parse_filter(FilterType::HIGHPASS, value, effects.filters);
+        } else if (key == "keep_length") {
+            valid = value.empty() || value == "wsola" || value == "vocoder" || value == "off";
+            effects.has_pitch_mode = valid;
+            effects.pitch_mode = value == "vocoder" ? PitchMode::VOCODER
+                                 : value == "off" ? PitchMode::RESAMPLE : PitchMode::WSOLA;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            error = "invalid effect " + token;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Second-order section, transposed direct form II; coefficients normalized by a0
+struct Biquad {
+    double b0, b1, b2, a1, a2;
+
+    // Audio EQ cookbook low/high pass at the given sample rate
+    static Biquad design(const FilterSpec& spec, unsigned int rate) {
+        double frequency = std::min(spec.frequency, 0.49 * rate);
+        double w0 = 2 * M_PI * frequency / rate;
+        double cosine = std::cos(w0);
+        double alpha = std::sin(w0) / (2 * spec.q);
+        double a0 = 1 + alpha;
+        Biquad filter;
+        if (spec.type == FilterType::LOWPASS) {
+            filter.b0 = filter.b2 = (1 - cosine) / 2 / a0;
+            filter.b1 = (1 - cosine) / a0;
+        } else {
+            filter.b0 = filter.b2 = (1 + cosine) / 2 / a0;
+            filter.b1 = -(1 + cosine) / a0;
+        }
+        filter.a1 = -2 * cosine / a0;
+        filter.a2 = (1 - alpha) / a0;
+        return filter;
+    }
+};
+
+// Scales interleaved frames by a gain per frame and a gain per channel. Compile-time channel
+// counts let the compiler vectorize the mono and stereo loops
+template <unsigned int CH>
+void apply_gains(float* block, std::size_t count, unsigned int channels, const float* frame_gains,
+                 const float* channel_gains) {
+    const unsigned int step = CH ? CH : channels;
+    for (std::size_t k = 0; k < count; ++k) {
+        for (unsigned int c = 0; c < step; ++c) block[k * step + c] *= frame_gains[k] * channel_gains[c];
+    }
+}
+
+// The effects of one event, applied to its frames block by block in order
+class EffectChain {
+public:
+    EffectChain(const Effects& effects, unsigned int channels, unsigned int rate, std::size_t frames)
+        : channels_(channels), frames_(frames), channel_gains_(channels, 1.0f) {
+        for (const FilterSpec& spec : effects.filters) filters_.push_back(Biquad::design(spec, rate));
+        state_.assign(filters_.size() * channels * 2, 0.0);
+
+        fade_in_ = effects.fade_in;
+        fade_out_ = effects.fade_out;
+        fade_in_frames_ = fade_in_.set ? static_cast<std::size_t>(fade_in_.ms * rate / 1000) : 0;
+        fade_out_frames_ = fade_out_.set ? static_cast<std::size_t>(fade_out_.ms * rate / 1000) : 0;
+        for (const EnvelopePoint& point : effects.envelope) {
+            envelope_.push_back({point.ms * rate / 1000, point.gain});
+        }
+        frame_gains_ = fade_in_frames_ > 0 || fade_out_frames_ > 0 || !envelope_.empty();
+
+        if (effects.has_pan && channels == 2) {
+            double angle = (effects.pan + 1) * M_PI / 4;
+            channel_gains_[0] = static_cast<float>(std::cos(angle));
+            channel_gains_[1] = static_cast<float>(std::sin(angle));
+            panned_ = true;
+        }
+    }
+
+    // False when the effects leave the event as it is, so it is rendered in one pass
+    bool active() const { return !filters_.empty() || frame_gains_ || panned_; }
+
+    // Processes frames [first, first + count) of the event, count <= BLOCK_FRAMES; blocks come
+    // in order, since filters carry their state from one block to the next
+    void process(float* block, std::size_t first, std::size_t count) {
+        for (std::size_t f = 0; f < filters_.size(); ++f) {
+            for (unsigned int c = 0; c < channels_; ++c) {
+                filter(filters_[f], &state_[(f * channels_ + c) * 2], block + c, count);
+            }
+        }
+        if (!frame_gains_ && !panned_) return;
+        fill_gains(first, count);
+        if (channels_ == 1) {
+            apply_gains<1>(block, count, channels_, gains_, channel_gains_.data());
+        } else if (channels_ == 2) {
+            apply_gains<2>(block, count, channels_, gains_, channel_gains_.data());
+        } else {
+            apply_gains<0>(block, count, channels_, gains_, channel_gains_.data());
+        }
+    }
+
+private:
+    // One channel of the block, in place
+    void filter(const Biquad& q, double* z, float* samples, std::size_t count) const {
+        double z1 = z[0], z2 = z[1];
+        for (std::size_t k = 0; k < count; ++k) {
+            double in = samples[k * channels_];
+            double out = q.b0 * in + z1;
+            z1 = q.b1 * in - q.a1 * out + z2;
+            z2 = q.b2 * in - q.a2 * out;
+            samples[k * channels_] = static_cast<float>(out);
+        }
+        z[0] = z1;
+        z[1] = z2;
+    }
+
+    static double fade_gain(const Fade& fade, double x) {
+        if (fade.shape == FadeShape::LINEAR) return x;
+        return std::expm1(EXP_FADE_CURVE * x) / std::expm1(EXP_FADE_CURVE);
+    }
+
+    // Gain of each frame of the block: fades times envelope
+    void fill_gains(std::size_t first, std::size_t count) {
+        std::fill(gains_, gains_ + count, 1.0f);
+        if (!envelope_.empty()) {
+            for (std::size_t k = 0; k < count; ++k) {
+                double position = static_cast<double>(first + k);
+                // Blocks and frames come in order, so the segment only moves forward
+                while (segment_ < envelope_.size() && envelope_[segment_].frame <= position) ++segment_;
+                if (segment_ == 0) {
+                    gains_[k] = envelope_.front().gain;
+                } else if (segment_ == envelope_.size()) {
+                    gains_[k] = envelope_.back().gain;
+                } else {
+                    const FramePoint& from = envelope_[segment_ - 1];
+                    const FramePoint& to = envelope_[segment_];
+                    double x = (position - from.frame) / (to.frame - from.frame);
+                    gains_[k] = static_cast<float>(from.gain + (to.gain - from.gain) * x);
+                }
+            }
+        }
+        for (std::size_t k = 0; k < count && first + k < fade_in_frames_; ++k) {
+            gains_[k] *= static_cast<float>(fade_gain(fade_in_, double(first + k) / fade_in_frames_));
+        }
+        if (fade_out_frames_ > 0 && first + count + fade_out_frames_ > frames_) {
+            std::size_t start = frames_ > fade_out_frames_ ? frames_ - fade_out_frames_ : 0;
+            for (std::size_t k = start > first ? start - first : 0; k < count; ++k) {
+                double remaining = double(frames_ - 1 - (first + k));
+                gains_[k] *= static_cast<float>(fade_gain(fade_out_, remaining / fade_out_frames_));
+            }
+        }
+    }
+
+    struct FramePoint {
+        double frame;
+        float gain;
+    };
+
+    unsigned int channels_;
+    std::size_t frames_;
+    std::vector<Biquad> filters_;
+    std::vector<double> state_;  // z1, z2 per filter and channel
+    Fade fade_in_;
+    Fade fade_out_;
+    std::size_t fade_in_frames_ = 0;
+    std::size_t fade_out_frames_ = 0;
+    std::vector<FramePoint> envelope_;
+    std::size_t segment_ = 0;
+    bool frame_gains_ = false;
+    bool panned_ = false;
+    std::vector<float> channel_gains_;
+    float gains_[BLOCK_FRAMES];
+};
+
+}  // namespace dsp
@@ -0,0 +1,102 @@
+// g++-9 -O2 -o io_bench io_bench.cpp -pthread
+// Job storage I/O under concurrent jobs: each job thread creates its folder, writes an upload
+// in 64 KB chunks (as receive_file does) and reads it back (as FETCH does), with a checksum
+// pass over every chunk standing in for the socket work. Compares blocking streams with
+// AsyncFile (async_io.h) on io_uring and on its blocking fallback.
+// ./io_bench [jobs, default 8] [MB per job, default 64] [folder, default io_bench_tmp]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "async_io.h"
+
+static const std::size_t CHUNK = 64 * 1024;
+
+enum Mode { BLOCKING, FALLBACK, URING };
+
+static uint64_t checksum(const char* data, std::size_t size) {
+    uint64_t sum = 0;
+    for (std::size_t i = 0; i < size; ++i) sum = sum * 31 + static_cast<unsigned char>(data[i]);
+    return sum;
+}
+
+static uint64_t run_job(Mode mode, const std::string& folder, std::size_t bytes) {
+    std::vector<char> chunk(CHUNK);
+    for (std::size_t i = 0; i < CHUNK; ++i) chunk[i] = static_cast<char>(i * 2654435761u >> 24);
+    std::string path = folder + "/sound.wav";
+    uint64_t sum = 0;
+    if (mode == BLOCKING) {
+        mkdir(folder.c_str(), 0777);
+        std::ofstream out(path, std::ios::binary);
+        for (std::size_t done = 0; done < bytes; done += CHUNK) {
+            sum += checksum(chunk.data(), CHUNK);
+            out.write(chunk.data(), CHUNK);
+        }
+        out.close();
+        std::ifstream in(path, std::ios::binary);
+        while (in.read(chunk.data(), CHUNK).gcount() > 0) sum += checksum(chunk.data(), in.gcount());
+    } else {
+        IoRing& io = IoRing::local();
+        io.wait(io.mkdir(folder.c_str(), 0777));
+        AsyncFile file;
+        file.open(path, O_WRONLY | O_CREAT | O_TRUNC);
+        for (std::size_t done = 0; done < bytes; done += CHUNK) {
+            sum += checksum(chunk.data(), CHUNK);
+            file.write(chunk.data(), CHUNK);
+        }
+        file.close();
+        file.open(path, O_RDONLY);
+        std::size_t n;
+        while ((n = file.read(chunk.data(), CHUNK)) > 0) sum += checksum(chunk.data(), n);
+        file.close();
+    }
+    unlink(path.c_str());
+    rmdir(folder.c_str());
+    return sum;
+}
+
+// Aggregate MB/s written and read back by all jobs
+static double run(Mode mode, int jobs, std::size_t bytes, const std::string& root) {
+    setenv("ASYNC_IO", mode == FALLBACK ? "off" : "on", 1);  // read by each new thread's ring
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int j = 0; j < jobs; ++j) {
+        threads.emplace_back([=] { run_job(mode, root + "/job_" + std::to_string(j), bytes); });
+    }
+    for (auto& thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return 2.0 * jobs * bytes / (1024 * 1024) / seconds;
+}
+
+int main(int argc, char* argv[]) {
+    int jobs = argc > 1 ? std::max(1, atoi(argv[1])) : 8;
+    std::size_t bytes = (argc > 2 ? std::max(1, atoi(argv[2])) : 64) * std::size_t(1024 * 1024);
+    std::string root = argc > 3 ? argv[3] : "io_bench_tmp";
+    mkdir(root.c_str(), 0777);
+
+    bool uring = false;
+    std::thread probe([&] { uring = IoRing::local().uring(); });
+    probe.join();
+
+    std::cout << jobs << " jobs x " << bytes / (1024 * 1024) << " MB, written and read back, MB/s" << std::endl;
+    const char* names[] = {"blocking streams", "AsyncFile fallback", "AsyncFile io_uring"};
+    for (int mode = BLOCKING; mode <= URING; ++mode) {
+        if (mode == URING && !uring) {
+            std::cout << std::left << std::setw(22) << names[mode] << "unavailable" << std::endl;
+            continue;
+        }
+        double best = 0;
+        for (int run_index = 0; run_index < 3; ++run_index) best = std::max(best, run(static_cast<Mode>(mode), jobs, bytes, root));
+        std::cout << std::left << std::setw(22) << names[mode] << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(8) << best << std::endl;
+    }
+    rmdir(root.c_str());
+    return 0;
+}
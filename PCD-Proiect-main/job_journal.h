@@ -0,0 +1,302 @@
+// Append-only write-ahead journal of job state transitions.
+// Records are text lines; a background thread writes and fsyncs them in batches and
+// periodically compacts the journal into one snapshot line per job (plus its track details).
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "job_registry.h"
+
+inline const char* job_state_token(JobState state) {
+    switch (state) {
+        case JOB_UPLOADING: return "uploading";
+        case JOB_QUEUED: return "queued";
+        case JOB_RUNNING: return "running";
+        case JOB_DONE: return "done";
+        case JOB_FAILED: return "failed";
+        case JOB_CANCELLED: return "cancelled";
+    }
+    return "unknown";
+}
+
+inline bool parse_job_state_token(const std::string& token, JobState& state) {
+    for (int s = JOB_UPLOADING; s <= JOB_CANCELLED; ++s) {
+        if (token == job_state_token(static_cast<JobState>(s))) {
+            state = static_cast<JobState>(s);
+            return true;
+        }
+    }
+    return false;
+}
+
+class JobJournal {
+public:
+    // Group commit window: records appended within it share one write and fsync
+    static const int FLUSH_INTERVAL_MS = 10;
+    // Rewrite the journal as a snapshot after this many records
+    static const int COMPACT_AFTER_RECORDS = 10000;
+
+    JobJournal() : fd_(-1), appended_(0), durable_(0), since_compaction_(0) {}
+
+    // Replays an existing journal into records; returns false if there was no journal yet
+    bool open(const std::string& path, std::map<std::string, JobRecord>& records) {
+        path_ = path;
+        bool existed = replay(path, records);
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ == -1) {
+            perror("Journal open failed");
+        }
+        return existed;
+    }
+
+    // Starts the flusher thread; snapshot provides the registry contents for compaction
+    void start(std::function<std::vector<JobRecord>()> snapshot) {
+        snapshot_ = snapshot;
+        std::thread flusher(&JobJournal::flush_loop, this);
+        flusher.detach();
+    }
+
+    // Queues one record; durable records return only once they are fsynced
+    void append(const std::string& record, bool durable = false) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        pending_ += record;
+        pending_ += '\n';
+        uint64_t sequence = ++appended_;
+        since_compaction_++;
+        cond_.notify_all();
+        if (durable) {
+            flushed_.wait(lock, [this, sequence] { return durable_ >= sequence || fd_ == -1; });
+        }
+    }
+
+    // Replaces the journal with one line per job; safe to call before start()
+    void compact(const std::vector<JobRecord>& records) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        compact_locked(records);
+    }
+
+    static std::string snapshot_line(const JobRecord& record) {
+        std::ostringstream line;
+        line << "JOB " << record.job_id << " " << record.folder << " " << job_state_token(record.state)
+             << " " << record.track_count << " " << record.bytes << " " << record.priority << " ";
+        if (record.completed_tracks.empty()) {
+            line << "-";
+        }
+        bool first = true;
+        for (int track : record.completed_tracks) {
+            line << (first ? "" : ",") << track;
+            first = false;
+        }
+        line << " " << (record.flac_result ? "flac" : "wav") << " " << record.result << " " << record.client;
+        // The JOB line ends with the client name, so track details follow as their own records
+        for (const auto& track : record.tracks) {
+            line << "\n" << sound_record(record.job_id, track.first, track.second) << "\n"
+                 << score_record(record.job_id, track.first, track.second);
+        }
+        return line.str();
+    }
+
+    static std::string sound_record(const std::string& job_id, int track, const TrackInfo& info) {
+        return "SOUND " + job_id + " " + std::to_string(track) + " " + std::to_string(info.sample_rate) + " " +
+               std::to_string(info.channels) + " " + std::to_string(info.frames) + " " + (info.flac ? "flac" : "wav");
+    }
+
+    static std::string score_record(const std::string& job_id, int track, const TrackInfo& info) {
+        return "SCORE " + job_id + " " + std::to_string(track) + " " + std::to_string(info.score_bytes) + " " +
+               std::to_string(info.events);
+    }
+
+private:
+    // Every record is idempotent, so replaying a record already covered by a snapshot is harmless
+    static bool replay(const std::string& path, std::map<std::string, JobRecord>& records) {
+        std::ifstream journal(path, std::ios::binary);
+        if (!journal.is_open()) {
+            return false;
+        }
+        std::string contents((std::istreambuf_iterator<char>(journal)), std::istreambuf_iterator<char>());
+        size_t start = 0;
+        size_t end;
+        while ((end = contents.find('\n', start)) != std::string::npos) {
+            apply(contents.substr(start, end - start), records);
+            start = end + 1;
+        }
+        // A trailing line without a newline is a torn write from a crash and is ignored
+        return true;
+    }
+
+    static void apply(const std::string& line, std::map<std::string, JobRecord>& records) {
+        std::istringstream in(line);
+        std::string op, job_id;
+        in >> op >> job_id;
+        if (job_id.empty()) {
+            return;
+        }
+        if (op == "JOB") {
+            JobRecord record;
+            std::string state, completed, encoding;
+            record.job_id = job_id;
+            in >> record.folder >> state >> record.track_count >> record.bytes >> record.priority >> completed
+               >> encoding >> record.result;
+            record.flac_result = encoding == "flac";
+            if (!in || !parse_job_state_token(state, record.state)) {
+                return;
+            }
+            std::istringstream tracks(completed);
+            std::string track;
+            while (std::getline(tracks, track, ',')) {
+                if (track != "-") record.completed_tracks.insert(atoi(track.c_str()));
+            }
+            std::getline(in >> std::ws, record.client);
+            records[job_id] = record;
+        } else if (op == "CREATE") {
+            JobRecord& record = records[job_id];
+            record.job_id = job_id;
+            in >> record.folder;
+        } else if (records.count(job_id) == 0) {
+            return; // record for a job that was already forgotten
+        } else if (op == "TRACK") {
+            int track = 0;
+            in >> track;
+            if (track > records[job_id].track_count) records[job_id].track_count = track;
+        } else if (op == "QUEUED") {
+            JobRecord& record = records[job_id];
+            in >> record.priority >> record.bytes;
+            std::getline(in >> std::ws, record.client);
+            record.state = JOB_QUEUED;
+        } else if (op == "STATE") {
+            std::string state;
+            in >> state;
+            parse_job_state_token(state, records[job_id].state);
+        } else if (op == "PRIORITY") {
+            in >> records[job_id].priority;
+        } else if (op == "TRACK_DONE") {
+            int track = 0;
+            if (in >> track) records[job_id].completed_tracks.insert(track);
+        } else if (op == "ENCODING") {
+            std::string encoding;
+            in >> encoding;
+            records[job_id].flac_result = encoding == "flac";
+        } else if (op == "SOUND") {
+            int track = 0;
+            TrackInfo sound;
+            std::string encoding;
+            if (in >> track >> sound.sample_rate >> sound.channels >> sound.frames >> encoding) {
+                TrackInfo& info = records[job_id].tracks[track];
+                info.sample_rate = sound.sample_rate;
+                info.channels = sound.channels;
+                info.frames = sound.frames;
+                info.flac = encoding == "flac";
+            }
+        } else if (op == "SCORE") {
+            int track = 0;
+            uint64_t bytes = 0;
+            int events = 0;
+            if (in >> track >> bytes >> events) {
+                records[job_id].tracks[track].score_bytes = bytes;
+                records[job_id].tracks[track].events = events;
+            }
+        } else if (op == "RESULT") {
+            in >> records[job_id].result;
+        } else if (op == "FORGET") {
+            records.erase(job_id);
+        }
+    }
+
+    void flush_loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cond_.wait(lock, [this] { return !pending_.empty(); });
+            // Let concurrent appends join this batch
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+            lock.lock();
+
+            std::string batch;
+            batch.swap(pending_);
+            uint64_t sequence = appended_;
+            if (since_compaction_ >= COMPACT_AFTER_RECORDS && snapshot_) {
+                // The snapshot already reflects every record appended so far
+                compact_locked(snapshot_());
+            } else {
+                lock.unlock();
+                write_all(batch);
+                if (fd_ != -1) fdatasync(fd_);
+                lock.lock();
+            }
+            durable_ = sequence;
+            flushed_.notify_all();
+        }
+    }
+
+    void write_all(const std::string& data) {
+        size_t written = 0;
+        while (fd_ != -1 && written < data.size()) {
+            ssize_t n = write(fd_, data.data() + written, data.size() - written);
+            if (n <= 0) {
+                perror("Journal write failed");
+                return;
+            }
+            written += n;
+        }
+    }
+
+    void compact_locked(const std::vector<JobRecord>& records) {
+        std::string tmp_path = path_ + ".tmp";
+        int tmp_fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (tmp_fd == -1) {
+            perror("Journal compaction failed");
+            return;
+        }
+        std::string contents;
+        for (const auto& record : records) {
+            contents += snapshot_line(record) + "\n";
+        }
+        int old_fd = fd_;
+        fd_ = tmp_fd;
+        write_all(contents);
+        fsync(tmp_fd);
+        if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+            perror("Journal rename failed");
+            close(tmp_fd);
+            fd_ = old_fd;
+            return;
+        }
+        // Make the rename itself durable
+        std::string directory = path_.substr(0, path_.find_last_of('/') + 1);
+        int dir_fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        if (old_fd != -1) close(old_fd);
+        close(tmp_fd);
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        pending_.clear();
+        since_compaction_ = 0;
+    }
+
+    std::string path_;
+    int fd_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable flushed_;
+    std::string pending_;
+    uint64_t appended_;
+    uint64_t durable_;
+    int since_compaction_;
+    std::function<std::vector<JobRecord>()> snapshot_;
+};
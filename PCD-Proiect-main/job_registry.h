@@ -0,0 +1,258 @@
+// In-memory job registry: the single source of truth for job state, indexed by job id.
+// Sharded so uploads, dispatchers and admin commands on different jobs do not share a lock.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum JobState {
+    JOB_UPLOADING,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED
+};
+
+inline const char* job_state_name(JobState state) {
+    switch (state) {
+        case JOB_UPLOADING: return "Unsubmitted";
+        case JOB_QUEUED: return "In Processing Queue";
+        case JOB_RUNNING: return "Running";
+        case JOB_DONE: return "DONE";
+        case JOB_FAILED: return "Failed";
+        case JOB_CANCELLED: return "Cancelled";
+    }
+    return "Unknown";
+}
+
+// States a job does not leave
+inline bool job_state_final(JobState state) {
+    return state == JOB_DONE || state == JOB_FAILED || state == JOB_CANCELLED;
+}
+
+// Explicit state machine; anything not listed here is rejected by JobRegistry::transition
+inline bool job_transition_allowed(JobState from, JobState to) {
+    switch (from) {
+        case JOB_UPLOADING: return to == JOB_QUEUED || to == JOB_CANCELLED;
+        case JOB_QUEUED: return to == JOB_RUNNING || to == JOB_CANCELLED;
+        case JOB_RUNNING: return to == JOB_DONE || to == JOB_FAILED || to == JOB_CANCELLED || to == JOB_QUEUED;
+        default: return false;
+    }
+}
+
+// A track's sound and score as read while they were uploaded (upload_check.h)
+struct TrackInfo {
+    unsigned int sample_rate = 0;
+    unsigned int channels = 0;
+    uint64_t frames = 0;      // 0 when a FLAC stream does not say
+    bool flac = false;
+    uint64_t score_bytes = 0;
+    int events = 0;           // score lines that play a slice
+};
+
+struct JobRecord {
+    std::string job_id;
+    std::string folder;
+    JobState state = JOB_UPLOADING;
+    int track_count = 0;  // track subfolders 1..track_count have been allocated
+    uint64_t bytes = 0;   // bytes uploaded so far
+    std::string client;   // scheduling details, kept so queued jobs can be restored
+    int priority = 1;
+    std::set<int> completed_tracks; // tracks already sequenced by an interrupted worker
+    bool flac_result = false;             // client asked for the result as FLAC
+    std::string result = "done.wav";      // file in the job folder delivered to the client
+    std::map<int, TrackInfo> tracks;      // by track number, once their uploads were checked
+    std::chrono::steady_clock::time_point finished;  // when it reached a final state (or was restored in one)
+};
+
+class JobRegistry {
+public:
+    static const int SHARDS = 16;
+
+    // Registers a new job in the UPLOADING state; false if the id is already taken
+    bool create(const std::string& job_id, const std::string& folder) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.jobs.count(job_id)) return false;
+        JobRecord& record = shard.jobs[job_id];
+        record.job_id = job_id;
+        record.folder = folder;
+        return true;
+    }
+
+    // Inserts a record as-is, used when restoring state at startup
+    void restore(const JobRecord& record) {
+        Shard& shard = shard_for(record.job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        JobRecord& restored = shard.jobs[record.job_id] = record;
+        restored.finished = std::chrono::steady_clock::now();
+    }
+
+    // Called with the job id and state each time a job reaches a final state; set once at startup
+    void on_final(std::function<void(const std::string&, JobState)> listener) {
+        final_listener_ = listener;
+    }
+
+    bool transition(const std::string& job_id, JobState from, JobState to) {
+        {
+            Shard& shard = shard_for(job_id);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.jobs.find(job_id);
+            if (it == shard.jobs.end() || it->second.state != from || !job_transition_allowed(from, to)) {
+                return false;
+            }
+            it->second.state = to;
+            if (!job_state_final(to)) {
+                return true;
+            }
+            it->second.finished = std::chrono::steady_clock::now();
+        }
+        // Outside the shard lock, so the listener may read the registry
+        if (final_listener_) final_listener_(job_id, to);
+        return true;
+    }
+
+    // Removes the jobs that have been done, failed or cancelled for at least retention and
+    // returns them
+    std::vector<JobRecord> expire_finished(std::chrono::seconds retention) {
+        std::vector<JobRecord> expired;
+        auto deadline = std::chrono::steady_clock::now() - retention;
+        for (int i = 0; i < SHARDS; ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            for (auto it = shards_[i].jobs.begin(); it != shards_[i].jobs.end();) {
+                if (job_state_final(it->second.state) && it->second.finished <= deadline) {
+                    expired.push_back(it->second);
+                    it = shards_[i].jobs.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        return expired;
+    }
+
+    // Allocates the next track number of a job (1, 2, ...); 0 if the job is unknown
+    int allocate_track(const std::string& job_id) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it == shard.jobs.end()) return 0;
+        return ++it->second.track_count;
+    }
+
+    void add_bytes(const std::string& job_id, uint64_t bytes) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it != shard.jobs.end()) it->second.bytes += bytes;
+    }
+
+    void set_sound_info(const std::string& job_id, int track, const TrackInfo& sound) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it == shard.jobs.end()) return;
+        TrackInfo& info = it->second.tracks[track];
+        info.sample_rate = sound.sample_rate;
+        info.channels = sound.channels;
+        info.frames = sound.frames;
+        info.flac = sound.flac;
+    }
+
+    void set_score_info(const std::string& job_id, int track, uint64_t bytes, int events) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it == shard.jobs.end()) return;
+        TrackInfo& info = it->second.tracks[track];
+        info.score_bytes = bytes;
+        info.events = events;
+    }
+
+    void set_scheduling(const std::string& job_id, const std::string& client, int priority) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it == shard.jobs.end()) return;
+        it->second.client = client;
+        it->second.priority = priority;
+    }
+
+    void track_completed(const std::string& job_id, int track) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it != shard.jobs.end()) it->second.completed_tracks.insert(track);
+    }
+
+    void set_flac_result(const std::string& job_id) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it != shard.jobs.end()) it->second.flac_result = true;
+    }
+
+    void set_result(const std::string& job_id, const std::string& result) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it != shard.jobs.end()) it->second.result = result;
+    }
+
+    void remove(const std::string& job_id) {
+        Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.jobs.erase(job_id);
+    }
+
+    bool get(const std::string& job_id, JobRecord& record) const {
+        const Shard& shard = shard_for(job_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(job_id);
+        if (it == shard.jobs.end()) return false;
+        record = it->second;
+        return true;
+    }
+
+    // Copy of every record, ordered by job id (ids are creation timestamps)
+    std::vector<JobRecord> snapshot() const {
+        std::vector<JobRecord> records;
+        for (int i = 0; i < SHARDS; ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            for (const auto& entry : shards_[i].jobs) {
+                records.push_back(entry.second);
+            }
+        }
+        std::sort(records.begin(), records.end(), [](const JobRecord& a, const JobRecord& b) {
+            return a.job_id.size() != b.job_id.size() ? a.job_id.size() < b.job_id.size() : a.job_id < b.job_id;
+        });
+        return records;
+    }
+
+private:
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, JobRecord> jobs;
+    };
+
+    Shard& shard_for(const std::string& job_id) {
+        return shards_[std::hash<std::string>()(job_id) % SHARDS];
+    }
+
+    const Shard& shard_for(const std::string& job_id) const {
+        return shards_[std::hash<std::string>()(job_id) % SHARDS];
+    }
+
+    Shard shards_[SHARDS];
+    std::function<void(const std::string&, JobState)> final_listener_;
+};
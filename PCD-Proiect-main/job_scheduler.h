@@ -0,0 +1,353 @@
+// Job dispatcher queue: strict priority classes with per-client deficit round robin
+// inside each class, plus pause/cancel/drain controls used by the admin socket.
+// Dispatched jobs hold their estimated peak memory until they finish; only jobs that fit
+// in what is left of the memory budget are dispatched.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+enum JobPriority {
+    PRIORITY_INTERACTIVE = 0,
+    PRIORITY_NORMAL = 1,
+    PRIORITY_BATCH = 2,
+    PRIORITY_CLASSES = 3
+};
+
+inline const char* priority_name(JobPriority priority) {
+    switch (priority) {
+        case PRIORITY_INTERACTIVE: return "interactive";
+        case PRIORITY_NORMAL: return "normal";
+        case PRIORITY_BATCH: return "batch";
+        default: return "unknown";
+    }
+}
+
+inline bool parse_priority(const std::string& name, JobPriority& priority) {
+    if (name == "interactive") priority = PRIORITY_INTERACTIVE;
+    else if (name == "normal") priority = PRIORITY_NORMAL;
+    else if (name == "batch") priority = PRIORITY_BATCH;
+    else return false;
+    return true;
+}
+
+struct ScheduledJob {
+    std::string job_id;
+    std::string folder;
+    std::string client;
+    JobPriority priority = PRIORITY_NORMAL;
+    uint64_t cost = 0; // the job's size in bytes (job_cost in serverUNIX), its share of the client's deficit
+    uint64_t memory = 0; // estimated peak memory of the job while it runs
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point promoted_at; // entered its current class, for aging
+};
+
+class JobScheduler {
+public:
+    // Each client may dispatch this many bytes of jobs per round of its class
+    static const uint64_t QUANTUM_BYTES = 4 * 1024 * 1024;
+    // Jobs waiting longer than this move up one class so batch work is never starved
+    static const int PROMOTE_AFTER_SECONDS = 120;
+
+    JobScheduler() : draining_(false), memory_budget_(0), memory_in_use_(0) {}
+
+    // Sum of the memory estimates of running jobs is kept under this; 0 means unlimited
+    void set_memory_budget(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        memory_budget_ = bytes;
+        cond_.notify_all();
+    }
+
+    // Called when a dispatched job stops running
+    void release_memory(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        memory_in_use_ -= std::min(bytes, memory_in_use_);
+        cond_.notify_all();
+    }
+
+    uint64_t memory_budget() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return memory_budget_;
+    }
+
+    uint64_t memory_in_use() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return memory_in_use_;
+    }
+
+    void submit(const ScheduledJob& job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ScheduledJob queued = job;
+        queued.submitted = queued.promoted_at = std::chrono::steady_clock::now();
+        enqueue(queued);
+        cond_.notify_one();
+    }
+
+    // Blocks until a job may be dispatched and removes it from the queue
+    ScheduledJob next() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ScheduledJob job;
+        while (true) {
+            promote_waiting_jobs();
+            if (!draining_ && pick(job)) {
+                memory_in_use_ += job.memory;
+                return job;
+            }
+            // Wake up periodically so aging promotions happen even without new submissions
+            cond_.wait_for(lock, std::chrono::seconds(PROMOTE_AFTER_SECONDS));
+        }
+    }
+
+    bool reprioritize(const std::string& job_id, JobPriority priority) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ScheduledJob job;
+        if (!remove(job_id, job)) return false;
+        job.priority = priority;
+        enqueue(job);
+        cond_.notify_one();
+        return true;
+    }
+
+    // Removes a queued job; returns false if it is not waiting in the queue
+    bool cancel(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ScheduledJob job;
+        paused_.erase(job_id);
+        return remove(job_id, job);
+    }
+
+    void pause(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_.insert(job_id);
+    }
+
+    void resume(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_.erase(job_id);
+        cond_.notify_all();
+    }
+
+    bool is_paused(const std::string& job_id) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return paused_.count(job_id) != 0;
+    }
+
+    bool contains(const std::string& job_id) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return locate(job_id) != nullptr;
+    }
+
+    // While draining, queued jobs stay queued and only running jobs finish
+    void set_draining(bool draining) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        draining_ = draining;
+        cond_.notify_all();
+    }
+
+    bool draining() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return draining_;
+    }
+
+    int size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int total = 0;
+        for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+            for (const auto& client : classes_[c].queues) {
+                total += client.second.size();
+            }
+        }
+        return total;
+    }
+
+    std::string describe() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        out << "Scheduler " << (draining_ ? "draining" : "running") << ", memory in use "
+            << memory_in_use_ / (1024 * 1024) << " MB";
+        if (memory_budget_) out << " of " << memory_budget_ / (1024 * 1024) << " MB";
+        out << ".\n";
+        for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+            for (const auto& client : classes_[c].queues) {
+                for (const auto& job : client.second) {
+                    out << "job ID:" << job.job_id << " class: " << priority_name(job.priority)
+                        << " client: " << job.client << " bytes: " << job.cost
+                        << " memory: " << job.memory / (1024 * 1024) << " MB"
+                        << (paused_.count(job.job_id) ? " (paused)" : "") << ".\n";
+                }
+            }
+        }
+        return out.str();
+    }
+
+private:
+    struct PriorityClass {
+        std::map<std::string, std::deque<ScheduledJob>> queues; // per client, in submission order
+        std::deque<std::string> round;                          // clients with queued jobs, in service order
+        std::map<std::string, uint64_t> deficit;
+        std::set<std::string> credited;                         // clients that got their quantum this visit
+    };
+
+    void enqueue(const ScheduledJob& job) {
+        PriorityClass& pc = classes_[job.priority];
+        std::deque<ScheduledJob>& queue = pc.queues[job.client];
+        if (queue.empty()) {
+            pc.round.push_back(job.client);
+        }
+        queue.push_back(job);
+    }
+
+    const ScheduledJob* locate(const std::string& job_id) const {
+        for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+            for (const auto& client : classes_[c].queues) {
+                for (const auto& job : client.second) {
+                    if (job.job_id == job_id) return &job;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    bool remove(const std::string& job_id, ScheduledJob& removed) {
+        for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+            PriorityClass& pc = classes_[c];
+            for (auto it = pc.queues.begin(); it != pc.queues.end(); ++it) {
+                for (auto job = it->second.begin(); job != it->second.end(); ++job) {
+                    if (job->job_id != job_id) continue;
+                    removed = *job;
+                    it->second.erase(job);
+                    if (it->second.empty()) {
+                        forget_client(pc, it->first);
+                        pc.queues.erase(it);
+                    }
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void forget_client(PriorityClass& pc, const std::string& client) {
+        for (auto it = pc.round.begin(); it != pc.round.end(); ++it) {
+            if (*it == client) {
+                pc.round.erase(it);
+                break;
+            }
+        }
+        pc.deficit.erase(client);
+        pc.credited.erase(client);
+    }
+
+    void promote_waiting_jobs() {
+        auto now = std::chrono::steady_clock::now();
+        for (int c = 1; c < PRIORITY_CLASSES; ++c) {
+            std::vector<std::string> promote;
+            for (const auto& client : classes_[c].queues) {
+                for (const auto& job : client.second) {
+                    if (now - job.promoted_at > std::chrono::seconds(PROMOTE_AFTER_SECONDS)) {
+                        promote.push_back(job.job_id);
+                    }
+                }
+            }
+            for (const auto& job_id : promote) {
+                ScheduledJob job;
+                if (remove(job_id, job)) {
+                    job.priority = static_cast<JobPriority>(c - 1);
+                    job.promoted_at = now;
+                    enqueue(job);
+                }
+            }
+        }
+    }
+
+    // A job that does not fit the budget waits; with nothing running any job fits, so a
+    // job larger than the whole budget still runs, alone
+    bool fits(const ScheduledJob& job) const {
+        return memory_budget_ == 0 || memory_in_use_ == 0 || memory_in_use_ + job.memory <= memory_budget_;
+    }
+
+    // Oldest waiting job that does not fit; once it has waited too long smaller jobs stop
+    // overtaking it, so the memory it needs drains
+    bool starved_job_waiting() const {
+        auto now = std::chrono::steady_clock::now();
+        for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+            for (const auto& client : classes_[c].queues) {
+                for (const auto& job : client.second) {
+                    if (!paused_.count(job.job_id) && !fits(job) &&
+                        now - job.submitted > std::chrono::seconds(2 * PROMOTE_AFTER_SECONDS)) {
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    // Highest class first; deficit round robin between the clients of that class
+    bool pick(ScheduledJob& picked) {
+        if (starved_job_waiting()) return false;
+        for (int c = 0; c < PRIORITY_CLASSES; ++c) {
+            if (pick_from_class(classes_[c], picked)) return true;
+        }
+        return false;
+    }
+
+    bool pick_from_class(PriorityClass& pc, ScheduledJob& picked) {
+        // Each pass over the round either dispatches or adds a quantum to every eligible client,
+        // so the loop ends once the cheapest eligible head job fits into its client's deficit.
+        while (true) {
+            bool eligible = false;
+            for (std::size_t visited = 0; visited < pc.round.size(); ++visited) {
+                const std::string client = pc.round.front();
+                std::deque<ScheduledJob>& queue = pc.queues[client];
+                auto job = queue.begin();
+                while (job != queue.end() && (paused_.count(job->job_id) || !fits(*job))) ++job;
+                if (job == queue.end()) {
+                    rotate(pc);
+                    continue;
+                }
+                eligible = true;
+                if (!pc.credited.count(client)) {
+                    pc.deficit[client] += QUANTUM_BYTES;
+                    pc.credited.insert(client);
+                }
+                if (job->cost <= pc.deficit[client]) {
+                    pc.deficit[client] -= job->cost;
+                    picked = *job;
+                    queue.erase(job);
+                    if (queue.empty()) {
+                        forget_client(pc, client);
+                        pc.queues.erase(client);
+                    }
+                    return true;
+                }
+                rotate(pc);
+            }
+            if (!eligible) return false;
+        }
+    }
+
+    void rotate(PriorityClass& pc) {
+        pc.credited.erase(pc.round.front());
+        pc.round.push_back(pc.round.front());
+        pc.round.pop_front();
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    PriorityClass classes_[PRIORITY_CLASSES];
+    std::set<std::string> paused_;
+    bool draining_;
+    uint64_t memory_budget_;
+    uint64_t memory_in_use_;
+};
@@ -0,0 +1,314 @@
+// Per-stage job timing and server counters, reported by the STATS admin command.
+// Header only so it can be used from serverUNIX.cpp without changing build.sh.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock stats_clock;
+
+inline int64_t monotonic_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(stats_clock::now().time_since_epoch()).count();
+}
+
+// Log-bucketed latency histogram: bucket i counts samples in [2^(i-1), 2^i) microseconds.
+class LatencyHistogram {
+public:
+    static const int BUCKETS = 40;
+
+    LatencyHistogram() : count_(0), sum_us_(0), max_us_(0) {
+        for (int i = 0; i < BUCKETS; ++i) buckets_[i] = 0;
+    }
+
+    void record(int64_t us) {
+        if (us < 0) us = 0;
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && (int64_t(1) << bucket) <= us) {
+            ++bucket;
+        }
+        buckets_[bucket]++;
+        count_++;
+        sum_us_ += us;
+        if (us > max_us_) max_us_ = us;
+    }
+
+    // Upper bound of the bucket holding the requested percentile, capped at the observed maximum
+    int64_t percentile(double p) const {
+        if (count_ == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(p * count_ + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += buckets_[i];
+            if (seen >= rank) {
+                int64_t upper = int64_t(1) << i;
+                return upper < max_us_ ? upper : max_us_;
+            }
+        }
+        return max_us_;
+    }
+
+    void to_json(std::ostringstream& out) const {
+        out << "{\"count\":" << count_
+            << ",\"mean_us\":" << (count_ ? sum_us_ / static_cast<int64_t>(count_) : 0)
+            << ",\"p50_us\":" << percentile(0.50)
+            << ",\"p95_us\":" << percentile(0.95)
+            << ",\"p99_us\":" << percentile(0.99)
+            << ",\"max_us\":" << max_us_ << "}";
+    }
+
+private:
+    uint64_t buckets_[BUCKETS];
+    uint64_t count_;
+    int64_t sum_us_;
+    int64_t max_us_;
+};
+
+// Monotonic timestamps (microseconds, 0 = not reached yet) for one job
+struct JobTimeline {
+    int64_t upload_start = 0;
+    int64_t upload_end = 0;
+    int64_t queued = 0;
+    int64_t dispatched = 0;
+    int64_t worker_end = 0;
+    int64_t delivery_start = 0;
+    int64_t delivery_end = 0;
+    int64_t mix_us = 0;
+    std::vector<std::pair<std::string, int64_t>> track_sequence_us;
+    // Memory estimated before dispatch against the peak RSS the worker measured, in KB
+    uint64_t estimate_sequence_kb = 0;
+    uint64_t estimate_mix_kb = 0;
+    uint64_t estimate_peak_kb = 0;
+    std::vector<uint64_t> track_estimate_kb;
+    std::vector<std::pair<std::string, uint64_t>> track_peak_rss_kb;
+    uint64_t mix_peak_rss_kb = 0;
+    uint64_t peak_rss_kb = 0;
+};
+
+class ServerStats {
+public:
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<int> queue_depth{0};
+    std::atomic<int> active_workers{0};
+    std::atomic<int> active_connections{0};
+    std::atomic<uint64_t> jobs_completed{0};
+    std::atomic<uint64_t> jobs_failed{0};
+
+    void upload_started(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        JobTimeline& t = jobs_[job_id];
+        if (t.upload_start == 0) t.upload_start = monotonic_us();
+    }
+
+    void job_queued(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        JobTimeline& t = jobs_[job_id];
+        int64_t now = monotonic_us();
+        t.upload_end = now;
+        t.queued = now;
+        if (t.upload_start != 0) upload_.record(t.upload_end - t.upload_start);
+    }
+
+    void job_dispatched(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        JobTimeline& t = jobs_[job_id];
+        t.dispatched = monotonic_us();
+        if (t.queued != 0) queue_wait_.record(t.dispatched - t.queued);
+    }
+
+    void track_sequenced(const std::string& job_id, const std::string& track, int64_t us) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_[job_id].track_sequence_us.emplace_back(track, us);
+        sequence_.record(us);
+    }
+
+    void job_mixed(const std::string& job_id, int64_t us) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_[job_id].mix_us = us;
+        mix_.record(us);
+    }
+
+    void memory_estimated(const std::string& job_id, const std::vector<uint64_t>& track_kb, uint64_t sequence_kb,
+                          uint64_t mix_kb, uint64_t peak_kb) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        JobTimeline& t = jobs_[job_id];
+        t.track_estimate_kb = track_kb;
+        t.estimate_sequence_kb = sequence_kb;
+        t.estimate_mix_kb = mix_kb;
+        t.estimate_peak_kb = peak_kb;
+    }
+
+    void track_peak_rss(const std::string& job_id, const std::string& track, uint64_t kb) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_[job_id].track_peak_rss_kb.emplace_back(track, kb);
+    }
+
+    // The mixer runs last, so its peak completes the job's measurement
+    void mix_peak_rss(const std::string& job_id, uint64_t kb, int concurrent_sequencers) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        JobTimeline& t = jobs_[job_id];
+        t.mix_peak_rss_kb = kb;
+        // Measured the same way as estimated: the largest sequencers together, or the mixer
+        std::vector<uint64_t> peaks;
+        for (const auto& track : t.track_peak_rss_kb) peaks.push_back(track.second);
+        std::sort(peaks.rbegin(), peaks.rend());
+        uint64_t sequence_kb = 0;
+        for (std::size_t i = 0; i < peaks.size() && i < static_cast<std::size_t>(concurrent_sequencers); ++i) {
+            sequence_kb += peaks[i];
+        }
+        t.peak_rss_kb = std::max(sequence_kb, kb);
+        if (t.estimate_peak_kb != 0) {
+            double ratio = static_cast<double>(t.peak_rss_kb) / t.estimate_peak_kb;
+            memory_jobs_++;
+            memory_ratio_sum_ += ratio;
+            memory_ratio_min_ = memory_jobs_ == 1 ? ratio : std::min(memory_ratio_min_, ratio);
+            memory_ratio_max_ = std::max(memory_ratio_max_, ratio);
+        }
+    }
+
+    void worker_finished(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        JobTimeline& t = jobs_[job_id];
+        t.worker_end = monotonic_us();
+        if (t.dispatched != 0) worker_.record(t.worker_end - t.dispatched);
+        // Keep finished timelines around for STATS <job id>, but bound the memory used
+        finished_.push_back(job_id);
+        if (finished_.size() > MAX_FINISHED_TIMELINES) {
+            jobs_.erase(finished_.front());
+            finished_.pop_front();
+        }
+    }
+
+    void delivery_started(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = jobs_.find(job_id);
+        if (it != jobs_.end()) it->second.delivery_start = monotonic_us();
+    }
+
+    void delivery_finished(const std::string& job_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = jobs_.find(job_id);
+        if (it == jobs_.end()) return;
+        JobTimeline& t = it->second;
+        t.delivery_end = monotonic_us();
+        if (t.delivery_start != 0) delivery_.record(t.delivery_end - t.delivery_start);
+        if (t.upload_start != 0) end_to_end_.record(t.delivery_end - t.upload_start);
+    }
+
+    void record_cache_lookup(const std::string& cache, bool hit) {
+        record_cache_lookups(cache, hit ? 1 : 0, hit ? 0 : 1);
+    }
+
+    // Lookups counted elsewhere (by a sequencer) and reported in one go
+    void record_cache_lookups(const std::string& cache, uint64_t hits, uint64_t misses) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::pair<uint64_t, uint64_t>& c = caches_[cache];
+        c.first += hits;
+        c.second += misses;
+    }
+
+    std::string to_json() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        out << "{\"queue_depth\":" << queue_depth.load()
+            << ",\"active_workers\":" << active_workers.load()
+            << ",\"active_connections\":" << active_connections.load()
+            << ",\"bytes_in\":" << bytes_in.load()
+            << ",\"bytes_out\":" << bytes_out.load()
+            << ",\"jobs_completed\":" << jobs_completed.load()
+            << ",\"jobs_failed\":" << jobs_failed.load()
+            << ",\"latency\":{";
+        out << "\"upload\":"; upload_.to_json(out);
+        out << ",\"queue_wait\":"; queue_wait_.to_json(out);
+        out << ",\"sequence_track\":"; sequence_.to_json(out);
+        out << ",\"mix\":"; mix_.to_json(out);
+        out << ",\"worker\":"; worker_.to_json(out);
+        out << ",\"delivery\":"; delivery_.to_json(out);
+        out << ",\"end_to_end\":"; end_to_end_.to_json(out);
+        out << "},\"memory_estimate\":{\"jobs\":" << memory_jobs_
+            << ",\"mean_actual_over_estimate\":" << (memory_jobs_ ? memory_ratio_sum_ / memory_jobs_ : 0.0)
+            << ",\"min_actual_over_estimate\":" << memory_ratio_min_
+            << ",\"max_actual_over_estimate\":" << memory_ratio_max_;
+        out << "},\"cache\":{";
+        bool first = true;
+        for (const auto& entry : caches_) {
+            uint64_t total = entry.second.first + entry.second.second;
+            out << (first ? "" : ",") << "\"" << entry.first << "\":{\"hits\":" << entry.second.first
+                << ",\"misses\":" << entry.second.second
+                << ",\"hit_rate\":" << (total ? static_cast<double>(entry.second.first) / total : 0.0) << "}";
+            first = false;
+        }
+        out << "}}";
+        return out.str();
+    }
+
+    // Timeline of a single job, relative to its upload start; returns an empty string for unknown jobs
+    std::string job_to_json(const std::string& job_id) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = jobs_.find(job_id);
+        if (it == jobs_.end()) return "";
+        const JobTimeline& t = it->second;
+        int64_t base = t.upload_start;
+        auto rel = [base](int64_t ts) { return ts == 0 ? -1 : ts - base; };
+        std::ostringstream out;
+        out << "{\"job_id\":\"" << job_id << "\""
+            << ",\"upload_start_us\":" << rel(t.upload_start)
+            << ",\"upload_end_us\":" << rel(t.upload_end)
+            << ",\"queued_us\":" << rel(t.queued)
+            << ",\"dispatched_us\":" << rel(t.dispatched)
+            << ",\"worker_end_us\":" << rel(t.worker_end)
+            << ",\"delivery_start_us\":" << rel(t.delivery_start)
+            << ",\"delivery_end_us\":" << rel(t.delivery_end)
+            << ",\"mix_us\":" << t.mix_us
+            << ",\"tracks\":[";
+        for (std::size_t i = 0; i < t.track_sequence_us.size(); ++i) {
+            out << (i ? "," : "") << "{\"track\":\"" << t.track_sequence_us[i].first
+                << "\",\"sequence_us\":" << t.track_sequence_us[i].second << "}";
+        }
+        out << "],\"memory_kb\":{\"estimate_peak\":" << t.estimate_peak_kb
+            << ",\"actual_peak\":" << t.peak_rss_kb
+            << ",\"estimate_sequence\":" << t.estimate_sequence_kb
+            << ",\"estimate_mix\":" << t.estimate_mix_kb
+            << ",\"actual_mix\":" << t.mix_peak_rss_kb
+            << ",\"estimate_tracks\":[";
+        for (std::size_t i = 0; i < t.track_estimate_kb.size(); ++i) {
+            out << (i ? "," : "") << t.track_estimate_kb[i];
+        }
+        out << "],\"actual_tracks\":[";
+        for (std::size_t i = 0; i < t.track_peak_rss_kb.size(); ++i) {
+            out << (i ? "," : "") << "{\"track\":\"" << t.track_peak_rss_kb[i].first
+                << "\",\"peak_rss\":" << t.track_peak_rss_kb[i].second << "}";
+        }
+        out << "]}}";
+        return out.str();
+    }
+
+private:
+    static const std::size_t MAX_FINISHED_TIMELINES = 1024;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, JobTimeline> jobs_;
+    std::deque<std::string> finished_;
+    std::map<std::string, std::pair<uint64_t, uint64_t>> caches_;
+    LatencyHistogram upload_;
+    LatencyHistogram queue_wait_;
+    LatencyHistogram sequence_;
+    LatencyHistogram mix_;
+    LatencyHistogram worker_;
+    LatencyHistogram delivery_;
+    LatencyHistogram end_to_end_;
+    uint64_t memory_jobs_ = 0;
+    double memory_ratio_sum_ = 0;
+    double memory_ratio_min_ = 0;
+    double memory_ratio_max_ = 0;
+};
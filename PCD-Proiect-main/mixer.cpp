@@ -1,137 +1,465 @@
 // sudo apt install libsndfile1-dev
-// g++-9 -o mixer mixer.cpp -lsfml-audio -lsndfile
+// g++-9 -O2 -o mixer mixer.cpp -lsndfile -pthread
 
-#include <SFML/Audio.hpp>
 #include <sndfile.h>
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "audio_file.h"
+#include "render_kernels.h"
+#include "sample_convert.h"
+#include "sample_pool.h"
+#include "sparse_track.h"
+#include "trace.h"
+#include "probes.h"
 
-// Function to resample audio data
-std::vector<sf::Int16> resample(const sf::Int16* samples, std::size_t sampleCount, unsigned int originalRate, unsigned int targetRate) {
-    std::vector<sf::Int16> resampledSamples;
-    double resampleRatio = static_cast<double>(originalRate) / targetRate;
-    std::size_t newSampleCount = static_cast<std::size_t>(sampleCount / resampleRatio);
-    resampledSamples.reserve(newSampleCount);
+// Frames decoded at a time from dense sound files, and the longest piece a sparse region is
+// read in; each becomes one region
+const std::size_t DECODE_FRAMES = 64 * 1024;
+// Output samples mixed and written at a time
+const std::size_t MIX_BLOCK = 256 * 1024;
+// How far ahead of the mix (output samples) loaders may convert a track; at least MIX_BLOCK
+const std::size_t LOOKAHEAD_SAMPLES = 4 * MIX_BLOCK;
 
-    for (std::size_t i = 0; i < newSampleCount; ++i) {
-        std::size_t originalIndex = static_cast<std::size_t>(i * resampleRatio);
-        resampledSamples.push_back(samples[originalIndex]);
+// One input, read region by region: a sparse track, or a dense sound file in blocks
+class TrackInput {
+public:
+    unsigned int channels = 0;
+    unsigned int sample_rate = 0;
+    uint64_t total_samples = 0;
+
+    // Reads the header only
+    bool open(const std::string& filename) {
+        sparse_ = SparseTrack::is_sparse_file(filename);
+        if (sparse_) {
+            if (!sparseReader_.open(filename)) return false;
+            channels = sparseReader_.channels;
+            sample_rate = sparseReader_.sample_rate;
+            total_samples = sparseReader_.total_samples;
+        } else {
+            if (!audioReader_.open(filename)) return false;
+            channels = audioReader_.channels;
+            sample_rate = audioReader_.sample_rate;
+            total_samples = audioReader_.frames * channels;
+        }
+        // The regions are read on a loader thread
+        sparseReader_.detach();
+        audioReader_.detach();
+        return channels > 0 && sample_rate > 0;
+    }
+
+    bool next(SparseRegion& region) {
+        if (sparse_) return sparseReader_.next(region, DECODE_FRAMES * channels);
+        region.start = position_;
+        if (audioReader_.read(region.samples, DECODE_FRAMES) == 0) return false;
+        position_ += region.samples.size();
+        return true;
+    }
+
+    bool ok() const { return !sparse_ || sparseReader_.ok(); }
+
+    // On the thread that read the regions, before it exits
+    void close() {
+        sparseReader_.close();
+        audioReader_.close();
+    }
+
+private:
+    bool sparse_ = false;
+    SparseTrackReader sparseReader_;
+    AudioReader audioReader_;
+    uint64_t position_ = 0;
+};
+
+// First output frame whose source frame (i * ratio) is at or after position
+std::size_t firstResampledAt(std::size_t position, double resampleRatio) {
+    std::size_t i = static_cast<std::size_t>(position / resampleRatio);
+    while (i > 0 && static_cast<std::size_t>((i - 1) * resampleRatio) >= position) --i;
+    while (static_cast<std::size_t>(i * resampleRatio) < position) ++i;
+    return i;
+}
+
+// Resamples and converts mono to stereo or vice versa in one pass, region by region.
+// Output frame i takes input frame i * ratio
+class TrackConverter {
+public:
+    // Picks the kernels for the track from the dispatch table; false for unsupported layouts
+    bool init(unsigned int channels, unsigned int rate, uint64_t totalSamples, unsigned int targetChannels, unsigned int targetRate) {
+        sourceChannels_ = channels;
+        targetChannels_ = targetChannels;
+        sameRate_ = rate == targetRate;
+        ratio_ = static_cast<double>(rate) / targetRate;
+        std::size_t frames = totalSamples / channels;
+        convertedFrames_ = sameRate_ ? frames : static_cast<std::size_t>(frames / ratio_);
+        copyKernel_ = CopyKernels::lookup(channels, targetChannels);
+        resampleKernel_ = ResampleKernels::lookup(channels, targetChannels);
+        return copyKernel_ && resampleKernel_;
+    }
+
+    bool passthrough() const { return sameRate_ && sourceChannels_ == targetChannels_; }
+
+    uint64_t convertedSamples() const { return convertedFrames_ * targetChannels_; }
+
+    // Output position before which nothing more comes once the source is read up to sourceSample
+    uint64_t convertedPosition(uint64_t sourceSample) const {
+        std::size_t frame = sourceSample / sourceChannels_;
+        if (!sameRate_) frame = std::min(firstResampledAt(frame, ratio_), convertedFrames_);
+        return frame * targetChannels_;
+    }
+
+    // False if the region has no output frames
+    bool convert(SparseRegion& region, SparseRegion& out) {
+        if (passthrough()) {
+            out = std::move(region);
+            return out.samples.size() > 0;
+        }
+        std::size_t regionStart = region.start / sourceChannels_;
+        std::size_t regionEnd = region.end() / sourceChannels_;
+        std::size_t first = regionStart, last = regionEnd;
+        if (!sameRate_) {
+            first = firstResampledAt(regionStart, ratio_);
+            last = std::min(firstResampledAt(regionEnd, ratio_), convertedFrames_);
+        }
+        if (first >= last) return false;
+
+        out.start = first * targetChannels_;
+        out.samples.resize((last - first) * targetChannels_);
+        if (sameRate_) {
+            render::SameRate position = {regionStart};
+            copyKernel_(region.samples.data(), out.samples.data(), sourceChannels_, first, last - first, position, render::UnityGain());
+        } else {
+            render::RateRatio position = {ratio_, regionStart};
+            resampleKernel_(region.samples.data(), out.samples.data(), sourceChannels_, first, last - first, position, render::UnityGain());
+        }
+        return true;
     }
 
-    return resampledSamples;
+private:
+    typedef render::Kernels<float, render::SameRate, render::UnityGain> CopyKernels;
+    typedef render::Kernels<float, render::RateRatio, render::UnityGain> ResampleKernels;
+
+    unsigned int sourceChannels_ = 1;
+    unsigned int targetChannels_ = 1;
+    bool sameRate_ = true;
+    double ratio_ = 1;
+    std::size_t convertedFrames_ = 0;
+    CopyKernels::Kernel copyKernel_ = nullptr;
+    ResampleKernels::Kernel resampleKernel_ = nullptr;
+};
+
+// A track being decoded and converted by a loader thread while the mixer consumes it
+struct TrackStream {
+    std::string filename;
+    TrackInput input;
+    TrackConverter converter;
+    std::unique_ptr<job_trace::Span> decodeSpan;  // from its first region until it is converted
+
+    std::mutex mutex;
+    std::condition_variable progress;
+    std::vector<SparseRegion> regions;  // converted, in order; released by the mixer once mixed
+    uint64_t readyUntil = 0;            // output samples before this position are all in regions
+    bool done = false;
+    bool failed = false;
+};
+
+// Where the mix is; loaders wait on it instead of converting whole tracks ahead of it
+struct MixProgress {
+    std::mutex mutex;
+    std::condition_variable moved;
+    uint64_t mixedUntil = 0;  // start of the block being mixed
+    bool stop = false;
+};
+
+// Converts the next region of a track; false once the track is done
+bool loadRegion(TrackStream& stream) {
+    if (!stream.decodeSpan) stream.decodeSpan.reset(new job_trace::Span("decode"));
+    SparseRegion region, converted;
+    if (stream.input.next(region)) {
+        uint64_t ready = stream.converter.convertedPosition(region.end());
+        bool hasOutput = stream.converter.convert(region, converted);
+        std::lock_guard<std::mutex> lock(stream.mutex);
+        if (hasOutput) stream.regions.push_back(std::move(converted));
+        stream.readyUntil = std::max(stream.readyUntil, ready);
+        stream.progress.notify_one();
+        return true;
+    }
+    bool ok = stream.input.ok();
+    stream.input.close();
+    stream.decodeSpan->args().add("file", stream.filename).add("samples", static_cast<long long>(stream.converter.convertedSamples()));
+    stream.decodeSpan->end();
+    std::lock_guard<std::mutex> lock(stream.mutex);
+    stream.failed = !ok;
+    stream.done = true;
+    stream.readyUntil = stream.converter.convertedSamples();
+    stream.progress.notify_one();
+    return false;
 }
 
-// Function to convert mono to stereo or vice versa
-std::vector<sf::Int16> convertChannels(const sf::Int16* samples, std::size_t sampleCount, unsigned int originalChannels, unsigned int targetChannels) {
-    std::vector<sf::Int16> convertedSamples;
-    if (originalChannels == 1 && targetChannels == 2) {
-        // Mono to Stereo
-        convertedSamples.reserve(sampleCount * 2);
-        for (std::size_t i = 0; i < sampleCount; ++i) {
-            convertedSamples.push_back(samples[i]);
-            convertedSamples.push_back(samples[i]);
+// Loader thread: decodes and converts every loaderCount-th track, region by region, always the
+// one furthest behind, and at most LOOKAHEAD_SAMPLES ahead of the mix. Every track advances
+// with the mix, so only that window of each track is resident, however many tracks there are
+void loadTracks(std::vector<std::unique_ptr<TrackStream>>& streams, std::size_t loader, std::size_t loaderCount,
+                MixProgress& mix) {
+    std::vector<TrackStream*> tracks;
+    for (std::size_t i = loader; i < streams.size(); i += loaderCount) {
+        tracks.push_back(streams[i].get());
+    }
+    while (true) {
+        // Only this thread writes readyUntil and done of its tracks
+        TrackStream* behind = nullptr;
+        for (TrackStream* stream : tracks) {
+            if (!stream->done && (!behind || stream->readyUntil < behind->readyUntil)) behind = stream;
         }
-    } else if (originalChannels == 2 && targetChannels == 1) {
-        // Stereo to Mono
-        convertedSamples.reserve(sampleCount / 2);
-        for (std::size_t i = 0; i < sampleCount; i += 2) {
-            sf::Int16 monoSample = static_cast<sf::Int16>((samples[i] + samples[i + 1]) / 2);
-            convertedSamples.push_back(monoSample);
+        if (!behind) break;
+        {
+            std::unique_lock<std::mutex> lock(mix.mutex);
+            mix.moved.wait(lock, [&] { return mix.stop || behind->readyUntil < mix.mixedUntil + LOOKAHEAD_SAMPLES; });
+            if (mix.stop) break;
         }
+        loadRegion(*behind);
+    }
+    for (TrackStream* stream : tracks) {
+        if (!stream->done) stream->input.close();
+    }
+}
+
+// Part of a converted region the mixer still has to add
+struct Span {
+    std::size_t start;
+    std::size_t end;
+    const float* samples;
+    std::size_t region;  // index in the stream, released once the span is mixed
+};
+
+// Function to mix one block of output [from, to) from the spans that overlap it.
+// Sums are kept in float without clipping, the output conversion clips once
+void mixBlock(const std::vector<Span>& spans, std::size_t from, std::size_t to, float* out) {
+    std::fill(out, out + (to - from), 0.0f);
+    for (const Span& span : spans) {
+        std::size_t begin = std::max(span.start, from);
+        std::size_t end = std::min(span.end, to);
+        if (begin >= end) continue;
+        const float* in = span.samples + (begin - span.start);
+        float* mixed = out + (begin - from);
+        for (std::size_t i = 0; i < end - begin; ++i) mixed[i] += in[i];
     }
-    return convertedSamples;
 }
 
+// Writes the mix block by block in the output format
+class OutputWriter {
+public:
+    ~OutputWriter() { close(); }
+
+    bool open(const std::string& filename, std::size_t samples, unsigned int channels, unsigned int sampleRate,
+              OutputFormat format, bool dither) {
+        format_ = format;
+        noise_ = dither ? &dither_ : nullptr;
+        SF_INFO sfInfo;
+        sfInfo.frames = samples / channels;
+        sfInfo.samplerate = sampleRate;
+        sfInfo.channels = channels;
+        sfInfo.format = SF_FORMAT_WAV | (format == OUTPUT_PCM24 ? SF_FORMAT_PCM_24 : format == OUTPUT_FLOAT ? SF_FORMAT_FLOAT : SF_FORMAT_PCM_16);
+        file_ = io_.open(filename, SFM_WRITE, &sfInfo);
+        if (!file_) {
+            std::cerr << filename << "\n";
+            std::cerr << "Failed to create output sound file: " << sf_strerror(file_) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Float output keeps the headroom; integer output is rounded (or dithered) and clipped
+    bool write(const float* samples, std::size_t n) {
+        sf_count_t written;
+        if (format_ == OUTPUT_FLOAT) {
+            written = sf_write_float(file_, samples, n);
+        } else if (format_ == OUTPUT_PCM24) {
+            pcm32_.resize(n);
+            float_to_pcm(samples, pcm32_.data(), n, 24, noise_);
+            // libsndfile takes 32-bit full scale ints
+            for (std::size_t k = 0; k < n; ++k) pcm32_[k] = static_cast<int32_t>(static_cast<uint32_t>(pcm32_[k]) << 8);
+            written = sf_write_int(file_, pcm32_.data(), n);
+        } else {
+            pcm16_.resize(n);
+            float_to_int16(samples, pcm16_.data(), n, noise_);
+            written = sf_write_short(file_, pcm16_.data(), n);
+        }
+        if (written != static_cast<sf_count_t>(n)) {
+            std::cerr << "Failed to write samples to output sound file: " << sf_strerror(file_) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // False if the file was not completely written
+    bool close() {
+        if (file_) sf_close(file_);
+        file_ = nullptr;
+        return io_.close();
+    }
+
+private:
+    SNDFILE* file_ = nullptr;
+    AsyncSoundFile io_;
+    OutputFormat format_ = OUTPUT_PCM16;
+    TpdfDither dither_;
+    TpdfDither* noise_ = nullptr;
+    PooledSamples<int16_t> pcm16_;
+    PooledSamples<int32_t> pcm32_;
+};
+
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <output file> <sound file 1> [<sound file 2> ... <sound file N>]" << std::endl;
+    // Options come before the file names
+    OutputFormat outputFormat = OUTPUT_PCM16;
+    bool dither = false;
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] == '-'; ++arg) {
+        std::string option = argv[arg];
+        if (option == "--format" && arg + 1 < argc && parse_output_format(argv[arg + 1], outputFormat)) {
+            ++arg;
+        } else if (option == "--dither") {
+            dither = true;
+        } else if (option == "--threads" && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+            threadCount = atoi(argv[++arg]);
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return -1;
+        }
+    }
+    if (argc - arg < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--format pcm16|pcm24|float] [--dither] [--threads N] <output file> <sound file 1> [<sound file 2> ... <sound file N>]" << std::endl;
         return -1;
     }
 
-    std::string outputFilename = argv[1];
-    std::vector<sf::SoundBuffer> buffers(argc - 2);
+    std::string outputFilename = argv[arg];
+    job_trace::init_child("mixer");
 
-    // Load all sound files
-    for (int i = 2; i < argc; ++i) {
-        if (!buffers[i - 2].loadFromFile(argv[i])) {
+    // Open all sequenced tracks (sparse .sptk or any sound file); only the headers are read here
+    std::vector<std::unique_ptr<TrackStream>> streams;
+    for (int i = arg + 1; i < argc; ++i) {
+        streams.emplace_back(new TrackStream());
+        streams.back()->filename = argv[i];
+        if (!streams.back()->input.open(argv[i])) {
             std::cerr << "Failed to load sound file: " << argv[i] << std::endl;
             return -1;
         }
     }
 
     // Determine target sample rate and channel count (based on the first sound file)
-    unsigned int targetSampleRate = buffers[0].getSampleRate();
-    unsigned int targetChannelCount = buffers[0].getChannelCount();
-
-    // Resample and convert channel count if necessary
-    std::vector<std::vector<sf::Int16>> processedSamples(buffers.size());
-    for (std::size_t i = 0; i < buffers.size(); ++i) {
-        const sf::Int16* samples = buffers[i].getSamples();
-        std::size_t sampleCount = buffers[i].getSampleCount();
-        unsigned int sampleRate = buffers[i].getSampleRate();
-        unsigned int channelCount = buffers[i].getChannelCount();
-
-        if (sampleRate != targetSampleRate) {
-            processedSamples[i] = resample(samples, sampleCount, sampleRate, targetSampleRate);
-        } else {
-            processedSamples[i] = std::vector<sf::Int16>(samples, samples + sampleCount);
-        }
+    unsigned int targetSampleRate = streams[0]->input.sample_rate;
+    unsigned int targetChannelCount = streams[0]->input.channels;
 
-        if (channelCount != targetChannelCount) {
-            processedSamples[i] = convertChannels(processedSamples[i].data(), processedSamples[i].size(), channelCount, targetChannelCount);
+    // Determine the size of the output
+    std::size_t maxSampleCount = 0;
+    for (auto& stream : streams) {
+        TrackInput& input = stream->input;
+        if (!stream->converter.init(input.channels, input.sample_rate, input.total_samples, targetChannelCount, targetSampleRate)) {
+            std::cerr << "Cannot convert " << input.channels << " channels to " << targetChannelCount << std::endl;
+            return -1;
         }
+        maxSampleCount = std::max<std::size_t>(maxSampleCount, stream->converter.convertedSamples());
     }
 
-    // Determine the size of the output buffer
-    std::size_t maxSampleCount = 0;
-    for (const auto& samples : processedSamples) {
-        if (samples.size() > maxSampleCount) {
-            maxSampleCount = samples.size();
-        }
+    OutputWriter writer;
+    if (!writer.open(outputFilename, maxSampleCount, targetChannelCount, targetSampleRate, outputFormat, dither)) {
+        return -1;
     }
 
-    std::vector<sf::Int16> mixedSamples(maxSampleCount, 0);
+    // Decode, resample and convert on loader threads, overlapping the mix
+    MixProgress mix;
+    std::size_t loaderCount = std::min<std::size_t>(threadCount, streams.size());
+    std::vector<std::thread> loaders;
+    for (std::size_t t = 0; t < loaderCount; ++t) {
+        loaders.emplace_back(loadTracks, std::ref(streams), t, loaderCount, std::ref(mix));
+    }
 
-    // Mix the samples
-    for (std::size_t i = 0; i < maxSampleCount; ++i) {
-        sf::Int32 mixedSample = 0;
-        for (const auto& samples : processedSamples) {
-            if (i < samples.size()) {
-                mixedSample += samples[i];
+    // Mix and write block by block, each block as soon as every track has converted it
+    std::vector<std::vector<Span>> pending(streams.size());
+    std::vector<std::size_t> taken(streams.size(), 0);
+    std::vector<std::size_t> finished(streams.size(), 0);
+    std::vector<Span> blockSpans;
+    PooledSamples<float> block;
+    bool ok = true;
+    job_trace::Span mixSpan("mix");
+    for (std::size_t from = 0; ok && from < maxSampleCount; from += MIX_BLOCK) {
+        std::size_t to = std::min(from + MIX_BLOCK, maxSampleCount);
+        {
+            std::lock_guard<std::mutex> lock(mix.mutex);
+            mix.mixedUntil = from;
+        }
+        mix.moved.notify_all();
+        blockSpans.clear();
+        for (std::size_t s = 0; s < streams.size(); ++s) {
+            TrackStream& stream = *streams[s];
+            std::unique_lock<std::mutex> lock(stream.mutex);
+            stream.progress.wait(lock, [&] { return stream.done || stream.readyUntil >= to; });
+            if (stream.failed) {
+                std::cerr << "Failed to load sound file: " << stream.filename << std::endl;
+                ok = false;
+                break;
+            }
+            // Take the regions converted since the last block; their samples do not move
+            for (; taken[s] < stream.regions.size(); ++taken[s]) {
+                const SparseRegion& region = stream.regions[taken[s]];
+                pending[s].push_back({region.start, region.end(), region.samples.data(), taken[s]});
+            }
+            finished[s] = 0;
+            for (const Span& span : pending[s]) {
+                if (span.start >= to) break;
+                blockSpans.push_back(span);
+                if (span.end <= to) finished[s]++;
             }
         }
+        if (!ok) break;
 
-        // Ensure the mixed sample is within the valid range
-        if (mixedSample > 32767) mixedSample = 32767;
-        if (mixedSample < -32768) mixedSample = -32768;
+        block.resize(to - from);
+        SOUNDSEQ_PROBE4(mix_block, probe_job_id(), from, to - from, blockSpans.size());
+        mixBlock(blockSpans, from, to, block.data());
+        ok = writer.write(block.data(), to - from);
 
-        mixedSamples[i] = static_cast<sf::Int16>(mixedSample);
+        // Regions that ended in this block are not needed any more
+        for (std::size_t s = 0; s < streams.size(); ++s) {
+            if (finished[s] == 0) continue;
+            std::lock_guard<std::mutex> lock(streams[s]->mutex);
+            for (std::size_t k = 0; k < finished[s]; ++k) {
+                streams[s]->regions[pending[s][k].region].samples = PooledSamples<float>();
+            }
+            pending[s].erase(pending[s].begin(), pending[s].begin() + finished[s]);
+        }
     }
 
-    // Write the mixed sound file using libsndfile
-    SF_INFO sfInfo;
-    sfInfo.frames = mixedSamples.size() / targetChannelCount;
-    sfInfo.samplerate = targetSampleRate;
-    sfInfo.channels = targetChannelCount;
-    sfInfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+    mixSpan.args().add("tracks", static_cast<long long>(streams.size())).add("samples", static_cast<long long>(maxSampleCount));
+    mixSpan.end();
 
-    SNDFILE* outFile = sf_open(outputFilename.c_str(), SFM_WRITE, &sfInfo);
-    if (!outFile) {
-        std::cerr <<outputFilename.c_str()<< "\n";
-        std::cerr << "Failed to create output sound file: " << sf_strerror(outFile) << std::endl;
-        return -1;
+    {
+        std::lock_guard<std::mutex> lock(mix.mutex);
+        mix.stop = true;  // after a failure; otherwise every track is done already
     }
-
-    sf_count_t count = sf_write_short(outFile, mixedSamples.data(), mixedSamples.size());
-    if (count != static_cast<sf_count_t>(mixedSamples.size())) {
-        std::cerr << "Failed to write samples to output sound file: " << sf_strerror(outFile) << std::endl;
-        sf_close(outFile);
+    mix.moved.notify_all();
+    for (auto& loader : loaders) {
+        loader.join();
+    }
+    job_trace::Span closeSpan("write");
+    bool closed = writer.close();
+    closeSpan.end();
+    if (!closed) {
+        std::cerr << "Failed to write " << outputFilename << std::endl;
+        ok = false;
+    }
+    if (!ok) {
         return -1;
     }
 
-    sf_close(outFile);
-
-    std::cout << "Mixed sound saved as " << outputFilename << std::endl;
+    std::cout << "Mixed sound saved as " << outputFilename << " (" << output_format_name(outputFormat) << (dither ? ", dithered" : "") << ")" << std::endl;
+    if (getenv("SAMPLE_POOL_STATS")) {
+        std::cout << SamplePool::local().describe() << std::endl;
+    }
     return 0;
 }
@@ -0,0 +1,85 @@
+// Render node connections registered with the server (node_protocol.h). A dispatcher takes an
+// idle one for each track it sends out and gives it back, or drops it when the node failed.
+
+#pragma once
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include "node_protocol.h"
+
+struct RenderNode {
+    std::string name;
+    std::unique_ptr<NodeChannel> channel;
+    bool busy = false;
+    uint64_t tracks_rendered = 0;
+};
+
+class NodePool {
+public:
+    void add(const std::string& name, int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        nodes_.emplace_back();
+        nodes_.back().name = name;
+        nodes_.back().channel.reset(new NodeChannel(fd));
+        idle_.notify_one();
+    }
+
+    // An idle node, waiting while all of them are busy; nullptr once none is registered
+    RenderNode* acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            if (nodes_.empty()) return nullptr;
+            for (auto& node : nodes_) {
+                if (!node.busy) {
+                    node.busy = true;
+                    return &node;
+                }
+            }
+            idle_.wait(lock);
+        }
+    }
+
+    void release(RenderNode* node, bool rendered) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        node->busy = false;
+        if (rendered) node->tracks_rendered++;
+        idle_.notify_one();
+    }
+
+    // Closes the connection of a node that failed; its track goes to another node
+    void drop(RenderNode* node) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = nodes_.begin(); it != nodes_.end(); ++it) {
+            if (&*it == node) {
+                nodes_.erase(it);
+                break;
+            }
+        }
+        idle_.notify_all();  // waiters recheck whether any node is left
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return nodes_.size();
+    }
+
+    std::string describe() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        out << "Render nodes: " << nodes_.size() << "\n";
+        for (const auto& node : nodes_) {
+            out << "node " << node.name << (node.busy ? " busy" : " idle") << ", " << node.tracks_rendered
+                << " tracks rendered\n";
+        }
+        return out.str();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    std::list<RenderNode> nodes_;  // a list, so nodes handed out stay put while others come and go
+};
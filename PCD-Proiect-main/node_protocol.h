@@ -0,0 +1,69 @@
+// Render node protocol, spoken between serverUNIX and render_node over TCP (--node-port).
+// A node opens one connection per render slot and registers it:
+//   node:   NODE <name>                                  server: REGISTERED <name>
+// The server then sends it one track at a time:
+//   server: TASK <task> <job> <track> <sha256> <wav|flac> <score bytes>, then the score
+//   node:   HAVE <task>                   the sound is in its cache, or
+//           NEED <task>                   server: SOUND <task> <bytes>, then the sound
+//   node:   BLOCK <task> <bytes> <crc32c>, then that much of the rendered sequenced.sptk, ...
+//           DONE <task> <total bytes>     or FAILED <task> <reason>
+// Nodes keep no state besides the sound cache (keyed by SHA-256), so any node can render any
+// track, and a track whose node disconnects or sends a damaged block is given to another.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "connection_reader.h"
+
+const int DEFAULT_NODE_PORT = 8081;
+const std::size_t NODE_BLOCK_SIZE = 1024 * 1024;  // BLOCK payload
+const std::size_t NODE_MAX_SCORE = 64 * 1024 * 1024;
+
+// One end of a node connection: buffered lines and payloads in, whole messages out
+class NodeChannel {
+public:
+    explicit NodeChannel(int fd) : fd_(fd), reader_(fd, nullptr) {}
+    ~NodeChannel() { close(fd_); }
+
+    int fd() const { return fd_; }
+
+    bool read_line(std::string& line) { return reader_.read_line(line); }
+
+    bool read_exact(char* out, std::size_t size) {
+        while (size > 0) {
+            ssize_t n = reader_.read_some(out, size);
+            if (n <= 0) return false;
+            out += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool send(const char* data, std::size_t size) {
+        while (size > 0) {
+            ssize_t n = ::send(fd_, data, size, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool send_line(const std::string& line) { return send((line + "\n").data(), line.size() + 1); }
+
+    // A line followed by its payload, in one message
+    bool send_frame(const std::string& line, const char* payload, std::size_t size) {
+        std::string frame = line + "\n";
+        frame.append(payload, size);
+        return send(frame.data(), frame.size());
+    }
+
+private:
+    int fd_;
+    ConnectionReader reader_;
+};
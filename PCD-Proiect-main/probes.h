@@ -0,0 +1,36 @@
+// USDT probes (provider "soundseq") at the hot points of a job, always compiled in so bpftrace or
+// SystemTap can attach to a running server, worker, sequencer or mixer without a restart:
+//   bpftrace -e 'usdt:./serverUNIX:soundseq:job_dispatched { printf("%s %d us\n", str(arg0), arg3); }'
+// With <sys/sdt.h> (systemtap-sdt-dev) each probe is a single nop plus an ELF note describing
+// where its arguments are; nothing else runs until a tracer attaches. Without the header the
+// probes compile to nothing. Job ids are passed as C strings.
+
+#pragma once
+
+#include <cstdlib>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SOUNDSEQ_SDT 1
+#endif
+#endif
+
+#ifdef SOUNDSEQ_SDT
+#define SOUNDSEQ_PROBE2(name, a, b) DTRACE_PROBE2(soundseq, name, a, b)
+#define SOUNDSEQ_PROBE3(name, a, b, c) DTRACE_PROBE3(soundseq, name, a, b, c)
+#define SOUNDSEQ_PROBE4(name, a, b, c, d) DTRACE_PROBE4(soundseq, name, a, b, c, d)
+#else
+// Arguments are named in sizeof only, so they are not evaluated but still count as used
+#define SOUNDSEQ_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define SOUNDSEQ_PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#define SOUNDSEQ_PROBE4(name, a, b, c, d) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+#endif
+
+// The worker puts its job id in the environment of the sequencers and the mixer it starts
+const char* const PROBE_JOB_VARIABLE = "SOUNDSEQ_JOB_ID";
+
+inline const char* probe_job_id() {
+    static const char* job_id = getenv(PROBE_JOB_VARIABLE) != nullptr ? getenv(PROBE_JOB_VARIABLE) : "";
+    return job_id;
+}
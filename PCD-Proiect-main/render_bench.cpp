@@ -0,0 +1,84 @@
+// g++-9 -O2 -o render_bench render_bench.cpp
+// Throughput of the render kernels (render_kernels.h): compile-time channel counts against
+// the run-time channel loop, for mono and stereo and each sample type.
+// ./render_bench [seconds of audio per run, default 60]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include "render_kernels.h"
+
+static const unsigned int RATE = 44100;
+static const int RUNS = 5;
+
+template <typename S>
+S test_sample(std::size_t i) {
+    return static_cast<S>(static_cast<int>((i * 2654435761u) >> 20) % 20000 - 10000);
+}
+
+template <>
+float test_sample<float>(std::size_t i) {
+    return (static_cast<int>((i * 2654435761u) >> 20) % 20000 - 10000) / 32768.0f;
+}
+
+// Best of RUNS, in millions of output frames per second
+template <typename F>
+double frames_per_us(std::size_t frames, F render) {
+    double best = 0;
+    for (int run = 0; run < RUNS; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        render();
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        if (us > 0 && frames / us > best) best = frames / us;
+    }
+    return best;
+}
+
+template <typename S, typename Position, typename Gain>
+void compare(const std::string& name, unsigned int channels, std::size_t frames, const Position& position, const Gain& gain) {
+    std::vector<S> src(frames * channels + channels);
+    for (std::size_t i = 0; i < src.size(); ++i) src[i] = test_sample<S>(i);
+    std::vector<S> dst(frames * channels);
+
+    typename render::Kernels<S, Position, Gain>::Kernel kernel = render::Kernels<S, Position, Gain>::lookup(channels, channels);
+    double specialized = frames_per_us(frames, [&] {
+        kernel(src.data(), dst.data(), channels, 0, frames, position, gain);
+    });
+    double runtime = frames_per_us(frames, [&] {
+        render::render_frames<0, 0>(src.data(), dst.data(), channels, 0, frames, position, gain);
+    });
+    std::cout << std::left << std::setw(28) << name << std::setw(8) << (channels == 1 ? "mono" : "stereo")
+              << std::right << std::fixed << std::setprecision(1) << std::setw(10) << runtime << std::setw(12)
+              << specialized << std::setw(8) << std::setprecision(2) << specialized / runtime << "x" << std::endl;
+}
+
+template <typename S>
+void run_type(const std::string& type, std::size_t frames) {
+    render::VolumeGain volume = {0.8f};
+    render::SameRate unpitched = {0};
+    render::PitchStep pitched = {0.75f};
+    render::RateRatio resample = {22050.0 / RATE, 0};
+    for (unsigned int channels = 1; channels <= 2; ++channels) {
+        compare<S>(type + " volume", channels, frames, unpitched, volume);
+        compare<S>(type + " pitch 0.75 + volume", channels, render::pitched_frames(frames, 0.75f), pitched, volume);
+        compare<S>(type + " resample 22050->44100", channels, frames, resample, render::UnityGain());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = argc > 1 ? std::max(1, atoi(argv[1])) : 60;
+    std::size_t frames = static_cast<std::size_t>(seconds) * RATE;
+
+    std::cout << seconds << " s of audio per run, best of " << RUNS << ", M frames/s" << std::endl;
+    std::cout << std::left << std::setw(28) << "kernel" << std::setw(8) << "layout" << std::right << std::setw(10)
+              << "run-time" << std::setw(12) << "constexpr" << std::setw(9) << "gain" << std::endl;
+    run_type<int16_t>("int16", frames);
+    run_type<int32_t>("int32", frames);
+    run_type<float>("float", frames);
+    return 0;
+}
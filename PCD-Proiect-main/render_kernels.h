@@ -0,0 +1,201 @@
+// Fused render kernels: one streaming pass from source frames to a destination block that
+// picks the source frame (resampling or pitch), up/down-mixes the channels and applies gain.
+// Replaces separate resample, channel conversion and volume passes over whole tracks.
+//
+// Output frame k reads source frame position(k); resampling is nearest-frame (the frame at
+// or before the exact position), mono->stereo duplicates, stereo->mono averages (truncating
+// for integer samples).
+//
+// Kernels are templates on the channel counts and the sample type (int16_t, int32_t, float).
+// Common layouts are instantiated with compile-time channel counts, so the per-frame channel
+// loop disappears; channel count 0 means "known at run time". lookup() is the dispatch table
+// that picks the instantiation for a track once, before its regions are rendered.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace render {
+
+// Per sample type arithmetic
+template <typename S>
+struct SampleTraits;
+
+template <>
+struct SampleTraits<int16_t> {
+    static int16_t average(int16_t a, int16_t b) { return static_cast<int16_t>((a + b) / 2); }
+    static int16_t scale(int16_t s, float volume) { return static_cast<int16_t>(s * volume); }
+};
+
+template <>
+struct SampleTraits<int32_t> {
+    static int32_t average(int32_t a, int32_t b) { return static_cast<int32_t>((int64_t(a) + b) / 2); }
+    static int32_t scale(int32_t s, float volume) { return static_cast<int32_t>(s * double(volume)); }
+};
+
+template <>
+struct SampleTraits<float> {
+    static float average(float a, float b) { return (a + b) * 0.5f; }
+    static float scale(float s, float volume) { return s * volume; }
+};
+
+// Source frame positions, relative to the start of the source block
+
+// Same rate: output frame k is source frame k - offset
+struct SameRate {
+    std::size_t offset;
+    std::size_t operator()(std::size_t k) const { return k - offset; }
+};
+
+// Rate conversion by source/target ratio (the mixer's resampler)
+struct RateRatio {
+    double ratio;
+    std::size_t offset;
+    std::size_t operator()(std::size_t k) const { return static_cast<std::size_t>(k * ratio) - offset; }
+};
+
+// Pitch change: output frame k takes source frame k / pitch (the sequencer's stretch)
+struct PitchStep {
+    float pitch;
+    std::size_t operator()(std::size_t k) const { return static_cast<int>(k / pitch); }
+};
+
+// Gains applied to each output sample
+
+struct UnityGain {
+    template <typename S>
+    S operator()(S sample) const { return sample; }
+};
+
+struct VolumeGain {
+    float volume;
+    template <typename S>
+    S operator()(S sample) const { return SampleTraits<S>::scale(sample, volume); }
+};
+
+// Channel layouts: how one destination frame is made from one source frame.
+// The general case keeps the channels as they are (SRC == DST, or both 0 for run time)
+template <int SRC, int DST>
+struct ChannelMap {
+    static_assert(SRC == DST, "only mono/stereo conversions change the channel count");
+    template <typename S, typename Gain>
+    static void frame(const S* in, S* out, unsigned int channels, const Gain& gain) {
+        const unsigned int count = SRC ? SRC : channels;
+        for (unsigned int c = 0; c < count; ++c) out[c] = gain(in[c]);
+    }
+};
+
+template <>
+struct ChannelMap<1, 2> {
+    template <typename S, typename Gain>
+    static void frame(const S* in, S* out, unsigned int, const Gain& gain) { out[0] = out[1] = gain(in[0]); }
+};
+
+template <>
+struct ChannelMap<2, 1> {
+    template <typename S, typename Gain>
+    static void frame(const S* in, S* out, unsigned int, const Gain& gain) {
+        out[0] = gain(SampleTraits<S>::average(in[0], in[1]));
+    }
+};
+
+// Frame loop for one layout, position and gain
+template <int SRC, int DST, typename S, typename Position, typename Gain>
+struct FrameLoop {
+    static void run(const S* src, S* dst, unsigned int channels, std::size_t first, std::size_t count,
+                    const Position& position, const Gain& gain) {
+        const std::size_t in_step = SRC ? SRC : channels;
+        const std::size_t out_step = DST ? DST : channels;
+        for (std::size_t k = 0; k < count; ++k) {
+            ChannelMap<SRC, DST>::frame(src + position(first + k) * in_step, dst + k * out_step, channels, gain);
+        }
+    }
+};
+
+// Same rate and no gain: consecutive frames, a plain copy when the layout does not change
+template <int SRC, int DST, typename S>
+struct FrameLoop<SRC, DST, S, SameRate, UnityGain> {
+    static void run(const S* src, S* dst, unsigned int channels, std::size_t first, std::size_t count,
+                    const SameRate& position, const UnityGain& gain) {
+        const std::size_t in_step = SRC ? SRC : channels;
+        const std::size_t out_step = DST ? DST : channels;
+        const S* in = src + position(first) * in_step;
+        if (SRC == DST) {
+            memcpy(dst, in, count * in_step * sizeof(S));
+            return;
+        }
+        for (std::size_t k = 0; k < count; ++k) {
+            ChannelMap<SRC, DST>::frame(in + k * in_step, dst + k * out_step, channels, gain);
+        }
+    }
+};
+
+// Renders output frames [first, first + count) into dst (frame first goes to dst[0]);
+// channels is only read when SRC and DST are 0
+template <int SRC, int DST, typename S, typename Position, typename Gain>
+void render_frames(const S* src, S* dst, unsigned int channels, std::size_t first, std::size_t count,
+                   const Position& position, const Gain& gain) {
+    FrameLoop<SRC, DST, S, Position, Gain>::run(src, dst, channels, first, count, position, gain);
+}
+
+template <typename S, typename Position, typename Gain>
+struct Kernels {
+    typedef void (*Kernel)(const S* src, S* dst, unsigned int channels, std::size_t first, std::size_t count,
+                           const Position& position, const Gain& gain);
+
+    // Instantiation for the layouts, or nullptr if there is no conversion between them
+    static Kernel lookup(unsigned int src_channels, unsigned int dst_channels) {
+        struct Entry {
+            unsigned int src;
+            unsigned int dst;
+            Kernel kernel;
+        };
+        static const Entry table[] = {
+            {1, 1, &render_frames<1, 1, S, Position, Gain>},
+            {2, 2, &render_frames<2, 2, S, Position, Gain>},
+            {1, 2, &render_frames<1, 2, S, Position, Gain>},
+            {2, 1, &render_frames<2, 1, S, Position, Gain>},
+            {4, 4, &render_frames<4, 4, S, Position, Gain>},
+            {6, 6, &render_frames<6, 6, S, Position, Gain>},
+            {8, 8, &render_frames<8, 8, S, Position, Gain>},
+        };
+        for (const Entry& entry : table) {
+            if (entry.src == src_channels && entry.dst == dst_channels) return entry.kernel;
+        }
+        if (src_channels == dst_channels && src_channels > 0) {
+            return &render_frames<0, 0, S, Position, Gain>;
+        }
+        return nullptr;
+    }
+};
+
+// Looks up the kernel and renders one block; false if there is no conversion between the layouts
+template <typename S, typename Position, typename Gain>
+bool render_block(const S* src, unsigned int src_channels, S* dst, unsigned int dst_channels,
+                  std::size_t first, std::size_t count, const Position& position, const Gain& gain) {
+    typename Kernels<S, Position, Gain>::Kernel kernel = Kernels<S, Position, Gain>::lookup(src_channels, dst_channels);
+    if (!kernel) return false;
+    kernel(src, dst, src_channels, first, count, position, gain);
+    return true;
+}
+
+// Output frames of a pitch change over length source frames (those whose source is in range)
+inline std::size_t pitched_frames(std::size_t length, float pitch) {
+    if (!(pitch > 0)) return 0;
+    if (pitch >= 1) return length;
+    // Source positions grow with k, so find the first one past the slice
+    std::size_t low = 0, high = length;
+    PitchStep position = {pitch};
+    while (low < high) {
+        std::size_t mid = low + (high - low) / 2;
+        if (position(mid) < length) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+}  // namespace render
@@ -0,0 +1,264 @@
+// g++-9 -O2 -o render_node render_node.cpp -pthread
+// Stateless render node (node_protocol.h): registers one connection per slot with the server,
+// renders the tracks it is sent with the sequencer next to it and streams the sparse tracks
+// back. Sounds are cached by SHA-256, so each sound crosses the network once per node.
+// ./render_node <server host> <node port> [--name N] [--slots N] [--cache folder] [--sequencer path]
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <climits>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "node_protocol.h"
+#include "probes.h"
+#include "sha256.h"
+
+extern char** environ;
+
+std::string server_host;
+std::string server_port;
+std::string node_name;
+std::string cache_folder;
+std::string sequencer_path;
+
+int connect_to_server() {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(server_host.c_str(), server_port.c_str(), &hints, &addresses) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* address = addresses; address != nullptr && fd == -1; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd != -1 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+bool file_exists(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+}
+
+// Receives a sound after NEED into the cache; false if the connection broke. A sound that
+// arrived whole but does not match its hash is not cached (matches stays false)
+bool receive_sound(NodeChannel& channel, const std::string& task, const std::string& hash, const std::string& path,
+                   bool& matches) {
+    matches = false;
+    std::string line, verb, id;
+    uint64_t size = 0;
+    if (!channel.read_line(line)) return false;
+    std::istringstream in(line);
+    in >> verb >> id >> size;
+    if (verb != "SOUND" || id != task) return false;
+    // Each slot writes its own temporary file; the rename makes the sound visible whole
+    std::ostringstream temporary_name;
+    temporary_name << path << ".part." << std::this_thread::get_id();
+    std::string temporary = temporary_name.str();
+    std::ofstream out(temporary, std::ios::binary);
+    Sha256 sound_hash;
+    std::vector<char> buffer(64 * 1024);
+    while (size > 0) {
+        std::size_t chunk = std::min<uint64_t>(buffer.size(), size);
+        if (!channel.read_exact(buffer.data(), chunk)) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        sound_hash.update(buffer.data(), chunk);
+        out.write(buffer.data(), chunk);
+        size -= chunk;
+    }
+    out.close();
+    matches = out && sound_hash.hex() == hash;
+    if (!matches || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        matches = false;
+    }
+    return true;
+}
+
+// Runs the sequencer in the task folder; the environment is built before fork() since this
+// process is threaded
+bool run_sequencer(const std::string& folder, const std::string& sound, const std::string& job_id) {
+    std::vector<std::string> variables;
+    for (char** variable = environ; *variable != nullptr; ++variable) variables.push_back(*variable);
+    variables.push_back(std::string(PROBE_JOB_VARIABLE) + "=" + job_id);
+    std::vector<char*> envp;
+    for (auto& variable : variables) envp.push_back(&variable[0]);
+    envp.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        return false;
+    }
+    if (pid == 0) {
+        if (chdir(folder.c_str()) != 0) _exit(127);
+        // One core per slot: the slots already keep every core busy
+        execle(sequencer_path.c_str(), "sequencer", sound.c_str(), "instructions.txt", "--threads", "1", (char*)nullptr,
+               envp.data());
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Streams the rendered track in checksummed blocks
+bool send_track(NodeChannel& channel, const std::string& task, const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return channel.send_line("FAILED " + task + " no sequenced track");
+    }
+    std::vector<char> block(NODE_BLOCK_SIZE);
+    uint64_t total = 0;
+    while (file.read(block.data(), block.size()) || file.gcount() > 0) {
+        std::size_t size = file.gcount();
+        std::string line = "BLOCK " + task + " " + std::to_string(size) + " " + crc32c_hex(crc32c(block.data(), size));
+        if (!channel.send_frame(line, block.data(), size)) return false;
+        total += size;
+    }
+    return channel.send_line("DONE " + task + " " + std::to_string(total));
+}
+
+// One TASK: the score, the sound (from the cache or the server), the sequencer and the result.
+// False only when the connection broke
+bool render_task(NodeChannel& channel, const std::string& line) {
+    std::istringstream in(line);
+    std::string verb, task, job_id, track, hash, kind;
+    uint64_t score_size = 0;
+    in >> verb >> task >> job_id >> track >> hash >> kind >> score_size;
+    if (score_size > NODE_MAX_SCORE || hash.size() != 64 || (kind != "wav" && kind != "flac")) {
+        return false;  // the stream cannot be trusted to stay in sync
+    }
+    std::string score(score_size, '\0');
+    if (!channel.read_exact(&score[0], score_size)) return false;
+
+    std::string sound = cache_folder + "/" + hash + "." + kind;
+    if (file_exists(sound)) {
+        if (!channel.send_line("HAVE " + task)) return false;
+    } else {
+        bool matches;
+        if (!channel.send_line("NEED " + task) || !receive_sound(channel, task, hash, sound, matches)) return false;
+        if (!matches) return channel.send_line("FAILED " + task + " sound does not match its hash");
+    }
+
+    std::string folder = cache_folder + "/task_" + std::to_string(getpid()) + "_" + task;
+    mkdir(folder.c_str(), 0777);
+    std::string sound_link = folder + "/sound." + kind;
+    std::ofstream(folder + "/instructions.txt", std::ios::binary) << score;
+    bool linked = symlink(sound.c_str(), sound_link.c_str()) == 0;
+    std::cout << "Rendering job " << job_id << " track " << track << std::endl;
+    bool connected;
+    if (linked && run_sequencer(folder, "sound." + kind, job_id)) {
+        connected = send_track(channel, task, folder + "/sequenced.sptk");
+    } else {
+        connected = channel.send_line("FAILED " + task + " sequencer failed");
+    }
+    unlink((folder + "/sequenced.sptk").c_str());
+    unlink((folder + "/instructions.txt").c_str());
+    unlink(sound_link.c_str());
+    rmdir(folder.c_str());
+    return connected;
+}
+
+// One render slot: registers, serves tasks, and reconnects with backoff when the server goes away
+void serve_slot(int slot) {
+    std::string name = node_name + "/" + std::to_string(slot);
+    int delay_ms = 250;
+    while (true) {
+        int fd = connect_to_server();
+        if (fd == -1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+            delay_ms = std::min(delay_ms * 2, 30000);
+            continue;
+        }
+        int keepalive = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+        NodeChannel channel(fd);
+        std::string line;
+        if (!channel.send_line("NODE " + name) || !channel.read_line(line) || line != "REGISTERED " + name) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+            delay_ms = std::min(delay_ms * 2, 30000);
+            continue;
+        }
+        std::cout << "Slot " << name << " registered with " << server_host << ":" << server_port << std::endl;
+        delay_ms = 250;
+        while (channel.read_line(line)) {
+            if (line.compare(0, 5, "TASK ") != 0 || !render_task(channel, line)) {
+                break;
+            }
+        }
+        std::cout << "Slot " << name << " disconnected, reconnecting" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <server host> <node port> [--name N] [--slots N] [--cache folder] [--sequencer path]" << std::endl;
+        return 1;
+    }
+    server_host = argv[1];
+    server_port = argv[2];
+    char host[256] = "node";
+    gethostname(host, sizeof(host) - 1);
+    node_name = host;
+    unsigned int slots = std::max(1u, std::thread::hardware_concurrency());
+    cache_folder = "node_cache";
+    // The sequencer installed next to this program
+    std::string program = argv[0];
+    sequencer_path = program.find('/') == std::string::npos ? "sequencer" : program.substr(0, program.rfind('/') + 1) + "sequencer";
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--name") {
+            node_name = argv[i + 1];
+        } else if (option == "--slots" && atoi(argv[i + 1]) > 0) {
+            slots = atoi(argv[i + 1]);
+        } else if (option == "--cache") {
+            cache_folder = argv[i + 1];
+        } else if (option == "--sequencer") {
+            sequencer_path = argv[i + 1];
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    // Tasks run in their own folders, so both paths are made absolute
+    mkdir(cache_folder.c_str(), 0777);
+    char absolute[PATH_MAX];
+    if (realpath(cache_folder.c_str(), absolute) == nullptr) {
+        std::cerr << "Cannot use cache folder " << cache_folder << std::endl;
+        return 1;
+    }
+    cache_folder = absolute;
+    if (realpath(sequencer_path.c_str(), absolute) == nullptr) {
+        std::cerr << "Sequencer not found: " << sequencer_path << std::endl;
+        return 1;
+    }
+    sequencer_path = absolute;
+
+    std::vector<std::thread> threads;
+    for (unsigned int slot = 0; slot < slots; ++slot) {
+        threads.emplace_back(serve_slot, slot);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return 0;
+}
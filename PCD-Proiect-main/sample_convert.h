@@ -0,0 +1,155 @@
+// Sample format conversions at the edges of the float render pipeline: 16-bit input to
+// float, and float to the output format (16/24-bit PCM with optional TPDF dither, or float).
+// Float samples are full scale at +-1.0; conversions round to nearest and clamp. The SSE2
+// paths give the same results as the scalar ones.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum OutputFormat {
+    OUTPUT_PCM16,
+    OUTPUT_PCM24,
+    OUTPUT_FLOAT,
+};
+
+inline bool parse_output_format(const std::string& name, OutputFormat& format) {
+    if (name == "pcm16") format = OUTPUT_PCM16;
+    else if (name == "pcm24") format = OUTPUT_PCM24;
+    else if (name == "float") format = OUTPUT_FLOAT;
+    else return false;
+    return true;
+}
+
+inline const char* output_format_name(OutputFormat format) {
+    switch (format) {
+        case OUTPUT_PCM24: return "pcm24";
+        case OUTPUT_FLOAT: return "float";
+        default: return "pcm16";
+    }
+}
+
+// Triangular (TPDF) dither: the difference of two uniform values, +-1 LSB peak.
+// Four xorshift32 lanes, so the SSE2 path draws the same noise as the scalar one
+class TpdfDither {
+public:
+    explicit TpdfDither(uint32_t seed = 0x9e3779b9u) {
+        for (int lane = 0; lane < 4; ++lane) state_[lane] = seed + 0x6d2b79f5u * (lane + 1);
+    }
+
+    // Noise for 4 consecutive samples, in LSB
+    void next4(float* noise) {
+        for (int lane = 0; lane < 4; ++lane) {
+            float a = uniform(state_[lane]);
+            float b = uniform(state_[lane]);
+            noise[lane] = a - b;
+        }
+    }
+
+#ifdef __SSE2__
+    __m128 next4() {
+        __m128i state = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state_));
+        __m128 a = uniform(state);
+        __m128 b = uniform(state);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(state_), state);
+        return _mm_sub_ps(a, b);
+    }
+#endif
+
+private:
+    static float uniform(uint32_t& x) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return static_cast<float>(static_cast<int32_t>(x >> 8)) * (1.0f / 16777216.0f);
+    }
+
+#ifdef __SSE2__
+    static __m128 uniform(__m128i& x) {
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+    }
+#endif
+
+    uint32_t state_[4];
+};
+
+inline void int16_to_float(const int16_t* in, float* out, std::size_t count) {
+    const float scale = 1.0f / 32768.0f;
+    std::size_t i = 0;
+#ifdef __SSE2__
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        // Sign-extend by unpacking into the high halves and shifting back down
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+#endif
+    for (; i < count; ++i) out[i] = in[i] * scale;
+}
+
+// Float to integers of the given bit depth (16 or 24), left in the low bits of an int32;
+// dither may be null
+inline void float_to_pcm(const float* in, int32_t* out, std::size_t count, int bits, TpdfDither* dither) {
+    const float scale = static_cast<float>(1 << (bits - 1));
+    const float high = scale - 1;
+    const float low = -scale;
+    std::size_t i = 0;
+#ifdef __SSE2__
+    // Round to nearest even, as lrintf below; the clamp comes first so the conversion cannot overflow
+    const __m128 vscale = _mm_set1_ps(scale), vhigh = _mm_set1_ps(high), vlow = _mm_set1_ps(low);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(in + i), vscale);
+        if (dither) x = _mm_add_ps(x, dither->next4());
+        x = _mm_max_ps(_mm_min_ps(x, vhigh), vlow);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_cvtps_epi32(x));
+    }
+#endif
+    float noise[4] = {0, 0, 0, 0};
+    for (std::size_t lane = 4; i < count; ++i, ++lane) {
+        if (dither && lane == 4) {
+            dither->next4(noise);
+            lane = 0;
+        }
+        float x = in[i] * scale + (dither ? noise[lane] : 0.0f);
+        x = std::max(low, std::min(high, x));
+        out[i] = static_cast<int32_t>(lrintf(x));
+    }
+}
+
+inline void float_to_int16(const float* in, int16_t* out, std::size_t count, TpdfDither* dither) {
+    std::size_t i = 0;
+#ifdef __SSE2__
+    const __m128 vscale = _mm_set1_ps(32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), vscale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), vscale);
+        if (dither) {
+            a = _mm_add_ps(a, dither->next4());
+            b = _mm_add_ps(b, dither->next4());
+        }
+        // Out-of-range values convert to INT_MIN, so clamp before converting; packs saturates the rest
+        a = _mm_max_ps(_mm_min_ps(a, _mm_set1_ps(32767.0f)), _mm_set1_ps(-32768.0f));
+        b = _mm_max_ps(_mm_min_ps(b, _mm_set1_ps(32767.0f)), _mm_set1_ps(-32768.0f));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+#endif
+    int32_t block[64];
+    while (i < count) {
+        std::size_t n = std::min<std::size_t>(64, count - i);
+        float_to_pcm(in + i, block, n, 16, dither);
+        for (std::size_t k = 0; k < n; ++k) out[i + k] = static_cast<int16_t>(block[k]);
+        i += n;
+    }
+}
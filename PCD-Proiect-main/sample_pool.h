@@ -0,0 +1,243 @@
+// Per-thread pool of large sample buffers for the render path (sequencer, mixer).
+// Blocks are 64-byte aligned, come in power-of-two sizes and are reused across
+// instructions, tracks and jobs instead of going back to the allocator; blocks of 2 MB
+// and more are mmap'ed and marked for transparent hugepages. Only the thread that
+// acquired a block keeps it for reuse; released on another thread it is freed.
+
+#pragma once
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class SamplePool {
+public:
+    static const std::size_t ALIGNMENT = 64;
+    static const std::size_t MIN_BLOCK = 64 * 1024;
+    static const std::size_t HUGEPAGE_BLOCK = 2 * 1024 * 1024;
+    static const int SIZE_CLASSES = 48;
+    // Free blocks kept per thread; larger leftovers are returned to the system
+    static const std::size_t MAX_RETAINED_BYTES = 512 * 1024 * 1024;
+
+    struct Stats {
+        uint64_t acquires = 0;
+        uint64_t reuses = 0;          // served from a free list
+        uint64_t fresh = 0;           // new mappings/allocations
+        uint64_t hugepage_blocks = 0; // fresh blocks advised for hugepages
+        uint64_t bytes_in_use = 0;
+        uint64_t peak_bytes_in_use = 0;
+        uint64_t bytes_retained = 0;  // free blocks kept for reuse
+        uint64_t foreign_freed = 0;   // blocks of other threads' pools freed here
+    };
+
+    // The calling thread's pool
+    static SamplePool& local() {
+        static thread_local SamplePool pool;
+        return pool;
+    }
+
+    ~SamplePool() {
+        for (int c = 0; c < SIZE_CLASSES; ++c) {
+            for (void* block : free_[c]) {
+                release_block(block, class_bytes(c));
+            }
+        }
+    }
+
+    // Block of at least bytes; capacity receives its real size
+    void* acquire(std::size_t bytes, std::size_t& capacity) {
+        int c = size_class(bytes);
+        capacity = class_bytes(c);
+        stats_.acquires++;
+        void* block;
+        if (!free_[c].empty()) {
+            block = free_[c].back();
+            free_[c].pop_back();
+            stats_.reuses++;
+            stats_.bytes_retained -= capacity;
+        } else {
+            block = allocate_block(capacity);
+            stats_.fresh++;
+        }
+        stats_.bytes_in_use += capacity;
+        stats_.peak_bytes_in_use = std::max(stats_.peak_bytes_in_use, stats_.bytes_in_use);
+        return block;
+    }
+
+    // owner is the pool that acquired the block. A block of another thread's pool (buffers
+    // handed between threads, like the mixer's regions decoded on loader threads) is freed:
+    // kept here it would sit on a thread that never allocates it while the owner maps new
+    // ones. The owner still counts it in bytes_in_use
+    void release(void* block, std::size_t capacity, const SamplePool* owner) {
+        if (!block) return;
+        if (owner != this) {
+            stats_.foreign_freed++;
+            release_block(block, capacity);
+            return;
+        }
+        stats_.bytes_in_use -= std::min<uint64_t>(stats_.bytes_in_use, capacity);
+        if (stats_.bytes_retained + capacity > MAX_RETAINED_BYTES) {
+            release_block(block, capacity);
+            return;
+        }
+        free_[size_class(capacity)].push_back(block);
+        stats_.bytes_retained += capacity;
+    }
+
+    const Stats& stats() const { return stats_; }
+
+    std::string describe() const {
+        std::ostringstream out;
+        out << "sample pool: " << stats_.acquires << " acquires, " << stats_.reuses << " reused, "
+            << stats_.fresh << " fresh (" << stats_.hugepage_blocks << " hugepage), peak "
+            << stats_.peak_bytes_in_use / 1024 << " KB in use, " << stats_.bytes_retained / 1024 << " KB retained, "
+            << stats_.foreign_freed << " freed for other threads";
+        return out.str();
+    }
+
+private:
+    SamplePool() {}
+
+    static int size_class(std::size_t bytes) {
+        int c = 0;
+        while (c < SIZE_CLASSES - 1 && class_bytes(c) < bytes) ++c;
+        return c;
+    }
+
+    static std::size_t class_bytes(int c) {
+        return MIN_BLOCK << c;
+    }
+
+    void* allocate_block(std::size_t bytes) {
+        if (bytes >= HUGEPAGE_BLOCK) {
+            void* block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+            if (madvise(block, bytes, MADV_HUGEPAGE) == 0) stats_.hugepage_blocks++;
+#endif
+            return block;
+        }
+        void* block = nullptr;
+        if (posix_memalign(&block, ALIGNMENT, bytes) != 0) throw std::bad_alloc();
+        return block;
+    }
+
+    static void release_block(void* block, std::size_t bytes) {
+        if (bytes >= HUGEPAGE_BLOCK) {
+            munmap(block, bytes);
+        } else {
+            free(block);
+        }
+    }
+
+    std::vector<void*> free_[SIZE_CLASSES];
+    Stats stats_;
+};
+
+// Growable sample array backed by the thread's SamplePool; for trivially copyable samples.
+// Moves are cheap, copies are not allowed.
+template <typename T>
+class PooledSamples {
+public:
+    PooledSamples() : data_(nullptr), size_(0), capacity_(0), owner_(nullptr) {}
+
+    explicit PooledSamples(std::size_t count, T value = T()) : PooledSamples() {
+        append(count, value);
+    }
+
+    PooledSamples(const T* first, std::size_t count) : PooledSamples() {
+        append(first, count);
+    }
+
+    PooledSamples(PooledSamples&& other)
+        : data_(other.data_), size_(other.size_), capacity_(other.capacity_), owner_(other.owner_) {
+        other.data_ = nullptr;
+        other.size_ = other.capacity_ = 0;
+    }
+
+    PooledSamples& operator=(PooledSamples&& other) {
+        if (this != &other) {
+            release();
+            data_ = other.data_;
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            owner_ = other.owner_;
+            other.data_ = nullptr;
+            other.size_ = other.capacity_ = 0;
+        }
+        return *this;
+    }
+
+    PooledSamples(const PooledSamples&) = delete;
+    PooledSamples& operator=(const PooledSamples&) = delete;
+
+    ~PooledSamples() { release(); }
+
+    void reserve(std::size_t count) {
+        if (count <= capacity_) return;
+        std::size_t bytes;
+        SamplePool& pool = SamplePool::local();
+        T* grown = static_cast<T*>(pool.acquire(count * sizeof(T), bytes));
+        std::size_t size = size_;
+        if (size) memcpy(grown, data_, size * sizeof(T));
+        release();
+        data_ = grown;
+        owner_ = &pool;
+        size_ = size;
+        capacity_ = bytes / sizeof(T);
+    }
+
+    void push_back(T value) {
+        if (size_ == capacity_) reserve(std::max<std::size_t>(1, capacity_ * 2));
+        data_[size_++] = value;
+    }
+
+    void append(std::size_t count, T value) {
+        reserve(size_ + count);
+        std::fill(data_ + size_, data_ + size_ + count, value);
+        size_ += count;
+    }
+
+    void append(const T* first, std::size_t count) {
+        reserve(size_ + count);
+        if (count) memcpy(data_ + size_, first, count * sizeof(T));
+        size_ += count;
+    }
+
+    // New samples are left uninitialized, for callers that render straight into the buffer
+    void resize(std::size_t count) {
+        reserve(count);
+        size_ = count;
+    }
+
+    // Keeps the block, so the next use of this buffer does not allocate
+    void clear() { size_ = 0; }
+
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    T& operator[](std::size_t i) { return data_[i]; }
+    const T& operator[](std::size_t i) const { return data_[i]; }
+    T* begin() { return data_; }
+    T* end() { return data_ + size_; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+private:
+    void release() {
+        SamplePool::local().release(data_, capacity_ * sizeof(T), owner_);
+        data_ = nullptr;
+        size_ = capacity_ = 0;
+    }
+
+    T* data_;
+    std::size_t size_;
+    std::size_t capacity_;
+    const SamplePool* owner_;  // the pool of the thread that acquired data_, only compared
+};
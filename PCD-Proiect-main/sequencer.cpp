@@ -1,13 +1,27 @@
 // sudo apt install libsndfile1-dev
-// g++-9 -o sequencer sequencer.cpp -lsfml-audio -lsndfile
+// g++-9 -O2 -o sequencer sequencer.cpp -lsndfile -pthread
 
-#include <SFML/Audio.hpp>
 #include <sndfile.h>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <cstdlib>
+#include <thread>
+#include <tuple>
+#include "audio_file.h"
+#include "dsp_chain.h"
+#include "render_kernels.h"
+#include "sample_pool.h"
+#include "sparse_track.h"
+#include "time_stretch.h"
+#include "trace.h"
+#include "probes.h"
 
 // Helper function to parse the sequencing instructions from a text file
 struct SequenceInstruction {
@@ -16,104 +30,352 @@ struct SequenceInstruction {
     float volume;
     int startSliceMs;
     int endSliceMs;
+    dsp::Effects effects;  // the track's effects with the event's own on top (dsp_chain.h)
 };
 
-std::vector<SequenceInstruction> parseInstructions(const std::string& filename) {
+// Five columns per event, then optional effects; "track" lines hold effects for every event.
+// Blank lines are skipped. error is set for a malformed line (the rules of ScoreCheck in
+// upload_check.h, which checks scores as they are uploaded)
+std::vector<SequenceInstruction> parseInstructions(const std::string& filename, std::string& error) {
     std::vector<SequenceInstruction> instructions;
+    dsp::Effects trackEffects;
     std::ifstream file(filename);
     std::string line;
+    int lineNumber = 0;
 
     while (std::getline(file, line)) {
+        ++lineNumber;
         std::istringstream iss(line);
-        SequenceInstruction instruction;
-        iss >> instruction.framesUntilPlayed >> instruction.pitch >> instruction.volume >> instruction.startSliceMs >> instruction.endSliceMs;
-        instructions.push_back(instruction);
+        std::string first;
+        bool valid;
+        if (!(iss >> first)) {
+            continue;
+        }
+        if (first == dsp::TRACK_KEYWORD) {
+            valid = dsp::parse_effects(iss, trackEffects, error);
+        } else {
+            iss.clear();
+            iss.seekg(0);
+            SequenceInstruction instruction;
+            if (!(iss >> instruction.framesUntilPlayed >> instruction.pitch >> instruction.volume >> instruction.startSliceMs >> instruction.endSliceMs)) {
+                valid = false;
+                error = "expected <frames> <pitch> <volume> <start ms> <end ms>";
+            } else if (instruction.framesUntilPlayed < 0) {
+                valid = false;
+                error = "negative <frames>";
+            } else {
+                valid = dsp::parse_effects(iss, instruction.effects, error);
+                instructions.push_back(instruction);
+            }
+        }
+        if (!valid) {
+            error = "line " + std::to_string(lineNumber) + ": " + error;
+            return instructions;
+        }
     }
 
+    // Track lines apply to the whole score, wherever they are
+    if (!trackEffects.empty()) {
+        for (auto& instruction : instructions) {
+            instruction.effects = dsp::Effects::combine(trackEffects, instruction.effects);
+        }
+    }
     return instructions;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <sound file> <instructions file>" << std::endl;
-        return -1;
+// Slices are rendered by several threads once a track has at least this many output samples
+const std::size_t PARALLEL_MIN_SAMPLES = 4 * 1024 * 1024;
+// Time regions per thread, so uneven regions still keep every thread busy
+const unsigned int REGIONS_PER_THREAD = 4;
+
+// The source sound every instruction slices
+struct SourceSound {
+    const float* samples;
+    unsigned int channels;
+    unsigned int sampleRate;
+    int frames;
+};
+
+// Source frames [startFrame, endFrame) of an instruction's slice; empty when they cross
+void sliceBounds(const SequenceInstruction& instruction, const SourceSound& source, int& startFrame, int& endFrame) {
+    // Convert milliseconds to frames
+    startFrame = (instruction.startSliceMs * source.sampleRate) / 1000;
+    endFrame = source.frames - (instruction.endSliceMs * source.sampleRate) / 1000;
+
+    // Ensure the slice boundaries are within the valid range
+    startFrame = std::max(0, startFrame);
+    endFrame = std::min(source.frames, endFrame);
+}
+
+// Whether an instruction changes pitch without changing length (keep_length, time_stretch.h)
+bool keepsLength(const SequenceInstruction& instruction) {
+    return instruction.effects.pitch_mode != dsp::PitchMode::RESAMPLE && instruction.pitch > 0 &&
+           instruction.pitch != 1.0f;
+}
+
+// Output frames of an instruction whose slice is length frames long
+std::size_t eventFrames(const SequenceInstruction& instruction, std::size_t length) {
+    return keepsLength(instruction) ? length : render::pitched_frames(length, instruction.pitch);
+}
+
+// Renders an instruction's slice, whose source starts at startFrame, as outputFrames frames
+// into out. It is pitched and scaled in one pass; a slice with effects is rendered and
+// processed one block at a time instead. A slice that keeps its length is stretched first
+// and the stretched copy is pitched back to the slice's length
+void renderSlice(const SourceSound& source, const SequenceInstruction& instruction, int startFrame,
+                 std::size_t outputFrames, dsp::StretchCache& stretcher, float* out) {
+    unsigned int channelCount = source.channels;
+    render::VolumeGain gain = {instruction.volume};
+    const float* slice = source.samples + static_cast<std::size_t>(startFrame) * channelCount;
+    if (keepsLength(instruction)) {
+        // Long enough for every source position the pitch step reads
+        render::PitchStep last = {instruction.pitch};
+        slice = stretcher.stretch(instruction.effects.pitch_mode, slice, outputFrames, channelCount,
+                                  source.sampleRate, last(outputFrames - 1) + 1);
     }
+    auto renderFrames = [&](float* block, std::size_t firstFrame, std::size_t frameCount) {
+        if (instruction.pitch == 1.0f) {
+            // Unpitched slices read consecutive frames, which the kernels vectorize
+            render::SameRate position = {0};
+            render::render_block(slice, channelCount, block, channelCount, firstFrame, frameCount, position, gain);
+        } else {
+            render::PitchStep position = {instruction.pitch};
+            render::render_block(slice, channelCount, block, channelCount, firstFrame, frameCount, position, gain);
+        }
+    };
+    dsp::EffectChain chain(instruction.effects, channelCount, source.sampleRate, outputFrames);
+    if (!chain.active()) {
+        renderFrames(out, 0, outputFrames);
+        return;
+    }
+    for (std::size_t firstFrame = 0; firstFrame < outputFrames; firstFrame += dsp::BLOCK_FRAMES) {
+        std::size_t frameCount = std::min(dsp::BLOCK_FRAMES, outputFrames - firstFrame);
+        float* block = out + firstFrame * channelCount;
+        renderFrames(block, firstFrame, frameCount);
+        chain.process(block, firstFrame, frameCount);
+    }
+}
 
-    std::string soundFilename = argv[1];
-    std::string instructionsFilename = argv[2];
+// Slices that occur more than once in a score, each rendered once and copied for every
+// occurrence: drum patterns repeat the same few hits, so a track then costs one render per
+// distinct hit plus a copy per hit
+struct SliceMemo {
+    std::vector<PooledSamples<float>> slices;
+    std::vector<int> sliceOf;  // per instruction, its entry in slices or -1
+    std::size_t hits = 0;      // instructions copied from the memo, less the one render per slice
+};
 
-    // Load the original sound file
-    sf::SoundBuffer buffer;
-    if (!buffer.loadFromFile(soundFilename)) {
-        std::cerr << "Failed to load sound file." << std::endl;
-        return -1;
+// Everything that decides the samples of a rendered slice
+struct SliceKey {
+    int startFrame;
+    int endFrame;
+    float pitch;
+    float volume;
+    std::string effects;
+
+    bool operator<(const SliceKey& other) const {
+        return std::tie(startFrame, endFrame, pitch, volume, effects) <
+               std::tie(other.startFrame, other.endFrame, other.pitch, other.volume, other.effects);
     }
+};
 
-    // Get the samples and sample rate
-    const sf::Int16* samples = buffer.getSamples();
-    std::size_t sampleCount = buffer.getSampleCount();
-    unsigned int sampleRate = buffer.getSampleRate();
-    unsigned int channelCount = buffer.getChannelCount();
+// Renders every repeated slice of the score once, on up to threadCount threads
+SliceMemo memoizeSlices(const SourceSound& source, const std::vector<SequenceInstruction>& instructions,
+                        unsigned int threadCount) {
+    SliceMemo memo;
+    memo.sliceOf.assign(instructions.size(), -1);
+    std::map<SliceKey, std::vector<std::size_t>> occurrences;
+    for (std::size_t i = 0; i < instructions.size(); ++i) {
+        int startFrame, endFrame;
+        sliceBounds(instructions[i], source, startFrame, endFrame);
+        if (startFrame >= endFrame || eventFrames(instructions[i], endFrame - startFrame) == 0) continue;
+        const SequenceInstruction& instruction = instructions[i];
+        occurrences[{startFrame, endFrame, instruction.pitch, instruction.volume, instruction.effects.key()}].push_back(i);
+    }
+    std::vector<std::size_t> firsts;  // an instruction of each memoized slice
+    for (const auto& entry : occurrences) {
+        if (entry.second.size() < 2) continue;
+        for (std::size_t i : entry.second) memo.sliceOf[i] = static_cast<int>(firsts.size());
+        memo.hits += entry.second.size() - 1;  // the first occurrence is rendered, a miss
+        firsts.push_back(entry.second.front());
+    }
+    memo.slices.resize(firsts.size());
 
-    // Parse the sequencing instructions
-    std::vector<SequenceInstruction> instructions = parseInstructions(instructionsFilename);
-
-    // Create a vector to hold the sequenced sound
-    std::vector<sf::Int16> sequencedSamples;
-
-    for (const auto& instruction : instructions) {
-        // Convert milliseconds to samples
-        int startSample = (instruction.startSliceMs * sampleRate) / 1000;
-        int endSample = sampleCount - (instruction.endSliceMs * sampleRate) / 1000;
-
-        // Ensure the slice boundaries are within the valid range
-        startSample = std::max(0, startSample);
-        endSample = std::min(static_cast<int>(sampleCount), endSample);
-
-        // Apply pitch change (stretch/compress samples)
-        std::vector<sf::Int16> pitchedSamples;
-        for (int i = startSample; i < endSample; ++i) {
-            int newIndex = static_cast<int>((i - startSample) / instruction.pitch);
-            if (newIndex + startSample < endSample) {
-                pitchedSamples.push_back(samples[newIndex + startSample]);
-            }
+    std::atomic<std::size_t> nextSlice(0);
+    auto renderSlices = [&] {
+        dsp::StretchCache stretcher;
+        std::size_t slice;
+        while ((slice = nextSlice++) < firsts.size()) {
+            const SequenceInstruction& instruction = instructions[firsts[slice]];
+            int startFrame, endFrame;
+            sliceBounds(instruction, source, startFrame, endFrame);
+            std::size_t outputFrames = eventFrames(instruction, endFrame - startFrame);
+            memo.slices[slice].resize(outputFrames * source.channels);
+            renderSlice(source, instruction, startFrame, outputFrames, stretcher, memo.slices[slice].data());
         }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int t = 1; t < std::min<std::size_t>(threadCount, firsts.size()); ++t) {
+        threads.emplace_back(renderSlices);
+    }
+    renderSlices();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return memo;
+}
 
-        // Apply volume change
-        for (auto& sample : pitchedSamples) {
-            sample = static_cast<sf::Int16>(sample * instruction.volume);
-        }
+// Renders instructions [first, last) onto a track of their own, starting at its position 0.
+// Only the slices are stored; the silence before them is just a gap in the sparse track.
+// Slices go straight into the track's regions, or are copied there from the memo
+SparseTrack renderInstructions(const SourceSound& source, const std::vector<SequenceInstruction>& instructions,
+                               std::size_t first, std::size_t last, const SliceMemo& memo) {
+    unsigned int channelCount = source.channels;
+    SparseTrack track(channelCount, source.sampleRate);
+    dsp::StretchCache stretcher;
+    for (std::size_t index = first; index < last; ++index) {
+        const SequenceInstruction& instruction = instructions[index];
+        int startFrame, endFrame;
+        sliceBounds(instruction, source, startFrame, endFrame);
 
         // Insert silence for frames until played
         int silenceFrames = instruction.framesUntilPlayed * channelCount;
-        sequencedSamples.insert(sequencedSamples.end(), silenceFrames, 0);
+        track.append_silence(silenceFrames);
+
+        // Apply pitch change (stretch/compress frames) and volume change
+        if (startFrame >= endFrame) continue;
+        std::size_t outputFrames = eventFrames(instruction, endFrame - startFrame);
+        SOUNDSEQ_PROBE4(instruction, probe_job_id(), index, endFrame - startFrame, outputFrames);
+        int memoized = memo.sliceOf[index];
+        track.append_rendered(outputFrames * channelCount, [&](float* out) {
+            if (memoized >= 0) {
+                const PooledSamples<float>& slice = memo.slices[memoized];
+                memcpy(out, slice.data(), slice.size() * sizeof(float));
+            } else {
+                renderSlice(source, instruction, startFrame, outputFrames, stretcher, out);
+            }
+        });
+    }
+    return track;
+}
+
+// Renders the whole score. Every instruction starts where the previous one ended, so once the
+// slice lengths are known the output splits into time regions (runs of whole instructions)
+// that do not overlap: each is rendered on its own track by one of the threads and the tracks
+// are joined in order. Region boundaries never cut a slice, so the track is bit-identical to
+// rendering the instructions one after another. Repeated slices are rendered once up front
+// (memoizeSlices); memoHits, if given, receives the number of instructions the memo saved a render for
+SparseTrack renderScore(const SourceSound& source, const std::vector<SequenceInstruction>& instructions,
+                        unsigned int threadCount, std::size_t* memoHits = nullptr) {
+    SliceMemo memo = memoizeSlices(source, instructions, threadCount);
+    if (memoHits) *memoHits = memo.hits;
+
+    // Output samples of each instruction, the work of its region
+    std::vector<std::size_t> work(instructions.size(), 0);
+    std::size_t totalWork = 0;
+    for (std::size_t i = 0; i < instructions.size(); ++i) {
+        int startFrame, endFrame;
+        sliceBounds(instructions[i], source, startFrame, endFrame);
+        if (startFrame < endFrame) {
+            work[i] = eventFrames(instructions[i], endFrame - startFrame) * source.channels;
+        }
+        totalWork += work[i];
+    }
+    if (threadCount <= 1 || totalWork < PARALLEL_MIN_SAMPLES) {
+        return renderInstructions(source, instructions, 0, instructions.size(), memo);
+    }
+
+    // Cut the score into regions of about equal work
+    std::vector<std::size_t> cuts = {0};
+    std::size_t target = totalWork / (threadCount * REGIONS_PER_THREAD) + 1;
+    std::size_t accumulated = 0;
+    for (std::size_t i = 0; i < instructions.size(); ++i) {
+        accumulated += work[i];
+        if (accumulated >= target && i + 1 < instructions.size()) {
+            cuts.push_back(i + 1);
+            accumulated = 0;
+        }
+    }
+    cuts.push_back(instructions.size());
+
+    std::vector<SparseTrack> parts(cuts.size() - 1);
+    std::atomic<std::size_t> nextPart(0);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < std::min<std::size_t>(threadCount, parts.size()); ++t) {
+        threads.emplace_back([&] {
+            std::size_t part;
+            while ((part = nextPart++) < parts.size()) {
+                parts[part] = renderInstructions(source, instructions, cuts[part], cuts[part + 1], memo);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
 
-        // Append the transformed samples to the sequenced sound
-        sequencedSamples.insert(sequencedSamples.end(), pitchedSamples.begin(), pitchedSamples.end());
+    SparseTrack track(source.channels, source.sampleRate);
+    for (auto& part : parts) {
+        track.append_track(std::move(part));
     }
+    return track;
+}
 
-    // Write the new sound file using libsndfile
-    SF_INFO sfInfo;
-    sfInfo.frames = sequencedSamples.size() / channelCount;
-    sfInfo.samplerate = sampleRate;
-    sfInfo.channels = channelCount;
-    sfInfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+int main(int argc, char* argv[]) {
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    if (argc == 5 && std::string(argv[3]) == "--threads" && atoi(argv[4]) > 0) {
+        threadCount = atoi(argv[4]);
+    } else if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <sound file> <instructions file> [--threads N]" << std::endl;
+        return -1;
+    }
 
-    SNDFILE* outFile = sf_open("sequenced.wav", SFM_WRITE, &sfInfo);
-    if (!outFile) {
-        std::cerr << "Failed to create output sound file." << std::endl;
+    std::string soundFilename = argv[1];
+    std::string instructionsFilename = argv[2];
+    job_trace::init_child("sequencer");
+
+    // Load the original sound file as float samples, whatever its resolution
+    job_trace::Span decodeSpan("decode");
+    AudioFile sound;
+    if (!sound.load(soundFilename) || sound.channels == 0) {
+        std::cerr << "Failed to load sound file." << std::endl;
         return -1;
     }
+    decodeSpan.args().add("file", soundFilename).add("frames", static_cast<long long>(sound.frames()));
+    decodeSpan.end();
 
-    sf_count_t count = sf_write_short(outFile, sequencedSamples.data(), sequencedSamples.size());
-    if (count != sequencedSamples.size()) {
-        std::cerr << "Failed to write samples to output sound file." << std::endl;
-        sf_close(outFile);
+    // Parse the sequencing instructions
+    std::string instructionsError;
+    std::vector<SequenceInstruction> instructions = parseInstructions(instructionsFilename, instructionsError);
+    if (!instructionsError.empty()) {
+        std::cerr << "Invalid instructions, " << instructionsError << std::endl;
         return -1;
     }
 
-    sf_close(outFile);
+    SourceSound source = {sound.samples.data(), sound.channels, sound.sample_rate, static_cast<int>(sound.frames())};
+    job_trace::Span pitchSpan("pitch");
+    std::size_t memoHits = 0;
+    SparseTrack sequencedTrack = renderScore(source, instructions, threadCount, &memoHits);
+
+    pitchSpan.args().add("instructions", static_cast<long long>(instructions.size()))
+        .add("memoized", static_cast<long long>(memoHits))
+        .add("samples", static_cast<long long>(sequencedTrack.content_samples()));
+    pitchSpan.end();
 
-    std::cout << "Sequenced sound saved as sequenced.wav" << std::endl;
+    // Write the sparse track for the mixer
+    job_trace::Span writeSpan("write");
+    if (!sequencedTrack.write("sequenced.sptk")) {
+        std::cerr << "Failed to write sequenced track." << std::endl;
+        return -1;
+    }
+    writeSpan.end();
+    // Slices copied from the memo and slices rendered, passed on by the worker to the server's STATS
+    std::ofstream("slice_memo.txt") << memoHits << " " << instructions.size() - memoHits << "\n";
+
+    std::cout << "Sequenced sound saved as sequenced.sptk (" << sequencedTrack.content_samples() << " of "
+              << sequencedTrack.total_samples << " samples stored, " << memoHits << " of " << instructions.size()
+              << " slices copied from repeated ones)" << std::endl;
+    if (getenv("SAMPLE_POOL_STATS")) {
+        std::cout << SamplePool::local().describe() << std::endl;
+    }
     return 0;
 }
@@ -12,25 +12,131 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <signal.h>
+#include <arpa/inet.h>
+#include "job_stats.h"
+#include "job_scheduler.h"
+#include "job_registry.h"
+#include "job_journal.h"
+#include "codec_pool.h"
+#include "connection_reader.h"
+#include "admission_control.h"
+#include "cost_model.h"
+#include "sample_convert.h"
+#include "async_io.h"
+#include "crc32c.h"
+#include "trace.h"
+#include "probes.h"
+#include "node_pool.h"
+#include "sha256.h"
+#include "upload_check.h"
+#include <ftw.h>
+#include <sys/prctl.h>
 
 const int PORT = 8080;
 const int MAX_CLIENTS = 10;
 const std::string SERVER_FOLDER = "./jobs/";
 const std::string WORKER_EXEC = "./worker";
-const uint32_t MAX_FILE_SIZE = 100 * 1024 * 1024; // 100 MB limit
+const std::string RENDER_NODE_EXEC = "./render_node";
+const std::string LOCAL_NODE_CACHE = "./node_cache/"; // sound caches of --local-nodes
+const uint64_t MAX_FILE_SIZE = 64ULL * 1024 * 1024 * 1024; // 64 GB, bounded by --max-inflight-mb as well
+const uint32_t LEGACY_SIZE_64 = 0xFFFFFFFF; // untagged 4-byte size announcing an 8-byte size
+const uint32_t MAX_LEGACY_SIZE = 0x40000000; // 4-byte sizes from here on would look like tagged verbs
+const uint64_t MAX_CHUNK_SIZE = 16 * 1024 * 1024; // CHUNK payload
+const uint64_t FETCH_CHUNK_SIZE = 1024 * 1024; // DATA frames of a ranged FETCH
+const int RESUME_GRACE_SECONDS = 600; // unsubmitted uploads outlive their connection this long
+const int DEFAULT_WAIT_MS = 30000; // WAIT without a timeout
+const int MAX_WAIT_MS = 600000;
+const int DEFAULT_RETENTION_HOURS = 24; // finished jobs are forgotten and deleted after this, --retention-hours N
+const int RETENTION_SWEEP_SECONDS = 60;
 const char *SOCKET_PATH = "/tmp/job_server_socket";
 const int BUFFER_SIZE = 1024;
+const int MAX_CONCURRENT_JOBS = 2; // Worker processes running at the same time
+const std::string JOURNAL_PATH = SERVER_FOLDER + "journal.log";
+const int CODEC_THREADS = 2; // Threads encoding results for transport
 
-std::mutex folder_mutex;
-std::atomic<bool> is_wav_expected(true);
+ServerStats server_stats;
+JobScheduler job_scheduler;
+JobRegistry job_registry;
+JobJournal job_journal;
+CodecPool codec_pool;
+AdmissionControl admission;
+NodePool node_pool;
+
+// Registry transition followed by its journal record; only dispatches are not waited on
+bool set_job_state(const std::string& job_id, JobState from, JobState to) {
+    if (!job_registry.transition(job_id, from, to)) {
+        return false;
+    }
+    // A job holds an admission slot until it is dispatched and its bytes until it finishes
+    if ((from == JOB_UPLOADING || from == JOB_QUEUED) && to != JOB_QUEUED) {
+        admission.release_job();
+    }
+    JobRecord record;
+    if ((to == JOB_DONE || to == JOB_FAILED || to == JOB_CANCELLED) && job_registry.get(job_id, record)) {
+        admission.release_bytes(record.bytes);
+    }
+    job_journal.append(std::string("STATE ") + job_id + " " + job_state_token(to), to != JOB_RUNNING);
+    return true;
+}
+
+// Worker process (group) of every dispatched job, used to pause or cancel it
+std::mutex running_mutex;
+std::map<std::string, pid_t> running_jobs;
+std::set<std::string> cancelled_jobs;
+std::set<std::string> remote_jobs; // dispatched jobs whose tracks are on render nodes, before their worker starts
+
+// Sends a signal to the whole process group of a running job's worker
+bool signal_running_job(const std::string& job_id, int signal_number) {
+    std::lock_guard<std::mutex> lock(running_mutex);
+    auto it = running_jobs.find(job_id);
+    if (it == running_jobs.end()) {
+        // Tracks on render nodes are finished, but no further ones are sent and the worker is not started
+        if (signal_number == SIGTERM && remote_jobs.count(job_id)) {
+            cancelled_jobs.insert(job_id);
+            return true;
+        }
+        return false;
+    }
+    if (signal_number == SIGTERM) {
+        cancelled_jobs.insert(job_id);
+        kill(-it->second, SIGCONT); // a paused worker has to run to receive SIGTERM
+    }
+    kill(-it->second, signal_number);
+    return true;
+}
 
 void send_ack(int sock, const std::string& message) {
-    send(sock, message.c_str(), message.size(), 0);
+    ssize_t bytes_sent = send(sock, message.c_str(), message.size(), 0);
+    if (bytes_sent > 0) server_stats.bytes_out += bytes_sent;
+}
+
+bool send_all(int sock, const char* data, size_t size) {
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n = send(sock, data + sent, size - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+        server_stats.bytes_out += n;
+    }
+    return true;
+}
+
+// Job folders are named <prefix>job_<id>; the id stays the same across state renames
+std::string job_id_from_folder(const std::string& folder) {
+    size_t pos = folder.rfind("job_");
+    return pos == std::string::npos ? folder : folder.substr(pos + 4);
 }
 
 bool is_directory(const std::string& path) {
@@ -84,16 +190,22 @@ int send_file(int socket, const std::string& file_path) {
         return -1;
     }
     std::cout << "Starting sending...\n";
-    std::ifstream file_stream(file_path, std::ios::binary | std::ios::ate);
-    if (!file_stream.is_open()) {
+    AsyncFile file;
+    if (!file.open(file_path, O_RDONLY)) {
         std::cerr << "Error opening file: " << file_path << std::endl;
         return -1;
     }
-    std::streamsize file_size = file_stream.tellg();
-    file_stream.seekg(0, std::ios::beg);
-    uint32_t size_to_send = htonl(static_cast<uint32_t>(file_size)); // ensure proper conversion
+    uint64_t file_size = file.size();
+    // 4-byte size, or the 64-bit marker and 8 bytes
+    char size_to_send[12];
+    size_t size_bytes = file_size < LEGACY_SIZE_64 ? 4 : 12;
+    uint32_t short_size = htonl(static_cast<uint32_t>(std::min<uint64_t>(file_size, LEGACY_SIZE_64)));
+    memcpy(size_to_send, &short_size, sizeof(short_size));
+    for (size_t i = 4; i < size_bytes; ++i) {
+        size_to_send[i] = static_cast<char>(file_size >> (8 * (11 - i)));
+    }
     std::cout << "File size to send: " << file_size << " bytes\n";
-    if (send(socket, &size_to_send, sizeof(size_to_send), 0) == -1) {
+    if (!send_all(socket, size_to_send, size_bytes)) {
         std::cerr << "Error sending file size.\n";
         return -1;
     }
@@ -103,57 +215,42 @@ int send_file(int socket, const std::string& file_path) {
         return -1;
     }
     std::cout << "Received acknowledgment of file size.\n";
-    char buffer[1024];
-    while (file_stream.read(buffer, sizeof(buffer))) {
-        ssize_t bytes_sent = send(socket, buffer, file_stream.gcount(), 0);
-        if (bytes_sent == -1) {
+    // The next chunk is read ahead while this one is sent
+    char buffer[64 * 1024];
+    std::size_t chunk;
+    while ((chunk = file.read(buffer, sizeof(buffer))) > 0) {
+        if (!send_all(socket, buffer, chunk)) {
             std::cerr << "Error sending file data.\n";
             return -1;
         }
-        std::cout << "Sent " << bytes_sent << " bytes of file data.\n";
-    }
-    if (file_stream.gcount() > 0) {
-        ssize_t bytes_sent = send(socket, buffer, file_stream.gcount(), 0);
-        if (bytes_sent == -1) {
-            std::cerr << "Error sending file data.\n";
-            return -1;
-        }
-        std::cout << "Sent last " << bytes_sent << " bytes of file data.\n";
+        std::cout << "Sent " << chunk << " bytes of file data.\n";
     }
     if (get_ack1(socket) != 0) {
         std::cerr << "Error receiving acknowledgement of " << file_path << " file.\n";
         return -1;
     }
     std::cout << "Received acknowledgment of file data.\n";
-    file_stream.close();
+    file.close();
     std::cout << "Closed file stream.\n";
     return 0;
 }
 
-int get_next_subfolder_number(const std::string& path) {
-    int max_number = 0;
-    for (const auto& entry_name : get_directories(path)) {
-        try {
-            int number = std::stoi(entry_name);
-            if (number > max_number) {
-                max_number = number;
-            }
-        } catch (...) {
-            continue;
-        }
-    }
-    return max_number + 1;
-}
-
-std::string get_job_status(const std::string& folder_name) {
+// Folders written by older servers encode the job state in their name prefix
+bool legacy_job_state(const std::string& folder_name, JobState& state) {
     if (folder_name.find("done_job_") == 0) {
-        return "DONE";
-    } else if (folder_name.find("job_") == 0) {
-        return "In Processing Queue";
+        state = JOB_DONE;
     } else if (folder_name.find("wip_job_") == 0) {
-        return "Unsubmitted";
+        state = JOB_UPLOADING;
+    } else if (folder_name.find("failed_job_") == 0) {
+        state = JOB_FAILED;
+    } else if (folder_name.find("cancelled_job_") == 0) {
+        state = JOB_CANCELLED;
+    } else if (folder_name.find("job_") == 0) {
+        state = JOB_QUEUED;
+    } else {
+        return false;
     }
-    return "Unknown"; // Fallback case
+    return true;
 }
 
 // Function to handle admin commands via UNIX socket
@@ -166,18 +263,90 @@ void handle_admin_commands(int admin_socket) {
             break;
         }
         std::string command(buffer, valread);
+        command.erase(command.find_last_not_of(" \r\n") + 1);
         std::cout << "Admin command received: " << command << std::endl;
 
         // Implement logic for handling admin commands
         if (command == "LIST") {
             std::string response = "Job statuses:\n";
-            std::vector<std::string> job_folders = get_directories(SERVER_FOLDER);
-            for (const auto &folder : job_folders) {
-                std::string job_id = folder.substr(folder.find("_") + 1); // Extract the numeric part
-                std::string status = get_job_status(folder);
-                response += "job ID:" + job_id + " status: " + status + ".\n";
+            for (const auto &job : job_registry.snapshot()) {
+                std::string status = job_state_name(job.state);
+                if (job_scheduler.is_paused(job.job_id)) {
+                    status += " (paused)";
+                }
+                response += "job ID:" + job.job_id + " status: " + status + ".\n";
+            }
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command == "NODES") {
+            std::string response = node_pool.describe();
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command == "QUEUE") {
+            std::string response = job_scheduler.describe();
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command == "STATS") {
+            std::string response = server_stats.to_json();
+            response.insert(response.size() - 1, ",\"admission\":" + admission.to_json());
+            response += "\n";
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command.find("STATS ") == 0) {
+            // Per-stage timeline of a single job
+            std::string response = server_stats.job_to_json(command.substr(6));
+            response = response.empty() ? "Unknown job.\n" : response + "\n";
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command.find("PRIORITY ") == 0) {
+            std::istringstream args(command.substr(9));
+            std::string job_id, class_name;
+            JobPriority priority;
+            args >> job_id >> class_name;
+            std::string response;
+            if (!parse_priority(class_name, priority)) {
+                response = "Usage: PRIORITY <job id> <interactive|normal|batch>\n";
+            } else if (job_scheduler.reprioritize(job_id, priority)) {
+                JobRecord record;
+                if (job_registry.get(job_id, record)) {
+                    job_registry.set_scheduling(job_id, record.client, priority);
+                }
+                job_journal.append("PRIORITY " + job_id + " " + std::to_string(priority));
+                response = "Job " + job_id + " moved to " + class_name + ".\n";
+            } else {
+                response = "Job " + job_id + " is not queued.\n";
             }
             send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command.find("PAUSE ") == 0) {
+            // Queued jobs are skipped by the dispatcher, running ones are stopped
+            std::string job_id = command.substr(6);
+            job_scheduler.pause(job_id);
+            signal_running_job(job_id, SIGSTOP);
+            std::string response = "Job " + job_id + " paused.\n";
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command.find("RESUME ") == 0) {
+            std::string job_id = command.substr(7);
+            job_scheduler.resume(job_id);
+            signal_running_job(job_id, SIGCONT);
+            std::string response = "Job " + job_id + " resumed.\n";
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command.find("CANCEL ") == 0) {
+            std::string job_id = command.substr(7);
+            std::string response;
+            if (job_scheduler.cancel(job_id)) {
+                set_job_state(job_id, JOB_QUEUED, JOB_CANCELLED);
+                server_stats.queue_depth = job_scheduler.size();
+                response = "Job " + job_id + " cancelled.\n";
+            } else if (signal_running_job(job_id, SIGTERM)) {
+                response = "Job " + job_id + " is being cancelled.\n";
+            } else {
+                response = "Job " + job_id + " is not queued or running.\n";
+            }
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command == "DRAIN") {
+            // Stop dispatching new jobs; running jobs finish normally
+            job_scheduler.set_draining(true);
+            std::string response = "Draining: no new jobs will be dispatched.\n";
+            send(admin_socket, response.c_str(), response.size(), 0);
+        } else if (command == "UNDRAIN") {
+            job_scheduler.set_draining(false);
+            std::string response = "Dispatching resumed.\n";
+            send(admin_socket, response.c_str(), response.size(), 0);
         } else if (command == "RESTART") {
             // Implement logic to restart job processing
             // Example: stop existing processing threads and start fresh
@@ -194,127 +363,1527 @@ void handle_admin_commands(int admin_socket) {
     close(admin_socket);
 }
 
-void handle_client(int client_socket) {
-    char buffer[1024] = {0};
-    std::string current_job_folder;
-    std::string current_subfolder;
-    std::ofstream current_file;
-    std::string current_file_name;
+// File of a job being uploaded in checksummed chunks (UPLOAD/CHUNK); it survives reconnects
+struct ResumableUpload {
+    std::string kind;       // "wav" or "txt"; empty when no upload is in progress
+    std::string path;       // created by the first chunk
+    uint64_t size = 0;
+    uint64_t offset = 0;    // bytes stored and acknowledged
+    int64_t trace_start_us = 0;
+    SoundCheck sound;       // checks of the bytes up to offset (upload_check.h)
+    ScoreCheck score;
 
-    
+    bool active() const { return !kind.empty(); }
+};
 
-    while (true) {
-        int valread = read(client_socket, buffer, sizeof(buffer));
-        if (valread <= 0) {
-            std::cout << "Client disconnected." << std::endl;
-            break;
+// A job being uploaded on a connection
+struct UploadJob {
+    std::string job_id;
+    std::string folder;
+    std::string subfolder;
+    int track = 0;
+    bool reuse_track = false;    // the last sound was rejected, its track takes the next one
+    bool wav_expected = true;
+    uint64_t bytes = 0;
+    JobPriority priority = PRIORITY_NORMAL;
+    bool flac_result = false;
+    OutputFormat output_format = OUTPUT_PCM16;
+    bool dither = false;
+    ResumableUpload upload;
+    int64_t trace_start_us = 0;  // trace.h span from OPEN (or the first legacy size) to SUBMIT
+};
+
+// Sending end of a connection, shared with the thread that answers its WAIT commands; every
+// reply on the connection, tagged or not, is sent under its mutex, so lines never interleave
+struct ReplyChannel {
+    int socket;
+    std::mutex mutex;
+    bool open = true;  // false once the connection has ended (the descriptor may be reused)
+
+    explicit ReplyChannel(int client_socket) : socket(client_socket) {}
+
+    void send(const std::string& line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (open) send_ack(socket, line);
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        open = false;
+    }
+};
+
+// Pending WAIT commands. A job reaching a final state (JobRegistry::on_final) or the timeout
+// passing answers them, so the connection that sent WAIT is never blocked on it. One notifier
+// thread (run) sends every answer, under the connection's ReplyChannel
+class JobWaiters {
+public:
+    // Records a WAIT; answered right away if the job has already finished
+    void add(const std::string& job_id, int timeout_ms, std::shared_ptr<ReplyChannel> channel) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Waiter waiter;
+            waiter.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            waiter.channel = channel;
+            waiters_.insert({job_id, waiter});
         }
+        changed_.notify_one();
+        // It may have finished before the waiter was recorded
+        JobRecord job;
+        if (job_registry.get(job_id, job) && job_state_final(job.state)) {
+            job_finished(job_id, job.state);
+        }
+    }
 
-        // Check if the client sent a "CHECK_DONE" command
-        std::string command(buffer, valread);
-        if (command == "CHECK_DONE") {
-            // Check if the job is done
-            bool is_done = false;
-            std::string done_wav_path;
+    // Hands the job's waiters to the notifier thread; never blocks on a connection
+    void job_finished(const std::string& job_id, JobState state) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto range = waiters_.equal_range(job_id);
+            for (auto it = range.first; it != range.second; ++it) {
+                ready_.push_back({it->second.channel, std::string("STATUS ") + job_id + " " + job_state_token(state) + "\n"});
+            }
+            waiters_.erase(range.first, range.second);
+        }
+        changed_.notify_one();
+    }
 
-            {
-                std::cout<<current_job_folder<<"da \n";
-                std::lock_guard<std::mutex> lock(folder_mutex);
-                if (!current_job_folder.empty()) {
-                    std::string potential_done_job_folder = current_job_folder;
-                    potential_done_job_folder.replace(potential_done_job_folder.find("wip_job_"), 8, "done_job_");
-                    done_wav_path = potential_done_job_folder + "/done.wav";
-                    std::cout<<done_wav_path<<"\n";
-                    if (std::ifstream(done_wav_path)) {
-                        is_done = true;
-                        current_job_folder = potential_done_job_folder;
-                    }
+    // The notifier thread: sends the answers of finished jobs, and of the waits whose timeout
+    // passed with the job's current state
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            auto now = std::chrono::steady_clock::now();
+            auto next = now + std::chrono::hours(1);
+            std::vector<std::pair<std::string, std::shared_ptr<ReplyChannel>>> expired;
+            for (auto it = waiters_.begin(); it != waiters_.end();) {
+                if (it->second.deadline <= now) {
+                    expired.push_back({it->first, it->second.channel});
+                    it = waiters_.erase(it);
+                } else {
+                    next = std::min(next, it->second.deadline);
+                    ++it;
+                }
+            }
+            if (expired.empty() && ready_.empty()) {
+                changed_.wait_until(lock, next);
+                continue;
+            }
+            std::vector<Reply> replies;
+            replies.swap(ready_);
+            lock.unlock();
+            for (const auto& waiter : expired) {
+                JobRecord job;
+                if (job_registry.get(waiter.first, job)) {
+                    replies.push_back({waiter.second, std::string("STATUS ") + waiter.first + " " + job_state_token(job.state) + "\n"});
+                } else {
+                    replies.push_back({waiter.second, "ERROR " + waiter.first + " unknown job\n"});  // forgotten meanwhile
                 }
             }
+            // A connection in the middle of a FETCH holds its channel; its answer follows the download
+            for (const auto& reply : replies) {
+                reply.channel->send(reply.line);
+            }
+            lock.lock();
+        }
+    }
+
+private:
+    struct Waiter {
+        std::chrono::steady_clock::time_point deadline;
+        std::shared_ptr<ReplyChannel> channel;
+    };
+
+    struct Reply {
+        std::shared_ptr<ReplyChannel> channel;
+        std::string line;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable changed_;  // a waiter was added or a job finished
+    std::multimap<std::string, Waiter> waiters_;
+    std::vector<Reply> ready_;  // answers of finished jobs, not sent yet
+};
+
+JobWaiters job_waiters;
+
+// Per-connection state; a connection can upload and collect any number of jobs at once
+struct ClientSession {
+    int socket;
+    ConnectionReader reader;
+    std::shared_ptr<ReplyChannel> replies;
+    std::string client_name = "unknown";
+    JobPriority priority = PRIORITY_NORMAL;  // defaults for jobs opened on this connection
+    bool flac_result = false;
+    OutputFormat output_format = OUTPUT_PCM16;
+    bool dither = false;
+    UploadJob legacy_job;                    // job of the untagged wav/txt protocol
+    std::string legacy_submitted;            // last untagged job submitted, answered by CHECK_DONE
+    std::map<std::string, UploadJob> jobs;   // tagged jobs still being uploaded
+    std::map<std::string, std::unique_ptr<AsyncFile>> upload_files;  // resumable uploads open on this connection
+    std::vector<char> chunk;                 // CHUNK payload being checked
 
-            if (is_done) {
-                send_ack(client_socket, "Job ready.");
-                send_file(client_socket, done_wav_path);
+    ClientSession(int client_socket)
+        : socket(client_socket), reader(client_socket, &server_stats.bytes_in), replies(new ReplyChannel(client_socket)) {}
+
+    void reply(const std::string& line) { replies->send(line); }
+};
+
+// Tagged jobs whose connection dropped before SUBMIT, kept for a while so the same client can
+// reconnect and carry on where its acknowledged uploads stopped
+struct DetachedUpload {
+    UploadJob job;
+    std::string client;
+    std::chrono::steady_clock::time_point since;
+};
+std::mutex detached_mutex;
+std::map<std::string, DetachedUpload> detached_uploads;
+
+void detach_upload(const std::string& client, const UploadJob& job) {
+    std::lock_guard<std::mutex> lock(detached_mutex);
+    detached_uploads[job.job_id] = DetachedUpload{job, client, std::chrono::steady_clock::now()};
+}
+
+// Moves a job left by an earlier connection of the same client to this one
+bool reattach_upload(ClientSession& session, const std::string& job_id) {
+    std::lock_guard<std::mutex> lock(detached_mutex);
+    auto it = detached_uploads.find(job_id);
+    if (it == detached_uploads.end() || it->second.client != session.client_name) {
+        return false;
+    }
+    session.jobs[job_id] = it->second.job;
+    detached_uploads.erase(it);
+    return true;
+}
+
+// Cancels detached jobs nobody came back for; their bytes and slots are given back
+void expire_detached_uploads() {
+    std::vector<UploadJob> expired;
+    {
+        std::lock_guard<std::mutex> lock(detached_mutex);
+        auto deadline = std::chrono::steady_clock::now() - std::chrono::seconds(RESUME_GRACE_SECONDS);
+        for (auto it = detached_uploads.begin(); it != detached_uploads.end();) {
+            if (it->second.since < deadline) {
+                expired.push_back(it->second.job);
+                it = detached_uploads.erase(it);
             } else {
-                send_ack(client_socket, "Job not ready.");
+                ++it;
             }
+        }
+    }
+    for (const auto& job : expired) {
+        admission.release_bytes(job.upload.size - job.upload.offset);
+        set_job_state(job.job_id, JOB_UPLOADING, JOB_CANCELLED);
+    }
+}
+
+// Peak memory the job's worker is expected to need, from its sound headers and instructions
+uint64_t estimate_job_memory(const std::string& job_id, const std::string& folder) {
+    JobRecord record;
+    if (!job_registry.get(job_id, record)) {
+        return 0;
+    }
+    // Formats checked at upload; FLAC streams that did not give their length are read again
+    std::map<int, AudioInfo> known;
+    for (const auto& track : record.tracks) {
+        if (track.second.channels > 0 && (track.second.frames > 0 || !track.second.flac)) {
+            AudioInfo& info = known[track.first];
+            info.frames = track.second.frames;
+            info.channels = track.second.channels;
+            info.sample_rate = track.second.sample_rate;
+        }
+    }
+    JobEstimate estimate = CostModel::estimate_job(folder, record.track_count, known);
+    std::vector<uint64_t> track_kb;
+    for (const auto& track : estimate.tracks) {
+        track_kb.push_back(track.peak_bytes / 1024);
+    }
+    server_stats.memory_estimated(job_id, track_kb, estimate.sequence_peak_bytes / 1024,
+                                  estimate.mix_peak_bytes / 1024, estimate.peak_bytes / 1024);
+    return estimate.peak_bytes;
+}
+
+// Share of its client's deficit a job takes: its sounds as 16-bit PCM and its scores, so FLAC
+// and WAV uploads of the same audio weigh the same. Uploaded bytes when a track was not checked
+// or its length is unknown
+uint64_t job_cost(const std::string& job_id, uint64_t uploaded_bytes) {
+    JobRecord record;
+    if (!job_registry.get(job_id, record) || int(record.tracks.size()) < record.track_count) {
+        return uploaded_bytes;
+    }
+    uint64_t cost = 0;
+    for (const auto& track : record.tracks) {
+        const TrackInfo& info = track.second;
+        if (info.channels == 0 || (info.flac && info.frames == 0)) {
+            return uploaded_bytes;
+        }
+        cost += info.frames * info.channels * 2 + info.score_bytes;
+    }
+    return cost;
+}
+
+// Refusal sent instead of accepting more work while the server is at one of its bounds
+std::string busy_message() {
+    return admission.busy_message(job_scheduler.size(), MAX_CONCURRENT_JOBS);
+}
+
+bool start_job(ClientSession& session, UploadJob& job) {
+    if (!admission.admit_job()) {
+        return false;
+    }
+    // The job folder keeps its name for the whole job; the registry holds the state
+    do {
+        job.job_id = std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+        job.folder = SERVER_FOLDER + "job_" + job.job_id;
+    } while (!job_registry.create(job.job_id, job.folder));
+    job_journal.append("CREATE " + job.job_id + " " + job.folder);
+    IoRing::local().wait(IoRing::local().mkdir(job.folder.c_str(), 0777));
+    job.priority = session.priority;
+    job.flac_result = session.flac_result;
+    job.output_format = session.output_format;
+    job.dither = session.dither;
+    job.wav_expected = true;
+    job.bytes = 0;
+    job.trace_start_us = job_trace::now_us();
+    server_stats.upload_started(job.job_id);
+    return true;
+}
+
+// A sound starts a new track of the job
+void start_track(UploadJob& job) {
+    if (job.reuse_track) {
+        job.reuse_track = false;
+        return;
+    }
+    job.track = job_registry.allocate_track(job.job_id);
+    std::string track = std::to_string(job.track);
+    job_journal.append("TRACK " + job.job_id + " " + track);
+    job.subfolder = job.folder + "/" + track;
+}
+
+// Keeps what the upload checks read with the job, so nothing has to read the files again
+void record_sound(const UploadJob& job, const SoundCheck& check) {
+    job_registry.set_sound_info(job.job_id, job.track, check.info());
+    job_journal.append(JobJournal::sound_record(job.job_id, job.track, check.info()));
+}
+
+void record_score(const UploadJob& job, const ScoreCheck& check) {
+    job_registry.set_score_info(job.job_id, job.track, check.bytes(), check.events());
+    TrackInfo info;
+    info.score_bytes = check.bytes();
+    info.events = check.events();
+    job_journal.append(JobJournal::score_record(job.job_id, job.track, info));
+}
+
+// Drops a file that failed its check; the job waits for the same kind of file again. A sound's
+// folder goes too (the worker runs every track folder) and its number is kept for the next sound
+void reject_upload(UploadJob& job, bool is_sound, const std::string& file_name, const std::string& reason) {
+    if (!file_name.empty()) {
+        unlink(file_name.c_str());
+    }
+    if (is_sound) {
+        rmdir(job.subfolder.c_str());
+    }
+    job.reuse_track = is_sound;
+    std::cerr << "Job " << job.job_id << ": rejected " << (is_sound ? "sound" : "instructions") << ": " << reason << std::endl;
+}
+
+// Creates the file for the job's next upload once its first bytes tell what kind of sound it
+// is; the track folder and the file are created in one batch (async_io.h)
+bool create_upload_file(UploadJob& job, bool is_sound, const char* head, size_t head_size, AsyncFile& file,
+                        std::string& file_name) {
+    IoRing& io = IoRing::local();
+    // FLAC uploads are stored as they are; the sequencer decodes them directly
+    file_name = job.subfolder + "/instructions.txt";
+    uint64_t made = 0;
+    if (is_sound) {
+        file_name = job.subfolder + (is_flac_data(head, head_size) ? "/sound.flac" : "/sound.wav");
+        made = io.mkdir(job.subfolder.c_str(), 0777, true);
+    }
+    int fd = io.wait(io.open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (made && io.wait(made) < 0 && fd == -ECANCELED) {
+        // The linked mkdir failed (the folder is already there)
+        fd = io.wait(io.open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    }
+    if (fd < 0) {
+        std::cerr << "Error creating " << file_name << ": " << strerror(-fd) << std::endl;
+        return false;
+    }
+    file.adopt(fd);
+    return true;
+}
+
+// Receives one file of the job; a sound starts a new track, a score completes it.
+// The file is written behind the socket reads and checked as it arrives; once the check
+// fails nothing more is written and the rest is only read, to keep the stream in sync.
+// rejected is set to the reason a file was refused
+bool receive_file(ClientSession& session, UploadJob& job, bool is_sound, uint64_t file_size, std::string& rejected) {
+    if (is_sound) {
+        start_track(job);
+    }
+
+    int64_t trace_start_us = job_trace::now_us();
+    char buffer[64 * 1024];
+    AsyncFile file;
+    std::string file_name;
+    SoundCheck sound(file_size);
+    ScoreCheck score;
+    bool written = true;
+    uint64_t total_read = 0;
+    while (total_read < file_size) {
+        ssize_t valread = session.reader.read_some(buffer, std::min<uint64_t>(sizeof(buffer), file_size - total_read));
+        if (valread <= 0) {
+            std::cerr << "Error reading file data." << std::endl;
+            break;
+        }
+        total_read += valread;
+        if (rejected.empty() && !(is_sound ? sound.feed(buffer, valread) : score.feed(buffer, valread))) {
+            rejected = is_sound ? sound.error() : score.error();
+        }
+        if (!rejected.empty() || !written) {
+            continue;
+        }
+        if (!file.is_open() && !create_upload_file(job, is_sound, buffer, valread, file, file_name)) {
+            written = false;
             continue;
         }
+        file.write(buffer, valread);
+    }
+    if (rejected.empty() && total_read == file_size) {
+        if (is_sound && !sound.done()) {
+            rejected = "empty file";
+        } else if (!is_sound && !score.finish()) {
+            rejected = score.error();
+        }
+    }
+    written = file.close() && written;
+    if (!rejected.empty()) {
+        reject_upload(job, is_sound, file_name, rejected);
+        admission.release_bytes(file_size);
+        SOUNDSEQ_PROBE3(file_rejected, job.job_id.c_str(), is_sound ? "wav" : "txt", total_read);
+        return false;
+    }
+    if (is_sound && file_name.empty()) {
+        // Nothing arrived; the folder still marks the track
+        IoRing::local().wait(IoRing::local().mkdir(job.subfolder.c_str(), 0777));
+    }
+    if (total_read == file_size) {
+        if (is_sound) {
+            record_sound(job, sound);
+        } else {
+            record_score(job, score);
+        }
+    }
+    admission.release_bytes(file_size - total_read);
+    job.bytes += total_read;
+    job_registry.add_bytes(job.job_id, total_read);
+    job.wav_expected = !is_sound;
+    SOUNDSEQ_PROBE3(file_received, job.job_id.c_str(), is_sound ? "wav" : "txt", total_read);
+    job_trace::emit(job.folder, job.job_id, is_sound ? "receive wav" : "receive txt", trace_start_us, job_trace::now_us(),
+                    job_trace::Args().add("bytes", total_read));
+    return written && total_read == file_size;
+}
+
+// Stores one chunk of the job's resumable upload at the acknowledged offset; the file is
+// created by the first chunk and reopened (cut back to the offset) after a reconnect
+bool store_chunk(ClientSession& session, UploadJob& job, const char* data, size_t size) {
+    ResumableUpload& upload = job.upload;
+    std::unique_ptr<AsyncFile>& file = session.upload_files[job.job_id];
+    if (!file) {
+        file.reset(new AsyncFile());
+        bool opened = upload.path.empty()
+                          ? create_upload_file(job, upload.kind == "wav", data, size, *file, upload.path)
+                          : truncate(upload.path.c_str(), upload.offset) == 0 && file->open(upload.path, O_WRONLY);
+        if (!opened) {
+            session.upload_files.erase(job.job_id);
+            return false;
+        }
+    }
+    // Acknowledged only once written
+    if (!file->seek(upload.offset) || !file->write(data, size) || !file->flush()) {
+        session.upload_files.erase(job.job_id);
+        return false;
+    }
+    upload.offset += size;
+    job.bytes += size;
+    job_registry.add_bytes(job.job_id, size);
+    if (upload.offset == upload.size) {
+        bool closed = file->close();
+        session.upload_files.erase(job.job_id);
+        return closed;
+    }
+    return true;
+}
+
+bool submit_job(ClientSession& session, UploadJob& job) {
+    if (job.job_id.empty() || !job_registry.transition(job.job_id, JOB_UPLOADING, JOB_QUEUED)) {
+        return false;
+    }
+    // Durable before the client is told the job was accepted
+    job_registry.set_scheduling(job.job_id, session.client_name, job.priority);
+    if (job.output_format != OUTPUT_PCM16 || job.dither) {
+        // Read by the worker from the job folder, so it survives a restart with the folder
+        std::ofstream render(job.folder + "/render.txt");
+        render << "format " << output_format_name(job.output_format) << "\n" << (job.dither ? "dither\n" : "");
+    }
+    if (job.flac_result) {
+        job_registry.set_flac_result(job.job_id);
+        job_journal.append("ENCODING " + job.job_id + " flac");
+    }
+    job_journal.append("QUEUED " + job.job_id + " " + std::to_string(job.priority) + " " +
+                       std::to_string(job.bytes) + " " + session.client_name, true);
+    ScheduledJob scheduled;
+    scheduled.job_id = job.job_id;
+    scheduled.folder = job.folder;
+    scheduled.client = session.client_name;
+    scheduled.priority = job.priority;
+    scheduled.cost = job_cost(job.job_id, job.bytes);
+    scheduled.memory = estimate_job_memory(job.job_id, job.folder);
+    job_trace::emit(job.folder, job.job_id, "upload", job.trace_start_us, job_trace::now_us(),
+                    job_trace::Args().add("bytes", job.bytes).add("client", session.client_name));
+    server_stats.job_queued(scheduled.job_id);
+    job_scheduler.submit(scheduled);
+    server_stats.queue_depth = job_scheduler.size();
+    return true;
+}
+
+// Untagged protocol: sizes followed by a wav, its instructions, ..., and a zero size to submit.
+// Sizes are 4 bytes, or 0xFFFFFFFF and 8 bytes (both big-endian) from 1 GB on
+void handle_legacy_message(ClientSession& session, const std::string& command) {
+    int client_socket = session.socket;
+    if (command.find("PRIORITY ") == 0) {
+        // Priority class for jobs uploaded on this connection
+        if (parse_priority(command.substr(9), session.priority)) {
+            session.reply("Priority set.");
+        } else {
+            session.reply("Unknown priority.");
+        }
+        return;
+    }
+    if (command.find("RESULT ") == 0) {
+        // Transport encoding of the result: "RESULT flac" or "RESULT wav"
+        session.flac_result = command.substr(7) == "flac";
+        session.reply("Result encoding set.");
+        return;
+    }
+    if (command.find("FORMAT ") == 0) {
+        // Sample format of the mix: "FORMAT pcm24", "FORMAT pcm16 dither", ...
+        std::istringstream in(command.substr(7));
+        std::string name, option;
+        OutputFormat format;
+        if (in >> name && parse_output_format(name, format)) {
+            session.output_format = format;
+            session.dither = in >> option && option == "dither";
+            session.reply("Format set.");
+        } else {
+            session.reply("Unknown format.");
+        }
+        return;
+    }
+    if (command.find("CLIENT ") == 0) {
+        // Tenant name used for fair sharing instead of the peer address
+        session.client_name = command.substr(7);
+        session.reply("Client set.");
+        return;
+    }
+    if (command == "CHECK_DONE") {
+        // Check if the job is done
+        JobRecord job;
+        if (session.legacy_submitted.empty() || !job_registry.get(session.legacy_submitted, job)) {
+            session.reply("Job not ready.");
+        } else if (job.state == JOB_DONE) {
+            // The header and the file are one reply; a WAIT answer due meanwhile follows them
+            std::lock_guard<std::mutex> sending(session.replies->mutex);
+            bool is_flac = job.result == "done.flac";
+            send_ack(client_socket, is_flac ? "Job ready. format=flac" : "Job ready.");
+            server_stats.delivery_started(job.job_id);
+            int64_t trace_start_us = job_trace::now_us();
+            if (send_file(client_socket, job.folder + "/" + job.result) == 0) {
+                server_stats.delivery_finished(job.job_id);
+                job_trace::emit(job.folder, job.job_id, "send", trace_start_us, job_trace::now_us(),
+                                job_trace::Args().add("result", job.result));
+                job_trace::merge(job.folder);
+            }
+        } else if (job.state == JOB_CANCELLED) {
+            session.reply("Job cancelled.");
+        } else if (job.state == JOB_FAILED) {
+            session.reply("Job failed.");
+        } else {
+            session.reply("Job not ready.");
+        }
+        return;
+    }
+    if (command.size() < sizeof(uint32_t)) {
+        session.reply("Unknown command.");
+        return;
+    }
+
+    // Read the file size: 4 bytes, or LEGACY_SIZE_64 and 8 more bytes for files of 1 GB and up
+    uint32_t short_size;
+    memcpy(&short_size, command.data(), sizeof(short_size));
+    short_size = ntohl(short_size);
+    uint64_t file_size = short_size;
+    size_t header_size = sizeof(short_size);
+    std::string message = command;
+    if (short_size == LEGACY_SIZE_64) {
+        header_size += sizeof(uint64_t);
+        while (message.size() < header_size) {
+            if (!session.reader.fill()) {
+                return;
+            }
+            message += session.reader.buffered();
+            session.reader.buffered().clear();
+        }
+        file_size = 0;
+        for (size_t i = sizeof(short_size); i < header_size; ++i) {
+            file_size = (file_size << 8) | static_cast<unsigned char>(message[i]);
+        }
+    }
+    // Anything after the size already belongs to the next message
+    session.reader.buffered().insert(0, message, header_size, std::string::npos);
+
+    UploadJob& job = session.legacy_job;
+    if (file_size == 0) {
+        // End-of-job signal received; the next file starts a new job
+        if (submit_job(session, job)) {
+            session.legacy_submitted = job.job_id;
+            job = UploadJob();
+            session.reply("Job marked as ready.");
+        }
+        return;
+    }
+
+    bool short_too_large = short_size != LEGACY_SIZE_64 && short_size >= MAX_LEGACY_SIZE;
+    if (short_too_large || file_size > MAX_FILE_SIZE || file_size > admission.max_inflight_bytes) {
+        std::cerr << "File size exceeds the maximum allowed limit." << std::endl;
+        session.reply("File too large.");
+        shutdown(client_socket, SHUT_RDWR);
+        return;
+    }
+
+    // Over a bound the client keeps the file and sends the same size again later
+    if (!admission.reserve_bytes(file_size)) {
+        session.reply(busy_message());
+        return;
+    }
+    if (job.job_id.empty() && !start_job(session, job)) {
+        admission.release_bytes(file_size);
+        session.reply(busy_message());
+        return;
+    }
+    session.reply("Got size.");
+    std::string rejected;
+    receive_file(session, job, job.wav_expected, file_size, rejected);
+    session.reply(rejected.empty() ? "Got file." : "Invalid file: " + rejected);
+}
+
+// Skips a payload that was refused so the following commands stay in sync
+void discard_payload(ClientSession& session, uint64_t size) {
+    char discard[64 * 1024];
+    uint64_t skipped = 0;
+    while (skipped < size) {
+        ssize_t n = session.reader.read_some(discard, std::min<uint64_t>(sizeof(discard), size - skipped));
+        if (n <= 0) break;
+        skipped += n;
+    }
+}
+
+// Tagged protocol, one '\n'-terminated command per line, replies are single lines:
+//   OPEN [interactive|normal|batch] [flac] [pcm16|pcm24|float] [dither]  -> JOB <id>
+//   PUT <id> <wav|txt> <size> + <size> bytes -> STORED <id> <wav|txt>
+//   SUBMIT <id>                              -> QUEUED <id>
+//   STATUS <id>                              -> STATUS <id> <state>
+//   WAIT <id> [<timeout ms>]                 -> STATUS <id> <state> once the job is done, failed or
+//                                               cancelled, or when the timeout (30 s by default) passes;
+//                                               later commands are answered meanwhile, so this line
+//                                               may come after their replies
+//   FETCH <id>                               -> RESULT <id> <wav|flac> <size> + <size> bytes
+// Resumable uploads and ranged downloads, in chunks checked with CRC32C (8 hex digits):
+//   UPLOAD <id> <wav|txt> <size>             -> OFFSET <id> <offset> (0, or where an interrupted upload stopped)
+//   CHUNK <id> <offset> <length> <crc|->     -> ACK <id> <offset + length>, STORED <id> <wav|txt> after the last one
+//   FETCH <id> <offset> [<length>]           -> RANGE <id> <wav|flac> <size> <offset> <length>,
+//                                               then DATA <n> <crc> + <n> bytes until <length> bytes are sent
+// Unsubmitted jobs outlive a dropped connection for RESUME_GRACE_SECONDS; the same client picks
+// them up again by naming them on a new connection.
+// Errors are answered with ERROR <id> <reason>, refusals under load with BUSY [<id>] retry_after_ms=<n>.
+// Commands may be pipelined.
+void handle_tagged_command(ClientSession& session, const std::string& line) {
+    std::istringstream in(line);
+    std::string verb, job_id;
+    in >> verb >> job_id;
+    int client_socket = session.socket;
+    if (verb != "OPEN" && !session.jobs.count(job_id)) {
+        reattach_upload(session, job_id);
+    }
+
+    if (verb == "OPEN") {
+        UploadJob job;
+        if (!start_job(session, job)) {
+            session.reply(busy_message() + "\n");
+            return;
+        }
+        std::string option = job_id;
+        do {
+            JobPriority priority;
+            OutputFormat format;
+            if (option == "flac") job.flac_result = true;
+            else if (option == "dither") job.dither = true;
+            else if (parse_output_format(option, format)) job.output_format = format;
+            else if (parse_priority(option, priority)) job.priority = priority;
+        } while (in >> option);
+        session.jobs[job.job_id] = job;
+        session.reply("JOB " + job.job_id + "\n");
+        return;
+    }
+
+    auto upload = session.jobs.find(job_id);
+    if (verb == "PUT") {
+        std::string kind;
+        uint64_t file_size = 0;
+        in >> kind >> file_size;
+        bool is_sound = kind == "wav";
+        std::string error;
+        if (upload == session.jobs.end()) error = "unknown job";
+        else if (upload->second.upload.active()) error = "upload in progress";
+        else if (kind != "wav" && kind != "txt") error = "unknown file kind";
+        else if (file_size > MAX_FILE_SIZE || file_size > admission.max_inflight_bytes) error = "file too large";
+        else if (is_sound != upload->second.wav_expected) error = is_sound ? "sound without instructions" : "instructions without a sound";
+        if (!error.empty()) {
+            discard_payload(session, file_size);
+            session.reply("ERROR " + job_id + " " + error + "\n");
+            return;
+        }
+        if (!admission.reserve_bytes(file_size)) {
+            discard_payload(session, file_size);
+            session.reply("BUSY " + job_id + busy_message().substr(4) + "\n");
+            return;
+        }
+        std::string rejected;
+        if (receive_file(session, upload->second, is_sound, file_size, rejected)) {
+            session.reply("STORED " + job_id + " " + kind + "\n");
+        } else if (!rejected.empty()) {
+            session.reply("ERROR " + job_id + " invalid " + kind + ": " + rejected + "\n");
+        } else {
+            session.reply("ERROR " + job_id + " incomplete upload\n");
+        }
+    } else if (verb == "UPLOAD") {
+        expire_detached_uploads();
+        std::string kind;
+        uint64_t file_size = 0;
+        in >> kind >> file_size;
+        bool is_sound = kind == "wav";
+        std::string error;
+        if (upload == session.jobs.end()) error = "unknown job";
+        else if (kind != "wav" && kind != "txt") error = "unknown file kind";
+        else if (file_size == 0) error = "empty file";
+        else if (file_size > MAX_FILE_SIZE || file_size > admission.max_inflight_bytes) error = "file too large";
+        if (!error.empty()) {
+            session.reply("ERROR " + job_id + " " + error + "\n");
+            return;
+        }
+        ResumableUpload& resumable = upload->second.upload;
+        if (resumable.active()) {
+            // Resuming: the same file again, from what was acknowledged
+            if (resumable.kind != kind || resumable.size != file_size) {
+                session.reply("ERROR " + job_id + " another upload in progress\n");
+                return;
+            }
+            session.upload_files.erase(job_id);
+            session.reply("OFFSET " + job_id + " " + std::to_string(resumable.offset) + "\n");
+            return;
+        }
+        if (is_sound != upload->second.wav_expected) {
+            session.reply("ERROR " + job_id + " " + (is_sound ? "sound without instructions" : "instructions without a sound") + "\n");
+            return;
+        }
+        if (!admission.reserve_bytes(file_size)) {
+            session.reply("BUSY " + job_id + busy_message().substr(4) + "\n");
+            return;
+        }
+        if (is_sound) {
+            start_track(upload->second);
+        }
+        resumable = ResumableUpload();
+        resumable.kind = kind;
+        resumable.size = file_size;
+        resumable.sound = SoundCheck(file_size);
+        resumable.trace_start_us = job_trace::now_us();
+        session.reply("OFFSET " + job_id + " 0\n");
+    } else if (verb == "CHUNK") {
+        uint64_t offset = 0, length = 0;
+        std::string crc_text;
+        in >> offset >> length >> crc_text;
+        uint32_t expected_crc = 0;
+        bool check_crc = crc_text != "-";
+        std::string error;
+        if (length > MAX_CHUNK_SIZE) {
+            // Not read: the stream cannot be trusted to stay in sync
+            session.reply("ERROR " + job_id + " chunk too large\n");
+            shutdown(client_socket, SHUT_RDWR);
+            return;
+        }
+        if (upload == session.jobs.end() || !upload->second.upload.active()) error = "no upload in progress";
+        else if (offset != upload->second.upload.offset) error = "expected offset " + std::to_string(upload->second.upload.offset);
+        else if (length == 0 || offset + length > upload->second.upload.size) error = "chunk outside the file";
+        else if (check_crc && !parse_crc32c_hex(crc_text, expected_crc)) error = "bad crc";
+        if (!error.empty()) {
+            discard_payload(session, length);
+            session.reply("ERROR " + job_id + " " + error + "\n");
+            return;
+        }
+        session.chunk.resize(length);
+        uint64_t received = 0;
+        while (received < length) {
+            ssize_t n = session.reader.read_some(session.chunk.data() + received, length - received);
+            if (n <= 0) {
+                return;  // disconnected; the client resumes from the last ACK
+            }
+            received += n;
+        }
+        if (check_crc && crc32c(session.chunk.data(), length) != expected_crc) {
+            session.reply("ERROR " + job_id + " crc mismatch at " + std::to_string(offset) + "\n");
+            return;
+        }
+        UploadJob& job = upload->second;
+        // Checked on copies: a chunk that is not stored comes again
+        bool is_sound = job.upload.kind == "wav";
+        SoundCheck sound = job.upload.sound;
+        ScoreCheck score = job.upload.score;
+        bool last = offset + length == job.upload.size;
+        bool valid = is_sound ? sound.feed(session.chunk.data(), length)
+                              : score.feed(session.chunk.data(), length) && (!last || score.finish());
+        if (!valid) {
+            std::string kind = job.upload.kind;
+            std::string reason = is_sound ? sound.error() : score.error();
+            session.upload_files.erase(job_id);
+            reject_upload(job, is_sound, job.upload.path, reason);
+            // Chunks already stored stay counted with the job until it ends
+            admission.release_bytes(job.upload.size - job.upload.offset);
+            SOUNDSEQ_PROBE3(file_rejected, job_id.c_str(), kind.c_str(), job.upload.offset + length);
+            job.upload = ResumableUpload();
+            session.reply("ERROR " + job_id + " invalid " + kind + ": " + reason + "\n");
+            return;
+        }
+        if (!store_chunk(session, job, session.chunk.data(), length)) {
+            session.reply("ERROR " + job_id + " write failed at " + std::to_string(offset) + "\n");
+            return;
+        }
+        job.upload.sound = sound;
+        job.upload.score = score;
+        if (job.upload.offset < job.upload.size) {
+            session.reply("ACK " + job_id + " " + std::to_string(job.upload.offset) + "\n");
+            return;
+        }
+        std::string kind = job.upload.kind;
+        if (is_sound) {
+            record_sound(job, sound);
+        } else {
+            record_score(job, score);
+        }
+        SOUNDSEQ_PROBE3(file_received, job_id.c_str(), kind.c_str(), job.upload.size);
+        job_trace::emit(job.folder, job_id, "receive " + kind, job.upload.trace_start_us, job_trace::now_us(),
+                        job_trace::Args().add("bytes", job.upload.size).add("chunked", 1));
+        job.wav_expected = kind != "wav";
+        job.upload = ResumableUpload();
+        session.reply("STORED " + job_id + " " + kind + "\n");
+    } else if (verb == "SUBMIT") {
+        if (upload == session.jobs.end() || upload->second.job_id.empty() || !upload->second.wav_expected ||
+            upload->second.upload.active() || !submit_job(session, upload->second)) {
+            session.reply("ERROR " + job_id + " cannot submit\n");
+            return;
+        }
+        session.jobs.erase(upload);
+        session.reply("QUEUED " + job_id + "\n");
+    } else if (verb == "STATUS") {
+        JobRecord job;
+        if (!job_registry.get(job_id, job)) {
+            session.reply("ERROR " + job_id + " unknown job\n");
+            return;
+        }
+        session.reply(std::string("STATUS ") + job_id + " " + job_state_token(job.state) + "\n");
+    } else if (verb == "WAIT") {
+        // Answered later by job_waiters, so the connection goes on reading commands meanwhile
+        int timeout_ms = DEFAULT_WAIT_MS;
+        in >> timeout_ms;
+        JobRecord job;
+        if (!job_registry.get(job_id, job)) {
+            session.reply("ERROR " + job_id + " unknown job\n");
+            return;
+        }
+        job_waiters.add(job_id, std::max(0, std::min(timeout_ms, MAX_WAIT_MS)), session.replies);
+    } else if (verb == "FETCH") {
+        // The whole download is one reply; a WAIT answer due meanwhile follows it
+        std::lock_guard<std::mutex> sending(session.replies->mutex);
+        JobRecord job;
+        if (!job_registry.get(job_id, job) || job.state != JOB_DONE) {
+            send_ack(client_socket, "ERROR " + job_id + " not ready\n");
+            return;
+        }
+        std::string path = job.folder + "/" + job.result;
+        AsyncFile file;
+        if (!file.open(path, O_RDONLY)) {
+            send_ack(client_socket, "ERROR " + job_id + " result missing\n");
+            return;
+        }
+        uint64_t size = file.size();
+        std::string format = job.result == "done.flac" ? "flac" : "wav";
+        uint64_t offset = 0, length = size;
+        if (in >> offset) {
+            in >> length;
+            if (offset > size) {
+                send_ack(client_socket, "ERROR " + job_id + " range outside the result\n");
+                return;
+            }
+            length = std::min(length, size - offset);
+            if (offset == 0) {
+                server_stats.delivery_started(job_id);
+            }
+            send_ack(client_socket, "RANGE " + job_id + " " + format + " " + std::to_string(size) + " " +
+                                    std::to_string(offset) + " " + std::to_string(length) + "\n");
+            file.seek(offset);
+            int64_t trace_start_us = job_trace::now_us();
+            std::vector<char> buffer(std::min(length, FETCH_CHUNK_SIZE));
+            uint64_t sent = 0;
+            while (sent < length) {
+                size_t chunk = file.read(buffer.data(), std::min<uint64_t>(buffer.size(), length - sent));
+                if (chunk == 0) {
+                    break;  // the result shrank; the client sees a short range
+                }
+                std::string frame = "DATA " + std::to_string(chunk) + " " + crc32c_hex(crc32c(buffer.data(), chunk)) + "\n";
+                if (!send_all(client_socket, frame.data(), frame.size()) || !send_all(client_socket, buffer.data(), chunk)) {
+                    return;
+                }
+                sent += chunk;
+            }
+            job_trace::emit(job.folder, job_id, "send", trace_start_us, job_trace::now_us(),
+                            job_trace::Args().add("bytes", sent).add("offset", offset));
+            if (sent == length && offset + length == size) {
+                server_stats.delivery_finished(job_id);
+                job_trace::merge(job.folder);
+            }
+            return;
+        }
+        server_stats.delivery_started(job_id);
+        int64_t trace_start_us = job_trace::now_us();
+        send_ack(client_socket, "RESULT " + job_id + " " + format + " " + std::to_string(size) + "\n");
+        char buffer[64 * 1024];
+        bool sent = true;
+        std::size_t chunk;
+        while (sent && (chunk = file.read(buffer, sizeof(buffer))) > 0) {
+            sent = send_all(client_socket, buffer, chunk);
+        }
+        if (sent) {
+            server_stats.delivery_finished(job_id);
+            job_trace::emit(job.folder, job_id, "send", trace_start_us, job_trace::now_us(),
+                            job_trace::Args().add("bytes", size));
+            job_trace::merge(job.folder);
+        }
+    } else {
+        session.reply("ERROR " + job_id + " unknown command\n");
+    }
+}
 
-        // Read the file size
-        uint32_t file_size;
-        memcpy(&file_size, buffer, sizeof(file_size));
-        file_size = ntohl(file_size);
+// Which protocol the buffered bytes start; undecided while they are a proper prefix of a verb
+// (a short read of "CH" could be CHUNK or the legacy CHECK_DONE)
+enum CommandKind { COMMAND_TAGGED, COMMAND_LEGACY, COMMAND_UNDECIDED };
 
-        if (file_size == 0) {
-            // End-of-job signal received
-            if (!current_job_folder.empty()) {
-                std::string final_job_folder = current_job_folder;
-                final_job_folder.replace(final_job_folder.find("wip_job_"), 8, "job_");
-                std::rename(current_job_folder.c_str(), final_job_folder.c_str());
-                //current_job_folder.clear();
-                send_ack(client_socket, "Job marked as ready.");
+CommandKind tagged_command_kind(const std::string& buffered) {
+    static const char* verbs[] = {"OPEN", "PUT ", "UPLOAD ", "CHUNK ", "SUBMIT ", "STATUS ", "WAIT ", "FETCH "};
+    CommandKind kind = COMMAND_LEGACY;
+    for (const char* verb : verbs) {
+        size_t length = strlen(verb);
+        size_t n = std::min(length, buffered.size());
+        if (buffered.compare(0, n, verb, n) == 0) {
+            if (n == length) {
+                return COMMAND_TAGGED;
+            }
+            kind = COMMAND_UNDECIDED;
+        }
+    }
+    return kind;
+}
+
+void handle_client(int client_socket) {
+    ClientSession session(client_socket);
+
+    // Jobs are shared fairly between clients; by default a client is its peer address
+    struct sockaddr_in peer_address;
+    socklen_t peer_length = sizeof(peer_address);
+    if (getpeername(client_socket, (struct sockaddr *)&peer_address, &peer_length) == 0) {
+        char peer_ip[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &peer_address.sin_addr, peer_ip, sizeof(peer_ip));
+        session.client_name = peer_ip;
+    }
+
+    server_stats.active_connections++;
+
+    while (true) {
+        if (session.reader.buffered().empty() && !session.reader.fill()) {
+            std::cout << "Client disconnected." << std::endl;
+            break;
+        }
+        // Tagged commands start with an upper-case verb, which as a 4-byte legacy size would be
+        // at least MAX_LEGACY_SIZE, so the two protocols cannot be confused. No legacy command is
+        // a prefix of a verb, so waiting for more bytes cannot stall a legacy client
+        CommandKind kind = tagged_command_kind(session.reader.buffered());
+        if (kind == COMMAND_UNDECIDED) {
+            if (!session.reader.fill()) {
+                std::cout << "Client disconnected." << std::endl;
+                break;
             }
             continue;
         }
+        if (kind == COMMAND_TAGGED) {
+            std::string line;
+            if (!session.reader.read_line(line)) {
+                std::cout << "Client disconnected." << std::endl;
+                break;
+            }
+            handle_tagged_command(session, line);
+        } else {
+            std::string command;
+            command.swap(session.reader.buffered());
+            handle_legacy_message(session, command);
+        }
+    }
+    // Uploads the client never submitted give back their admission slot and bytes
+    if (!session.legacy_job.job_id.empty()) {
+        set_job_state(session.legacy_job.job_id, JOB_UPLOADING, JOB_CANCELLED);
+    }
+    // Tagged ones wait for the client to reconnect (the files were written up to the last ACK)
+    session.upload_files.clear();
+    for (const auto &entry : session.jobs) {
+        detach_upload(session.client_name, entry.second);
+    }
+    expire_detached_uploads();
+    server_stats.active_connections--;
+    admission.release_connection();
+    session.replies->close();
+    close(client_socket);
+}
 
-        if (file_size > MAX_FILE_SIZE) {
-            std::cerr << "File size exceeds the maximum allowed limit." << std::endl;
-            send_ack(client_socket, "File too large.");
+// Read back the per-stage timings the worker leaves in the job folder
+void collect_worker_timings(const std::string& job_id, const std::string& job_folder) {
+    std::ifstream timings(job_folder + "/timings.txt");
+    std::string line;
+    while (std::getline(timings, line)) {
+        std::istringstream iss(line);
+        std::string stage;
+        iss >> stage;
+        if (stage == "sequence") {
+            std::string track;
+            long long us = 0;
+            if (iss >> track >> us) {
+                server_stats.track_sequenced(job_id, track, us);
+            }
+        } else if (stage == "mix") {
+            long long us = 0;
+            if (iss >> us) {
+                server_stats.job_mixed(job_id, us);
+            }
+        } else if (stage == "peak_rss") {
+            std::string process, track;
+            uint64_t kb = 0;
+            iss >> process;
+            if (process == "sequence" && iss >> track >> kb) {
+                server_stats.track_peak_rss(job_id, track, kb);
+            } else if (process == "mix" && iss >> kb) {
+                server_stats.mix_peak_rss(job_id, kb, CostModel::WORKER_SEQUENCERS);
+            }
+        } else if (stage == "slice_memo") {
+            std::string track;
+            uint64_t hits = 0, misses = 0;
+            if (iss >> track >> hits >> misses) {
+                server_stats.record_cache_lookups("slice_memo", hits, misses);
+            }
+        }
+    }
+}
+
+// Journal every "track <n> done" line the worker writes to its progress pipe
+void follow_worker_progress(const std::string& job_id, int progress_fd) {
+    std::string pending;
+    char buffer[256];
+    ssize_t n;
+    while ((n = read(progress_fd, buffer, sizeof(buffer))) > 0) {
+        pending.append(buffer, n);
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            std::istringstream line(pending.substr(0, end));
+            pending.erase(0, end + 1);
+            std::string word, state;
+            int track = 0;
+            if (line >> word >> track >> state && word == "track" && state == "done") {
+                job_registry.track_completed(job_id, track);
+                job_journal.append("TRACK_DONE " + job_id + " " + std::to_string(track));
+            }
+        }
+    }
+}
+
+enum NodeResult { NODE_RENDERED, NODE_LOST, NODE_TASK_FAILED };
+
+// Sends a sound the node does not have yet
+bool send_sound(NodeChannel& channel, const std::string& task, const std::string& path) {
+    AsyncFile file;
+    if (!file.open(path, O_RDONLY) || !channel.send_line("SOUND " + task + " " + std::to_string(file.size()))) {
+        return false;
+    }
+    char buffer[64 * 1024];
+    std::size_t chunk;
+    while ((chunk = file.read(buffer, sizeof(buffer))) > 0) {
+        if (!channel.send(buffer, chunk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Renders one track of the job on a node (node_protocol.h) and stores the sparse track it
+// streams back in the track folder, where the worker would have left it
+NodeResult render_track_on_node(RenderNode& node, const ScheduledJob& job, const std::string& track) {
+    static std::atomic<uint64_t> next_task(0);
+    std::string folder = job.folder + "/" + track;
+    std::string kind = std::ifstream(folder + "/sound.flac") ? "flac" : "wav";
+    std::string sound = folder + "/sound." + kind;
+    std::ifstream score_file(folder + "/instructions.txt", std::ios::binary);
+    std::string score((std::istreambuf_iterator<char>(score_file)), std::istreambuf_iterator<char>());
+    std::string hash = sha256_file(sound);
+    std::string part = folder + "/sequenced.sptk.part";
+    AsyncFile out;
+    if (hash.empty() || score.size() > NODE_MAX_SCORE || !out.open(part, O_WRONLY | O_CREAT | O_TRUNC)) {
+        return NODE_TASK_FAILED;
+    }
+    std::string task = std::to_string(++next_task);
+    NodeChannel& channel = *node.channel;
+    std::string line;
+    std::string header = "TASK " + task + " " + job.job_id + " " + track + " " + hash + " " + kind + " " + std::to_string(score.size());
+    bool connected = channel.send_frame(header, score.data(), score.size()) && channel.read_line(line);
+    if (connected && line == "NEED " + task) {
+        server_stats.record_cache_lookup("node_sound", false);
+        connected = send_sound(channel, task, sound);
+    } else if (line == "HAVE " + task) {
+        server_stats.record_cache_lookup("node_sound", true);
+    } else {
+        connected = false;
+    }
+    // Blocks until DONE; a damaged block counts as a lost node, since its stream cannot be trusted
+    std::vector<char> block;
+    uint64_t total = 0;
+    NodeResult result = NODE_LOST;
+    while (connected && channel.read_line(line)) {
+        std::istringstream in(line);
+        std::string verb, id, crc_text;
+        uint64_t size = 0;
+        uint32_t crc = 0;
+        in >> verb >> id >> size >> crc_text;
+        if (id != task) {
+            break;
+        }
+        if (verb == "BLOCK") {
+            if (size > NODE_BLOCK_SIZE || !parse_crc32c_hex(crc_text, crc)) break;
+            block.resize(size);
+            if (!channel.read_exact(block.data(), size) || crc32c(block.data(), size) != crc || !out.write(block.data(), size)) break;
+            total += size;
+        } else if (verb == "DONE") {
+            if (size == total && out.close()) {
+                IoRing& io = IoRing::local();
+                result = io.wait(io.rename(part.c_str(), (folder + "/sequenced.sptk").c_str())) == 0 ? NODE_RENDERED : NODE_TASK_FAILED;
+            }
+            break;
+        } else {
+            if (verb == "FAILED") {
+                std::cerr << "Render node " << node.name << " could not render job " << job.job_id << " track " << track << ":" << line.substr(line.find(task) + task.size()) << std::endl;
+                result = NODE_TASK_FAILED;
+            }
             break;
         }
+    }
+    if (result != NODE_RENDERED) {
+        out.close();
+        unlink(part.c_str());
+    }
+    return result;
+}
 
-        send_ack(client_socket, "Got size.");
+bool job_cancelled(const std::string& job_id) {
+    std::lock_guard<std::mutex> lock(running_mutex);
+    return cancelled_jobs.count(job_id) > 0;
+}
 
-        if (is_wav_expected) {
+// Renders the job's tracks on the registered render nodes, as many at once as there are idle
+// nodes, before the worker starts; the worker then reuses them like tracks finished before a
+// restart. A track whose node fails goes to another node; tracks no node could render are left
+// to the worker
+void render_tracks_on_nodes(const ScheduledJob& job) {
+    JobRecord record;
+    if (node_pool.size() == 0 || !job_registry.get(job.job_id, record)) {
+        return;
+    }
+    std::vector<std::string> tracks;
+    for (const auto& name : get_directories(job.folder)) {
+        int track = atoi(name.c_str());
+        if (track > 0 && std::to_string(track) == name && !record.completed_tracks.count(track)) {
+            tracks.push_back(name);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(running_mutex);
+        remote_jobs.insert(job.job_id);
+    }
+    std::mutex tracks_mutex;
+    auto render = [&] {
+        while (!job_cancelled(job.job_id)) {
+            std::string track;
             {
-                std::lock_guard<std::mutex> lock(folder_mutex);
-                if (current_job_folder.empty()) {
-                    current_job_folder = SERVER_FOLDER + "wip_job_" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
-                    mkdir(current_job_folder.c_str(), 0777);
-                }
+                std::lock_guard<std::mutex> lock(tracks_mutex);
+                if (tracks.empty()) return;
+                track = tracks.back();
+                tracks.pop_back();
+            }
+            RenderNode* node = node_pool.acquire();
+            if (node == nullptr) {
+                return;  // no node left; the worker renders the rest
+            }
+            std::string node_name = node->name;
+            int64_t trace_start_us = job_trace::now_us();
+            auto started = std::chrono::steady_clock::now();
+            NodeResult result = render_track_on_node(*node, job, track);
+            if (result == NODE_LOST) {
+                std::cerr << "Render node " << node_name << " lost with job " << job.job_id << " track " << track << ", reassigning" << std::endl;
+                node_pool.drop(node);
+                std::lock_guard<std::mutex> lock(tracks_mutex);
+                tracks.push_back(track);
+                continue;
             }
+            node_pool.release(node, result == NODE_RENDERED);
+            if (result == NODE_RENDERED) {
+                job_registry.track_completed(job.job_id, atoi(track.c_str()));
+                job_journal.append("TRACK_DONE " + job.job_id + " " + track);
+                server_stats.track_sequenced(job.job_id, track, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+                job_trace::emit(job.folder, job.job_id, "node " + track, trace_start_us, job_trace::now_us(),
+                                job_trace::Args().add("node", node_name));
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(tracks.size(), node_pool.size()); ++i) {
+        threads.emplace_back(render);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::lock_guard<std::mutex> lock(running_mutex);
+    remote_jobs.erase(job.job_id);
+}
 
-            current_file_name = current_job_folder + "/sound.wav";
-            current_file.open(current_file_name, std::ios::binary);
+// Run the worker for one job in its own process group so it can be paused or cancelled as a whole
+int run_worker(const ScheduledJob& job) {
+    render_tracks_on_nodes(job);
+    {
+        std::lock_guard<std::mutex> lock(running_mutex);
+        if (cancelled_jobs.erase(job.job_id)) {
+            return -2;
+        }
+    }
+    // Tracks finished before a crash, or on render nodes, are not sequenced again
+    JobRecord record;
+    std::string skip;
+    if (job_registry.get(job.job_id, record)) {
+        for (int track : record.completed_tracks) {
+            skip += (skip.empty() ? "" : ",") + std::to_string(track);
+        }
+    }
+
+    // Close-on-exec, so a worker forked by the other dispatcher thread does not hold this job's
+    // write end open and delay its EOF
+    int progress_pipe[2];
+    if (pipe2(progress_pipe, O_CLOEXEC) == -1) {
+        perror("Progress pipe failed");
+        return -1;
+    }
+    // Only async-signal-safe calls are allowed in the child of a threaded process, so build argv first
+    std::string progress_fd = std::to_string(progress_pipe[1]);
+    job_trace::ChildEnvironment environment(job.folder, job.job_id);
+    int64_t trace_start_us = job_trace::now_us();
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::cerr << "Fork failed for job " << job.job_id << std::endl;
+        close(progress_pipe[0]);
+        close(progress_pipe[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        close(progress_pipe[0]);
+        fcntl(progress_pipe[1], F_SETFD, 0); // the one descriptor this worker inherits
+        if (skip.empty()) {
+            execle(WORKER_EXEC.c_str(), WORKER_EXEC.c_str(), job.folder.c_str(), "--progress-fd", progress_fd.c_str(), (char *)nullptr, environment.get());
         } else {
-            current_file_name = current_job_folder + "/instructions.txt";
-            current_file.open(current_file_name);
+            execle(WORKER_EXEC.c_str(), WORKER_EXEC.c_str(), job.folder.c_str(), "--progress-fd", progress_fd.c_str(), "--skip", skip.c_str(), (char *)nullptr, environment.get());
         }
+        _exit(127);
+    }
+    close(progress_pipe[1]);
+    setpgid(pid, pid);
+    {
+        std::lock_guard<std::mutex> lock(running_mutex);
+        running_jobs[job.job_id] = pid;
+    }
+    if (job_scheduler.is_paused(job.job_id)) {
+        kill(-pid, SIGSTOP); // paused between being picked and starting
+    }
 
-        size_t total_read = 0;
-        while (total_read < file_size) {
-            valread = read(client_socket, buffer, std::min(sizeof(buffer), file_size - total_read));
-            if (valread <= 0) {
-                std::cerr << "Error reading file data." << std::endl;
-                break;
-            }
-            current_file.write(buffer, valread);
-            total_read += valread;
+    follow_worker_progress(job.job_id, progress_pipe[0]);
+    close(progress_pipe[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    job_trace::emit(job.folder, job.job_id, "worker", trace_start_us, job_trace::now_us(),
+                    job_trace::Args().add("pid", pid).add("status", status));
+
+    std::lock_guard<std::mutex> lock(running_mutex);
+    running_jobs.erase(job.job_id);
+    if (cancelled_jobs.erase(job.job_id)) {
+        return -2;
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+// One dispatcher per worker slot; the scheduler decides which job runs next
+void process_jobs() {
+    while (true) {
+        ScheduledJob job = job_scheduler.next();
+        server_stats.queue_depth = job_scheduler.size();
+        if (!set_job_state(job.job_id, JOB_QUEUED, JOB_RUNNING)) {
+            continue; // cancelled while it was being picked
         }
-        current_file.close();
-        send_ack(client_socket, "Got file.");
+        server_stats.job_dispatched(job.job_id);
+        // The queue span starts at SUBMIT (or at the restart that queued the job again)
+        int64_t waited_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job.submitted).count();
+        SOUNDSEQ_PROBE4(job_dispatched, job.job_id.c_str(), static_cast<int>(job.priority), job.cost, waited_us);
+        int64_t dispatched_us = job_trace::now_us();
+        job_trace::emit(job.folder, job.job_id, "queue", dispatched_us - waited_us, dispatched_us,
+                        job_trace::Args().add("priority", priority_name(job.priority)));
+        server_stats.active_workers++;
+        std::cout << "Dispatching job " << job.job_id << " (" << priority_name(job.priority) << ", client " << job.client << ")\n";
+        int status = run_worker(job);
+        job_scheduler.release_memory(job.memory);
+        server_stats.active_workers--;
+        server_stats.worker_finished(job.job_id);
+        collect_worker_timings(job.job_id, job.folder);
 
-        if (is_wav_expected) {
-            std::lock_guard<std::mutex> lock(folder_mutex);
-            int subfolder_number = get_next_subfolder_number(current_job_folder);
-            current_subfolder = current_job_folder + "/" + std::to_string(subfolder_number);
-            mkdir(current_subfolder.c_str(), 0777);
-            std::string new_wav_path = current_subfolder + "/sound.wav";
-            std::rename(current_file_name.c_str(), new_wav_path.c_str());
-            is_wav_expected = false;
+        JobRecord record;
+        if (status == 0 && job_registry.get(job.job_id, record) && record.flac_result) {
+            // Encode on the codec pool so this worker slot is free for the next job
+            server_stats.jobs_completed++;
+            std::string job_id = job.job_id;
+            std::string folder = job.folder;
+            codec_pool.submit([job_id, folder] {
+                int64_t trace_start_us = job_trace::now_us();
+                bool encoded = encode_flac(folder + "/done.wav", folder + "/done.flac");
+                if (encoded) {
+                    job_registry.set_result(job_id, "done.flac");
+                    job_journal.append("RESULT " + job_id + " done.flac");
+                }
+                job_trace::emit(folder, job_id, "encode", trace_start_us, job_trace::now_us(),
+                                job_trace::Args().add("format", "flac").add("ok", encoded));
+                set_job_state(job_id, JOB_RUNNING, JOB_DONE);
+                job_trace::merge(folder);
+            });
+            continue;
+        }
+
+        JobState final_state = JOB_FAILED;
+        if (status == 0) {
+            // Worker execution successful, mark job as done
+            final_state = JOB_DONE;
+            server_stats.jobs_completed++;
+        } else if (status == -2) {
+            final_state = JOB_CANCELLED;
         } else {
-            if (current_file_name.find("instructions.txt") != std::string::npos) {
-                std::string new_txt_path = current_subfolder + "/instructions.txt";
-                std::rename(current_file_name.c_str(), new_txt_path.c_str());
-                is_wav_expected = true;
+            std::cerr << "Error processing job in folder: " << job.folder << std::endl;
+            server_stats.jobs_failed++;
+        }
+        set_job_state(job.job_id, JOB_RUNNING, final_state);
+        job_trace::merge(job.folder);
+    }
+}
+
+// Without a journal (first start), one scan of the job folder seeds the registry
+void restore_jobs_from_disk() {
+    for (const auto &entry_name : get_directories(SERVER_FOLDER)) {
+        JobRecord record;
+        if (!legacy_job_state(entry_name, record.state)) {
+            continue;
+        }
+        record.job_id = job_id_from_folder(entry_name);
+        record.folder = SERVER_FOLDER + entry_name;
+        record.client = "restored";
+        bool tracks_complete = true;
+        for (const auto &track : get_directories(record.folder)) {
+            record.track_count = std::max(record.track_count, atoi(track.c_str()));
+            if (!std::ifstream(record.folder + "/" + track + "/instructions.txt")) {
+                tracks_complete = false;
             }
         }
+        if (record.state == JOB_QUEUED && std::ifstream(record.folder + "/done.wav")) {
+            record.state = JOB_DONE; // job_<id> folders keep their name once finished
+        } else if (record.state == JOB_QUEUED && !tracks_complete) {
+            record.state = JOB_UPLOADING; // the upload was cut off by the restart
+        }
+        job_registry.restore(record);
+    }
+}
+
+int remove_tree_entry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
+}
 
-        memset(buffer, 0, sizeof(buffer));
+// Deletes uploads abandoned by a restart and job folders the journal never recorded
+void collect_orphaned_uploads(std::vector<std::string> orphaned_folders) {
+    for (const auto &entry_name : get_directories(SERVER_FOLDER)) {
+        JobRecord record;
+        if (entry_name.find("job_") == 0 && !job_registry.get(job_id_from_folder(entry_name), record)) {
+            orphaned_folders.push_back(SERVER_FOLDER + entry_name);
+        }
+    }
+    for (const auto &folder : orphaned_folders) {
+        std::cout << "Removing orphaned upload " << folder << std::endl;
+        nftw(folder.c_str(), remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+// Forgets jobs that finished more than the retention period ago: registry entry, journal
+// records (FORGET, dropped at the next compaction) and job folder
+void forget_finished_jobs(int retention_hours) {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(RETENTION_SWEEP_SECONDS));
+        for (const auto& record : job_registry.expire_finished(std::chrono::hours(retention_hours))) {
+            job_journal.append("FORGET " + record.job_id);
+            nftw(record.folder.c_str(), remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+            std::cout << "Forgot job " << record.job_id << " (" << job_state_token(record.state) << ")" << std::endl;
+        }
+    }
+}
+
+// Replay the journal, resume interrupted jobs and queue everything that was waiting
+void restore_jobs() {
+    std::map<std::string, JobRecord> records;
+    if (job_journal.open(JOURNAL_PATH, records)) {
+        for (const auto &entry : records) {
+            job_registry.restore(entry.second);
+        }
+    } else {
+        restore_jobs_from_disk();
+    }
+
+    std::vector<std::string> orphaned_folders;
+    for (auto record : job_registry.snapshot()) {
+        if (record.state == JOB_UPLOADING) {
+            // The connection that was uploading it is gone
+            job_registry.remove(record.job_id);
+            orphaned_folders.push_back(record.folder);
+            continue;
+        }
+        if (record.state == JOB_RUNNING) {
+            // Interrupted mid-worker: run again, skipping the tracks that already finished
+            job_registry.transition(record.job_id, JOB_RUNNING, JOB_QUEUED);
+            record.state = JOB_QUEUED;
+        }
+        if (record.state == JOB_QUEUED) {
+            ScheduledJob job;
+            job.job_id = record.job_id;
+            job.folder = record.folder;
+            job.client = record.client;
+            job.priority = static_cast<JobPriority>(record.priority);
+            job.cost = job_cost(record.job_id, record.bytes);
+            job.memory = estimate_job_memory(record.job_id, record.folder);
+            admission.restore_job(record.bytes);
+            server_stats.job_queued(job.job_id);
+            job_scheduler.submit(job);
+        }
+    }
+    server_stats.queue_depth = job_scheduler.size();
+
+    // Start the new journal from the recovered state
+    job_journal.compact(job_registry.snapshot());
+    job_journal.start([] { return job_registry.snapshot(); });
+
+    std::thread gc_thread(collect_orphaned_uploads, orphaned_folders);
+    gc_thread.detach();
+}
+
+// Accept admin connections independently of client connections
+void accept_admin_connections(int admin_socket) {
+    while (true) {
+        struct sockaddr_un admin_client_address;
+        int admin_client_socket;
+        socklen_t admin_client_addrlen = sizeof(admin_client_address);
+
+        if ((admin_client_socket = accept4(admin_socket, (struct sockaddr *)&admin_client_address, &admin_client_addrlen, SOCK_CLOEXEC)) == -1) {
+            perror("Admin accept failed");
+            continue;
+        }
+
+        std::cout << "Admin client connected.\n";
+
+        // Handle admin commands in a separate thread
+        std::thread admin_thread(handle_admin_commands, admin_client_socket);
+        admin_thread.detach(); // Detach admin thread to run independently
     }
-    close(client_socket);
 }
+// Each slot of a render node registers with "NODE <name>" and then waits for tracks
+void accept_render_nodes(int node_socket) {
+    while (true) {
+        int node_fd = accept4(node_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (node_fd < 0) {
+            continue;
+        }
+        std::thread([node_fd] {
+            // A peer that never registers does not hold the thread
+            timeval timeout = {10, 0};
+            setsockopt(node_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ConnectionReader reader(node_fd, nullptr);
+            std::string line;
+            if (!reader.read_line(line) || line.compare(0, 5, "NODE ") != 0 || !reader.buffered().empty()) {
+                close(node_fd);
+                return;
+            }
+            // Renders take as long as they take; a dead node is noticed by keepalive
+            timeval none = {0, 0};
+            setsockopt(node_fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+            int keepalive = 1;
+            setsockopt(node_fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+            std::string name = line.substr(5);
+            send_ack(node_fd, "REGISTERED " + name + "\n");
+            node_pool.add(name, node_fd);
+            std::cout << "Render node " << name << " registered\n";
+        }).detach();
+    }
+}
+
+// --local-nodes N: N single-slot render nodes as child processes on loopback, each with its own
+// sound cache, so the node protocol runs on one machine; they end with the server
+void start_local_nodes(int count, int port) {
+    mkdir(LOCAL_NODE_CACHE.c_str(), 0777);
+    std::string port_text = std::to_string(port);
+    for (int i = 0; i < count; ++i) {
+        std::string name = "local" + std::to_string(i);
+        std::string cache = LOCAL_NODE_CACHE + name;
+        pid_t pid = fork();
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            execl(RENDER_NODE_EXEC.c_str(), RENDER_NODE_EXEC.c_str(), "127.0.0.1", port_text.c_str(), "--name", name.c_str(),
+                  "--slots", "1", "--cache", cache.c_str(), (char *)nullptr);
+            _exit(127);
+        }
+        if (pid == -1) {
+            perror("Fork failed for a local render node");
+        }
+    }
+}
+
 void remove_existing_socket() {
     // Use system call to remove the socket file
     std::string command = "rm -f ";
@@ -322,7 +1891,38 @@ void remove_existing_socket() {
     system(command.c_str());
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // Memory budget for running jobs, half of the physical memory unless --memory-budget-mb is given
+    job_scheduler.set_memory_budget(static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE) / 2);
+    // Admission bounds: --max-connections N, --max-queued-jobs N, --max-inflight-mb N
+    // Render nodes: --node-port N, --local-nodes N
+    int node_port = 0;
+    int local_nodes = 0;
+    int retention_hours = DEFAULT_RETENTION_HOURS;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        long long value = atoll(argv[i + 1]);
+        if (option == "--max-connections") {
+            admission.max_connections = value;
+        } else if (option == "--max-queued-jobs") {
+            admission.max_pending_jobs = value;
+        } else if (option == "--max-inflight-mb") {
+            admission.max_inflight_bytes = value * 1024 * 1024;
+        } else if (option == "--memory-budget-mb") {
+            job_scheduler.set_memory_budget(value * 1024 * 1024);
+        } else if (option == "--node-port") {
+            node_port = value;
+        } else if (option == "--local-nodes") {
+            local_nodes = value;
+        } else if (option == "--retention-hours" && value > 0) {
+            retention_hours = value;
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    // JOB_TRACE=1 writes a Chrome trace of each job to its folder (trace.h)
+    job_trace::init_server();
     // Remove existing socket file, if any
     remove_existing_socket();
     // Existing server setup code for TCP/IP connections
@@ -331,7 +1931,7 @@ int main() {
     int opt = 1;
     int addrlen = sizeof(address);
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == 0) {
         perror("Socket failed");
         exit(EXIT_FAILURE);
     }
@@ -366,7 +1966,7 @@ int main() {
     struct sockaddr_un admin_address;
     int admin_socket;
 
-    if ((admin_socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((admin_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
         perror("Admin socket creation failed");
         close(server_fd);
         exit(EXIT_FAILURE);
@@ -394,39 +1994,63 @@ int main() {
 
     std::cout << "Admin socket listening on path " << SOCKET_PATH << "...\n";
 
+    std::thread admin_accept_thread(accept_admin_connections, admin_socket);
+    admin_accept_thread.detach();
+
+    // Render nodes (node_protocol.h) register on their own port; without any, workers render everything here
+    if (node_port > 0 || local_nodes > 0) {
+        node_port = node_port > 0 ? node_port : DEFAULT_NODE_PORT;
+        int node_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_in node_address = {};
+        node_address.sin_family = AF_INET;
+        node_address.sin_addr.s_addr = INADDR_ANY;
+        node_address.sin_port = htons(node_port);
+        if (node_socket == -1 || setsockopt(node_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+            bind(node_socket, (struct sockaddr *)&node_address, sizeof(node_address)) < 0 || listen(node_socket, MAX_CLIENTS) < 0) {
+            perror("Render node socket failed");
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Render nodes register on port " << node_port << "...\n";
+        std::thread node_accept_thread(accept_render_nodes, node_socket);
+        node_accept_thread.detach();
+        start_local_nodes(local_nodes, node_port);
+    }
+
+    codec_pool.start(CODEC_THREADS);
+    job_registry.on_final([](const std::string& job_id, JobState state) { job_waiters.job_finished(job_id, state); });
+    std::thread waiter_thread(&JobWaiters::run, &job_waiters);
+    waiter_thread.detach();
+    restore_jobs();
+    std::thread retention_thread(forget_finished_jobs, retention_hours);
+    retention_thread.detach();
+    for (int i = 0; i < MAX_CONCURRENT_JOBS; ++i) {
+        std::thread job_thread(process_jobs);
+        job_thread.detach();
+    }
+
     // Accept connections and handle them
     while (true) {
-        // Accept incoming connection from client
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0) {
+        // Accept incoming connection from client; close-on-exec keeps it out of worker processes
+        if ((new_socket = accept4(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen, SOCK_CLOEXEC)) < 0) {
             perror("Accept failed");
             close(server_fd);
             close(admin_socket);
             exit(EXIT_FAILURE);
         }
 
+        // Over the connection bound the client is told when to come back instead of getting a thread
+        if (!admission.admit_connection()) {
+            std::string response = busy_message() + "\n";
+            send(new_socket, response.c_str(), response.size(), MSG_NOSIGNAL);
+            close(new_socket);
+            continue;
+        }
+
         std::cout << "New client connected.\n";
 
         // Create a new thread to handle the client connection
         std::thread client_thread(handle_client, new_socket);
         client_thread.detach(); // Detach thread to run independently
-
-        // Accept incoming connection from admin client
-        struct sockaddr_un admin_client_address;
-        int admin_client_socket;
-        socklen_t admin_client_addrlen = sizeof(admin_client_address);
-
-        if ((admin_client_socket = accept(admin_socket, (struct sockaddr *)&admin_client_address, &admin_client_addrlen)) == -1) {
-            perror("Admin accept failed");
-            close(server_fd);
-            close(admin_socket);
-            exit(EXIT_FAILURE);
-        }
-
-        std::cout << "Admin client connected.\n";
-
-        // Handle admin commands in a separate thread
-        std::thread admin_thread(handle_admin_commands, admin_client_socket);
-        admin_thread.detach(); // Detach admin thread to run independently
     }
 
     close(server_fd);
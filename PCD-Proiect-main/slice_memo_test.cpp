@@ -0,0 +1,50 @@
+// g++-9 -O2 -o slice_memo_test slice_memo_test.cpp -lsndfile -pthread
+// Checks the counts the sequencer reports for the slice memo (slice_memo.txt, the "memoized"
+// trace arg and the server's STATS): N identical score lines are 1 render and N-1 hits.
+// ./slice_memo_test exits non-zero on a failure.
+
+#define main sequencer_main
+#include "sequencer.cpp"
+#undef main
+
+static int failures = 0;
+
+static SequenceInstruction event(int startMs, int endMs, float pitch) {
+    SequenceInstruction instruction = {};
+    instruction.pitch = pitch;
+    instruction.volume = 1;
+    instruction.startSliceMs = startMs;
+    instruction.endSliceMs = endMs;
+    return instruction;
+}
+
+static void expect_hits(const char* name, const SourceSound& source, const std::vector<SequenceInstruction>& score,
+                        std::size_t hits) {
+    std::size_t memoHits = 0;
+    renderScore(source, score, 2, &memoHits);
+    std::size_t renders = score.size() - memoHits;
+    bool ok = memoHits == hits;
+    std::cout << (ok ? "ok   " : "FAIL ") << name << ": " << memoHits << " hits, " << renders << " renders (expected "
+              << hits << " hits, " << score.size() - hits << " renders)" << std::endl;
+    failures += !ok;
+}
+
+int main() {
+    const unsigned int rate = 44100;
+    std::vector<float> samples(rate);
+    for (std::size_t i = 0; i < samples.size(); ++i) {
+        samples[i] = static_cast<float>(std::sin(i * 0.05));
+    }
+    SourceSound source = {samples.data(), 1, rate, static_cast<int>(samples.size())};
+
+    for (std::size_t n : {1, 2, 4, 16}) {
+        std::vector<SequenceInstruction> score(n, event(0, 100, 1));
+        expect_hits((std::to_string(n) + " identical lines").c_str(), source, score, n - 1);
+    }
+    std::vector<SequenceInstruction> mixed(4, event(0, 100, 1));
+    mixed.push_back(event(100, 200, 1));
+    mixed.push_back(event(0, 100, 2));
+    mixed.push_back(event(0, 100, 2));
+    expect_hits("two repeated slices and a single one", source, mixed, 4);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,299 @@
+// Sparse track: a sequenced track kept as the regions that hold audio, with the silence
+// between them implied. Positions count interleaved samples, like the dense sample arrays
+// the sequencer used to write, so a sparse track expands to exactly the same samples;
+// regions start and end on frame boundaries.
+//
+// Samples are floats at full scale +-1.0, like the rest of the render pipeline.
+//
+// File format (sequenced.sptk, host byte order):
+//   "SPTK" u32 version, u32 channels, u32 sample rate, u64 total samples, u32 region count
+//   per region: u64 start sample, u64 sample count, count x float samples
+// Version 1 files (int16 samples) are still read.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "async_io.h"
+#include "sample_convert.h"
+#include "sample_pool.h"
+
+struct SparseRegion {
+    uint64_t start = 0;
+    PooledSamples<float> samples;
+
+    uint64_t end() const { return start + samples.size(); }
+};
+
+// Reads a sparse track file region by region, so callers can start on the first regions
+// while the rest are still on disk (and the next ones are being read ahead)
+class SparseTrackReader {
+public:
+    SparseTrackReader()
+        : channels(0), sample_rate(0), total_samples(0), version_(0), remaining_(0), position_(0), left_(0), ok_(false) {}
+    ~SparseTrackReader() { close(); }
+
+    SparseTrackReader(const SparseTrackReader&) = delete;
+    SparseTrackReader& operator=(const SparseTrackReader&) = delete;
+
+    unsigned int channels;
+    unsigned int sample_rate;
+    uint64_t total_samples;
+
+    // Reads the header; false if the file is not a sparse track
+    bool open(const std::string& path) {
+        close();
+        if (!file_.open(path, O_RDONLY)) return false;
+        char magic[4];
+        uint32_t header[3];
+        ok_ = read(magic, 4) && memcmp(magic, "SPTK", 4) == 0 &&
+              read(header, sizeof(header)) && (header[0] == 1 || header[0] == 2) &&  // int16 or float samples
+              read(&total_samples, sizeof(total_samples)) && read(&remaining_, sizeof(remaining_));
+        if (!ok_) {
+            close();
+            return false;
+        }
+        version_ = header[0];
+        left_ = 0;
+        channels = header[1];
+        sample_rate = header[2];
+        return true;
+    }
+
+    // Next region in file order; false at the end or on a read error (see ok()). With
+    // max_samples (a whole number of frames) a longer region comes in pieces of that size
+    bool next(SparseRegion& region, uint64_t max_samples = 0) {
+        if (!file_.is_open() || !ok_) return false;
+        if (left_ == 0) {
+            if (remaining_ == 0) return false;
+            remaining_--;
+            uint64_t span[2];
+            ok_ = read(span, sizeof(span)) && span[0] + span[1] <= total_samples;
+            if (!ok_) return false;
+            position_ = span[0];
+            left_ = span[1];
+        }
+        uint64_t count = max_samples ? std::min(left_, max_samples) : left_;
+        region.start = position_;
+        region.samples.resize(count);
+        if (version_ == 1) {
+            pcm_.resize(count);
+            ok_ = read(pcm_.data(), count * sizeof(int16_t));
+            int16_to_float(pcm_.data(), region.samples.data(), count);
+        } else {
+            ok_ = read(region.samples.data(), count * sizeof(float));
+        }
+        position_ += count;
+        left_ -= count;
+        return ok_;
+    }
+
+    bool ok() const { return ok_; }
+
+    // Lets another thread read the rest (see AsyncFile::detach)
+    void detach() { file_.detach(); }
+
+    void close() {
+        file_.close();
+    }
+
+private:
+    bool read(void* out, std::size_t size) {
+        return file_.read(static_cast<char*>(out), size) == size;
+    }
+
+    AsyncFile file_;
+    uint32_t version_;
+    uint32_t remaining_;  // regions not started yet
+    uint64_t position_;   // where the rest of the current region starts
+    uint64_t left_;       // samples of the current region not read yet
+    bool ok_;
+    PooledSamples<int16_t> pcm_;  // version 1 samples before conversion
+};
+
+class SparseTrack {
+public:
+    static const uint32_t VERSION = 2;
+    // Runs of silent frames of at least this many samples inside audio are stored as silence too
+    static const std::size_t MIN_SILENT_RUN = 1024;
+
+    SparseTrack() : channels(0), sample_rate(0), total_samples(0) {}
+    SparseTrack(unsigned int channel_count, unsigned int rate) : channels(channel_count), sample_rate(rate), total_samples(0) {}
+
+    SparseTrack(SparseTrack&&) = default;
+    SparseTrack& operator=(SparseTrack&&) = default;
+
+    unsigned int channels;
+    unsigned int sample_rate;
+    uint64_t total_samples;
+    std::vector<SparseRegion> regions;
+
+    void append_silence(uint64_t count) {
+        total_samples += count;
+    }
+
+    // Appends audio, leaving out long runs of silent frames
+    void append(const float* samples, std::size_t count) {
+        std::size_t i = 0;
+        while (i < count) {
+            std::size_t zeros = zero_run(samples, i, count);
+            if (zeros >= MIN_SILENT_RUN || i + zeros == count) {
+                append_silence(zeros);
+                i += zeros;
+                continue;
+            }
+            // Audio up to the next long zero run, or the zeros ending the slice
+            std::size_t end = i + zeros;
+            while (end < count) {
+                std::size_t run = zero_run(samples, end, count);
+                if (run == 0) {
+                    end += std::min<std::size_t>(frame_size(), count - end);
+                    continue;
+                }
+                if (run >= MIN_SILENT_RUN || end + run == count) break;
+                end += run;
+            }
+            append_audio(samples + i, end - i);
+            i = end;
+        }
+    }
+
+    // Renders count samples straight onto the end of the track; render(out) writes them.
+    // Blocks that append() would split around silence are split the same way
+    template <typename Render>
+    void append_rendered(std::size_t count, const Render& render) {
+        if (count == 0) return;
+        if (regions.empty() || regions.back().end() != total_samples) {
+            regions.push_back(SparseRegion());
+            regions.back().start = total_samples;
+        }
+        PooledSamples<float>& samples = regions.back().samples;
+        std::size_t from = samples.size();
+        samples.resize(from + count);
+        render(samples.data() + from);
+        total_samples += count;
+        if (is_dense(samples.data() + from, count)) return;
+
+        PooledSamples<float> rendered(samples.data() + from, count);
+        samples.resize(from);
+        total_samples -= count;
+        if (from == 0) regions.pop_back();
+        append(rendered.data(), count);
+    }
+
+    // Appends a track rendered on its own, as if its audio had been appended here: a region
+    // starting right at the end of the last one continues it
+    void append_track(SparseTrack&& next) {
+        for (auto& region : next.regions) {
+            uint64_t start = total_samples + region.start;
+            if (!regions.empty() && regions.back().end() == start) {
+                regions.back().samples.append(region.samples.data(), region.samples.size());
+            } else {
+                regions.push_back(std::move(region));
+                regions.back().start = start;
+            }
+        }
+        total_samples += next.total_samples;
+        next.regions.clear();
+    }
+
+    // Samples of audio stored, as opposed to the length of the timeline
+    uint64_t content_samples() const {
+        uint64_t total = 0;
+        for (const auto& region : regions) total += region.samples.size();
+        return total;
+    }
+
+    // Merges regions closer than min_gap samples, filling the gap with zeros
+    void coalesce(uint64_t min_gap) {
+        std::vector<SparseRegion> merged;
+        for (auto& region : regions) {
+            if (!merged.empty() && region.start - merged.back().end() < min_gap) {
+                SparseRegion& last = merged.back();
+                last.samples.append(region.start - last.end(), 0);
+                last.samples.append(region.samples.data(), region.samples.size());
+            } else {
+                merged.push_back(std::move(region));
+            }
+        }
+        regions = std::move(merged);
+    }
+
+    bool write(const std::string& path) const {
+        AsyncFile file;
+        if (!file.open(path, O_WRONLY | O_CREAT | O_TRUNC)) return false;
+        uint32_t header[3] = {VERSION, channels, sample_rate};
+        uint32_t region_count = regions.size();
+        bool ok = file.write("SPTK", 4) && file.write(reinterpret_cast<const char*>(header), sizeof(header)) &&
+                  file.write(reinterpret_cast<const char*>(&total_samples), sizeof(total_samples)) &&
+                  file.write(reinterpret_cast<const char*>(&region_count), sizeof(region_count));
+        for (std::size_t r = 0; ok && r < regions.size(); ++r) {
+            uint64_t span[2] = {regions[r].start, regions[r].samples.size()};
+            ok = file.write(reinterpret_cast<const char*>(span), sizeof(span)) &&
+                 file.write(reinterpret_cast<const char*>(regions[r].samples.data()), span[1] * sizeof(float));
+        }
+        return file.close() && ok;
+    }
+
+    bool read(const std::string& path) {
+        SparseTrackReader reader;
+        if (!reader.open(path)) return false;
+        channels = reader.channels;
+        sample_rate = reader.sample_rate;
+        total_samples = reader.total_samples;
+        regions.clear();
+        SparseRegion region;
+        while (reader.next(region)) {
+            regions.push_back(std::move(region));
+        }
+        return reader.ok();
+    }
+
+    static bool is_sparse_file(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return false;
+        char magic[4];
+        bool sparse = fread(magic, 1, 4, file) == 4 && memcmp(magic, "SPTK", 4) == 0;
+        fclose(file);
+        return sparse;
+    }
+
+private:
+    std::size_t frame_size() const { return channels ? channels : 1; }
+
+    // Zero samples from a frame boundary, counted in whole silent frames
+    std::size_t zero_run(const float* samples, std::size_t from, std::size_t count) const {
+        std::size_t run = 0;
+        while (from + run < count) {
+            std::size_t frame = std::min<std::size_t>(frame_size(), count - from - run);
+            for (std::size_t c = 0; c < frame; ++c) {
+                if (samples[from + run + c] != 0) return run;
+            }
+            run += frame;
+        }
+        return run;
+    }
+
+    // True if append() would store the block as one span of audio
+    bool is_dense(const float* samples, std::size_t count) const {
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < count; i += frame_size()) {
+            run = zero_run(samples, i, std::min<std::size_t>(count, i + frame_size())) ? run + frame_size() : 0;
+            if (run >= MIN_SILENT_RUN) return false;
+        }
+        return run == 0;
+    }
+
+    void append_audio(const float* samples, std::size_t count) {
+        if (regions.empty() || regions.back().end() != total_samples) {
+            regions.push_back(SparseRegion());
+            regions.back().start = total_samples;
+        }
+        regions.back().samples.append(samples, count);
+        total_samples += count;
+    }
+};
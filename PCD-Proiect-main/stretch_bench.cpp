@@ -0,0 +1,77 @@
+// g++-9 -O2 -o stretch_bench stretch_bench.cpp
+// Cost of one sequencer event with keep_length (time_stretch.h) against the resample-only
+// pitch path: microseconds per event for WSOLA and the phase vocoder (stretch + resample back
+// to the slice length) and for render::PitchStep alone, mono and stereo.
+// ./stretch_bench [event length in ms, default 500]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include "render_kernels.h"
+#include "time_stretch.h"
+
+static const unsigned int RATE = 44100;
+static const int EVENTS = 20;
+
+// Best per-event time over EVENTS runs, in microseconds
+template <typename F>
+double us_per_event(F render) {
+    double best = 1e300;
+    for (int run = 0; run < EVENTS; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        render();
+        best = std::min(best, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    int ms = argc > 1 ? std::max(10, atoi(argv[1])) : 500;
+    std::size_t length = static_cast<std::size_t>(ms) * RATE / 1000;
+
+    std::cout << ms << " ms events at " << RATE << " Hz, best of " << EVENTS << ", us per event" << std::endl;
+    std::cout << std::left << std::setw(8) << "layout" << std::setw(8) << "pitch" << std::right << std::setw(10)
+              << "resample" << std::setw(10) << "wsola" << std::setw(10) << "vocoder" << std::setw(10) << "wsola x"
+              << std::setw(10) << "vocoder x" << std::endl;
+    for (unsigned int channels = 1; channels <= 2; ++channels) {
+        // A chord with some noise, so WSOLA's search has something to line up
+        std::vector<float> slice(length * channels);
+        unsigned int seed = 1;
+        for (std::size_t k = 0; k < length; ++k) {
+            seed = seed * 1103515245 + 12345;
+            float noise = ((seed >> 16) % 2000 - 1000) / 20000.0f;
+            float tone = 0.3f * std::sin(2 * M_PI * 220 * k / RATE) + 0.2f * std::sin(2 * M_PI * 330 * k / RATE);
+            for (unsigned int c = 0; c < channels; ++c) slice[k * channels + c] = tone + noise;
+        }
+        std::vector<float> out(length * channels);
+        dsp::StretchCache cache;
+        render::VolumeGain gain = {0.8f};
+
+        for (float pitch : {0.5f, 0.8f, 1.25f, 2.0f}) {
+            render::PitchStep position = {pitch};
+            std::size_t stretched = position(length - 1) + 1;
+            double resample = us_per_event([&] {
+                render::render_block(slice.data(), channels, out.data(), channels, 0,
+                                     render::pitched_frames(length, pitch), position, gain);
+            });
+            double timed[2];
+            dsp::PitchMode modes[2] = {dsp::PitchMode::WSOLA, dsp::PitchMode::VOCODER};
+            for (int m = 0; m < 2; ++m) {
+                timed[m] = us_per_event([&] {
+                    const float* source = cache.stretch(modes[m], slice.data(), length, channels, RATE, stretched);
+                    render::render_block(source, channels, out.data(), channels, 0, length, position, gain);
+                });
+            }
+            std::cout << std::left << std::fixed << std::setw(8) << (channels == 1 ? "mono" : "stereo")
+                      << std::setw(8) << std::setprecision(2) << pitch << std::right << std::setprecision(0) << std::setw(10) << resample
+                      << std::setw(10) << timed[0] << std::setw(10) << timed[1] << std::setprecision(1)
+                      << std::setw(9) << timed[0] / resample << "x" << std::setw(9) << timed[1] / resample << "x"
+                      << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,254 @@
+// Duration-preserving pitch change for the sequencer (keep_length in a score, dsp_chain.h).
+// A slice of L frames is first time-stretched to L / pitch frames without changing its pitch,
+// then resampled by pitch as usual (render::PitchStep), which brings it back to L frames at
+// the new pitch. Two stretchers:
+//  - WSOLA (the default): Hann frames copied from the input at the stretched hop, each moved
+//    within a tolerance so that it lines up with the natural continuation of the previous one.
+//    Time domain only; the alignment search runs on a mono mix, coarse then fine.
+//  - Phase vocoder: STFT frames whose bin phases are advanced at the synthesis hop from their
+//    measured frequencies. Smoother on sustained tones, several times the cost of WSOLA.
+// FFT plans and windows depend only on the frame size, so a StretchCache keeps them, with its
+// scratch buffers, for every event it renders (and so for every event of the same ratio).
+
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <map>
+#include <memory>
+#include <vector>
+#include "dsp_chain.h"
+
+namespace dsp {
+
+// WSOLA frame length; the synthesis hop is half of it and the search tolerance a quarter
+const double WSOLA_FRAME_MS = 23.0;
+// Phase vocoder FFT length (a power of two at least this long) and hop (a quarter of it)
+const double VOCODER_FRAME_MS = 46.0;
+
+// Radix-2 complex FFT of one size: bit reversal table and twiddles computed once
+class FftPlan {
+public:
+    explicit FftPlan(std::size_t size) : size_(size), reversed_(size), twiddles_(size / 2) {
+        unsigned int bits = 0;
+        while ((std::size_t(1) << bits) < size) ++bits;
+        for (std::size_t i = 0; i < size; ++i) {
+            std::size_t r = 0;
+            for (unsigned int b = 0; b < bits; ++b) r |= ((i >> b) & 1) << (bits - 1 - b);
+            reversed_[i] = r;
+        }
+        for (std::size_t k = 0; k < size / 2; ++k) {
+            twiddles_[k] = std::polar(1.0f, static_cast<float>(-2 * M_PI * k / size));
+        }
+    }
+
+    std::size_t size() const { return size_; }
+
+    // In place; the inverse is scaled by 1 / size
+    void transform(std::complex<float>* data, bool inverse) const {
+        for (std::size_t i = 0; i < size_; ++i) {
+            if (i < reversed_[i]) std::swap(data[i], data[reversed_[i]]);
+        }
+        for (std::size_t length = 2; length <= size_; length *= 2) {
+            std::size_t half = length / 2, step = size_ / length;
+            for (std::size_t start = 0; start < size_; start += length) {
+                for (std::size_t j = 0; j < half; ++j) {
+                    // Spelled out: std::complex multiplication checks for infinities and NaNs
+                    float wr = twiddles_[j * step].real();
+                    float wi = inverse ? -twiddles_[j * step].imag() : twiddles_[j * step].imag();
+                    std::complex<float>& a = data[start + j];
+                    std::complex<float>& b = data[start + j + half];
+                    float vr = b.real() * wr - b.imag() * wi;
+                    float vi = b.real() * wi + b.imag() * wr;
+                    b = std::complex<float>(a.real() - vr, a.imag() - vi);
+                    a = std::complex<float>(a.real() + vr, a.imag() + vi);
+                }
+            }
+        }
+        if (inverse) {
+            float scale = 1.0f / size_;
+            for (std::size_t i = 0; i < size_; ++i) data[i] *= scale;
+        }
+    }
+
+private:
+    std::size_t size_;
+    std::vector<std::size_t> reversed_;
+    std::vector<std::complex<float>> twiddles_;
+};
+
+// Periodic Hann window: overlapping copies at half or quarter hops sum to a constant
+inline std::vector<float> hann_window(std::size_t size) {
+    std::vector<float> window(size);
+    for (std::size_t n = 0; n < size; ++n) window[n] = static_cast<float>(0.5 - 0.5 * std::cos(2 * M_PI * n / size));
+    return window;
+}
+
+class StretchCache {
+public:
+    // Frames [0, length) of an interleaved slice stretched to output_frames frames at the same
+    // pitch. The result stays valid until the next call
+    const float* stretch(PitchMode mode, const float* slice, std::size_t length, unsigned int channels,
+                         unsigned int rate, std::size_t output_frames) {
+        out_.assign(output_frames * channels, 0.0f);
+        weights_.assign(output_frames, 0.0f);
+        double stretch = double(output_frames) / length;
+        if (mode == PitchMode::VOCODER) {
+            vocoder(slice, length, channels, rate, output_frames, stretch);
+        } else {
+            wsola(slice, length, channels, rate, output_frames, stretch);
+        }
+        // Overlapping windows sum to a constant except where the output starts and ends
+        for (std::size_t k = 0; k < output_frames; ++k) {
+            float scale = weights_[k] > 1e-3f ? 1.0f / weights_[k] : 0.0f;
+            for (unsigned int c = 0; c < channels; ++c) out_[k * channels + c] *= scale;
+        }
+        return out_.data();
+    }
+
+private:
+    // Window of the given length, built once
+    const std::vector<float>& window(std::size_t size) {
+        std::unique_ptr<std::vector<float>>& entry = windows_[size];
+        if (!entry) entry.reset(new std::vector<float>(hann_window(size)));
+        return *entry;
+    }
+
+    const FftPlan& plan(std::size_t size) {
+        std::unique_ptr<FftPlan>& entry = plans_[size];
+        if (!entry) entry.reset(new FftPlan(size));
+        return *entry;
+    }
+
+    // Cross-correlation of the mono mix at two input positions over count frames, every
+    // stride-th; frames outside the slice count as silence
+    float correlation(long a, long b, std::size_t count, std::size_t stride) const {
+        long length = long(mono_.size());
+        long first = std::max(0L, std::max(-a, -b));
+        long end = std::min(long(count), std::min(length - a, length - b));
+        const float* x = mono_.data() + a;
+        const float* y = mono_.data() + b;
+        float sum = 0;
+        for (long n = first; n < end; n += stride) sum += x[n] * y[n];
+        return sum;
+    }
+
+    void wsola(const float* slice, std::size_t length, unsigned int channels, unsigned int rate,
+               std::size_t output_frames, double stretch) {
+        std::size_t frame = std::max<std::size_t>(64, static_cast<std::size_t>(rate * WSOLA_FRAME_MS / 1000) & ~std::size_t(1));
+        std::size_t synthesis_hop = frame / 2;
+        long tolerance = long(frame / 4);
+        double analysis_hop = synthesis_hop / stretch;
+        const std::vector<float>& hann = window(frame);
+
+        mono_.resize(length);
+        for (std::size_t k = 0; k < length; ++k) {
+            float sum = 0;
+            for (unsigned int c = 0; c < channels; ++c) sum += slice[k * channels + c];
+            mono_[k] = sum;
+        }
+
+        long previous = 0;
+        for (std::size_t m = 0; m * synthesis_hop < output_frames; ++m) {
+            long start = std::lround(m * analysis_hop);
+            if (m > 0) {
+                // The frame that would have followed the previous one in the input is the
+                // target; search around the nominal position, coarse then fine
+                long natural = previous + long(synthesis_hop);
+                long best = 0;
+                float best_score = -HUGE_VALF;
+                for (long delta = -tolerance; delta <= tolerance; delta += 4) {
+                    float score = correlation(natural, start + delta, synthesis_hop, 4);
+                    if (score > best_score) {
+                        best_score = score;
+                        best = delta;
+                    }
+                }
+                long coarse = best;
+                best_score = -HUGE_VALF;
+                for (long delta = std::max(-tolerance, coarse - 3); delta <= std::min(tolerance, coarse + 3); ++delta) {
+                    float score = correlation(natural, start + delta, synthesis_hop, 1);
+                    if (score > best_score) {
+                        best_score = score;
+                        best = delta;
+                    }
+                }
+                start += best;
+            }
+            std::size_t base = m * synthesis_hop;
+            for (std::size_t n = 0; n < frame && base + n < output_frames; ++n) {
+                long source = start + long(n);
+                weights_[base + n] += hann[n];
+                if (source < 0 || source >= long(length)) continue;
+                for (unsigned int c = 0; c < channels; ++c) {
+                    out_[(base + n) * channels + c] += hann[n] * slice[source * channels + c];
+                }
+            }
+            previous = start;
+        }
+    }
+
+    void vocoder(const float* slice, std::size_t length, unsigned int channels, unsigned int rate,
+                 std::size_t output_frames, double stretch) {
+        std::size_t size = 256;
+        while (size < rate * VOCODER_FRAME_MS / 1000) size *= 2;
+        std::size_t synthesis_hop = size / 4;
+        double analysis_hop = synthesis_hop / stretch;
+        const FftPlan& fft = plan(size);
+        const std::vector<float>& hann = window(size);
+        std::size_t bins = size / 2 + 1;
+        spectrum_.resize(size);
+        last_phase_.resize(bins);
+        phase_.resize(bins);
+
+        std::size_t frames = (output_frames + synthesis_hop - 1) / synthesis_hop;
+        for (unsigned int c = 0; c < channels; ++c) {
+            long previous = 0;
+            for (std::size_t m = 0; m < frames; ++m) {
+                long start = std::lround(m * analysis_hop);
+                for (std::size_t n = 0; n < size; ++n) {
+                    long source = start + long(n);
+                    float sample = source >= 0 && source < long(length) ? slice[source * channels + c] : 0.0f;
+                    spectrum_[n] = std::complex<float>(sample * hann[n], 0.0f);
+                }
+                fft.transform(spectrum_.data(), false);
+                double hop = double(start - previous);
+                for (std::size_t k = 0; k < bins; ++k) {
+                    double magnitude = std::abs(spectrum_[k]);
+                    double measured = std::arg(spectrum_[k]);
+                    double omega = 2 * M_PI * k / size;
+                    if (m == 0 || hop <= 0) {
+                        phase_[k] = m == 0 ? measured : phase_[k] + omega * synthesis_hop;
+                    } else {
+                        // Deviation from the bin's own frequency, wrapped to [-pi, pi]
+                        double deviation = measured - last_phase_[k] - omega * hop;
+                        deviation -= 2 * M_PI * std::floor(deviation / (2 * M_PI) + 0.5);
+                        phase_[k] += (omega + deviation / hop) * synthesis_hop;
+                    }
+                    last_phase_[k] = measured;
+                    spectrum_[k] = std::polar(static_cast<float>(magnitude), static_cast<float>(phase_[k]));
+                }
+                for (std::size_t k = 1; k < size / 2; ++k) spectrum_[size - k] = std::conj(spectrum_[k]);
+                fft.transform(spectrum_.data(), true);
+
+                std::size_t base = m * synthesis_hop;
+                for (std::size_t n = 0; n < size && base + n < output_frames; ++n) {
+                    out_[(base + n) * channels + c] += hann[n] * spectrum_[n].real();
+                    if (c == 0) weights_[base + n] += hann[n] * hann[n];
+                }
+                previous = start;
+            }
+        }
+    }
+
+    std::map<std::size_t, std::unique_ptr<FftPlan>> plans_;
+    std::map<std::size_t, std::unique_ptr<std::vector<float>>> windows_;
+    std::vector<float> out_;
+    std::vector<float> weights_;  // sum of the window (squared for the vocoder) at each output frame
+    std::vector<float> mono_;
+    std::vector<std::complex<float>> spectrum_;
+    std::vector<double> last_phase_;
+    std::vector<double> phase_;
+};
+
+}  // namespace dsp
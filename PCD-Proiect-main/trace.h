@@ -0,0 +1,227 @@
+// Opt-in trace of a job's lifecycle across the server, worker, sequencer and mixer processes,
+// in the Chrome trace-event format (chrome://tracing, ui.perfetto.dev). Started with JOB_TRACE=1
+// in the server's environment. Each process appends its spans for a job to
+// <job folder>/trace.<process>.<pid>.json (files, as every folder of a job is a track); the
+// server merges them into <job folder>/trace.json
+// when the job ends and after each delivery. Timestamps are wall-clock microseconds so the spans
+// of all processes share one timeline, and every span carries the job id.
+
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+extern char** environ;
+
+namespace job_trace {
+
+// Set by the server (or a parent process) in the environment of the processes it starts
+const char* const FOLDER_VARIABLE = "JOB_TRACE_DIR";    // absolute job folder
+const char* const JOB_VARIABLE = "JOB_TRACE_JOB";       // job id
+const char* const SPAWN_VARIABLE = "JOB_TRACE_SPAWN_US"; // when the parent forked, for the "fork/exec" span
+
+struct State {
+    bool enabled = false;
+    std::string process = "server";
+    std::string folder;  // the job this process works on (not the server's)
+    std::string job_id;
+};
+
+inline State& state() {
+    static State current;
+    return current;
+}
+
+inline bool enabled() { return state().enabled; }
+
+inline int64_t now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+inline std::string quoted(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) out += c;
+    }
+    return out + "\"";
+}
+
+// Span arguments besides the job id: Args().add("bytes", n).add("track", "2")
+class Args {
+public:
+    Args& add(const char* key, long long value) {
+        json_ += std::string(",") + quoted(key) + ":" + std::to_string(value);
+        return *this;
+    }
+    Args& add(const char* key, const std::string& value) {
+        json_ += std::string(",") + quoted(key) + ":" + quoted(value);
+        return *this;
+    }
+    const std::string& json() const { return json_; }
+
+private:
+    std::string json_;
+};
+
+// Appends one complete ("X") span of this process to the job's trace; a single O_APPEND
+// write per line keeps the lines of concurrent threads whole
+inline void emit(const std::string& folder, const std::string& job_id, const std::string& name, int64_t start_us,
+                 int64_t end_us, const Args& args = Args()) {
+    if (!enabled() || folder.empty()) return;
+    std::string path = folder + "/trace." + state().process + "." + std::to_string(getpid()) + ".json";
+    std::string line = "{\"name\":" + quoted(name) + ",\"cat\":" + quoted(state().process) +
+                       ",\"ph\":\"X\",\"ts\":" + std::to_string(start_us) +
+                       ",\"dur\":" + std::to_string(std::max<int64_t>(0, end_us - start_us)) +
+                       ",\"pid\":" + std::to_string(getpid()) + ",\"tid\":" + std::to_string(syscall(SYS_gettid)) +
+                       ",\"args\":{\"job\":" + quoted(job_id) + args.json() + "}}\n";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    ssize_t written = write(fd, line.data(), line.size());
+    (void)written;
+    close(fd);
+}
+
+// A span of the job this process was started for
+inline void span(const std::string& name, int64_t start_us, int64_t end_us, const Args& args = Args()) {
+    emit(state().folder, state().job_id, name, start_us, end_us, args);
+}
+
+// Span from construction to end() or destruction, of the job this process was started for
+class Span {
+public:
+    explicit Span(const std::string& name) : name_(name), start_(enabled() ? now_us() : 0) {}
+    ~Span() { end(); }
+
+    Args& args() { return args_; }
+
+    void end() {
+        if (start_ != 0) span(name_, start_, now_us(), args_);
+        start_ = 0;
+    }
+
+private:
+    std::string name_;
+    int64_t start_;
+    Args args_;
+};
+
+// The server traces every job when JOB_TRACE is set (to anything but 0)
+inline void init_server() {
+    const char* value = getenv("JOB_TRACE");
+    state().enabled = value != nullptr && strcmp(value, "0") != 0;
+}
+
+// Processes started for a job trace it when their parent passed the job in the environment;
+// the time since the parent's fork is their first span
+inline void init_child(const char* process) {
+    const char* folder = getenv(FOLDER_VARIABLE);
+    const char* job_id = getenv(JOB_VARIABLE);
+    if (folder == nullptr || job_id == nullptr) return;
+    State& current = state();
+    current.enabled = true;
+    current.process = process;
+    current.folder = folder;
+    current.job_id = job_id;
+    const char* spawned = getenv(SPAWN_VARIABLE);
+    if (spawned != nullptr) {
+        span("fork/exec", atoll(spawned), now_us());
+    }
+}
+
+// Environment for a child about to be exec'd for a job: ours plus the job's trace settings.
+// Built before fork(), since only async-signal-safe calls are allowed in the child of a
+// threaded process, and right before it: the child's "fork/exec" span starts here. Without
+// tracing it is our environment unchanged
+class ChildEnvironment {
+public:
+    ChildEnvironment() : ChildEnvironment(state().folder, state().job_id) {}
+
+    ChildEnvironment(const std::string& folder, const std::string& job_id) {
+        if (!enabled() || folder.empty()) return;
+        for (char** variable = environ; *variable != nullptr; ++variable) {
+            if (strncmp(*variable, "JOB_TRACE_", 10) != 0) strings_.push_back(*variable);
+        }
+        // Children change directory, so the folder is passed absolute
+        char absolute[PATH_MAX];
+        std::string path = realpath(folder.c_str(), absolute) != nullptr ? absolute : folder;
+        strings_.push_back(std::string(FOLDER_VARIABLE) + "=" + path);
+        strings_.push_back(std::string(JOB_VARIABLE) + "=" + job_id);
+        strings_.push_back(std::string(SPAWN_VARIABLE) + "=" + std::to_string(now_us()));
+        for (auto& variable : strings_) pointers_.push_back(&variable[0]);
+        pointers_.push_back(nullptr);
+    }
+
+    char* const* get() const { return pointers_.empty() ? environ : pointers_.data(); }
+
+private:
+    std::vector<std::string> strings_;
+    std::vector<char*> pointers_;
+};
+
+// Joins the spans every process wrote for the job into <folder>/trace.json, with each process
+// named after its fragment ("worker 4711")
+inline bool merge(const std::string& folder) {
+    if (!enabled()) return false;
+    DIR* dir = opendir(folder.c_str());
+    if (dir == nullptr) return false;
+    static const char* const order[] = {"server", "worker", "sequencer", "mixer"};
+    std::ostringstream events;
+    bool first = true;
+    auto append = [&](const std::string& event) {
+        events << (first ? "\n" : ",\n") << event;
+        first = false;
+    };
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        // trace.<process>.<pid>.json
+        std::string name = entry->d_name;
+        size_t dot = name.find('.', 6);
+        if (name.compare(0, 6, "trace.") != 0 || dot == std::string::npos || name.size() < dot + 6 ||
+            name.compare(name.size() - 5, 5, ".json") != 0) {
+            continue;
+        }
+        std::string process = name.substr(6, dot - 6);
+        std::string pid = name.substr(dot + 1, name.size() - 5 - dot - 1);
+        int sort_index = 4;
+        for (int k = 0; k < 4; ++k) {
+            if (process == order[k]) sort_index = k;
+        }
+        append("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + pid + ",\"args\":{\"name\":" +
+               quoted(process + " " + pid) + "}}");
+        append("{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":" + pid + ",\"args\":{\"sort_index\":" +
+               std::to_string(sort_index) + "}}");
+        std::ifstream fragment(folder + "/" + name);
+        std::string line;
+        while (std::getline(fragment, line)) {
+            if (!line.empty()) append(line);
+        }
+    }
+    closedir(dir);
+    // Replaced whole, so a reader never sees a half-written trace
+    std::string path = folder + "/trace.json";
+    std::string temporary = path + "." + std::to_string(syscall(SYS_gettid));
+    {
+        std::ofstream out(temporary);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << events.str() << "\n]}\n";
+        if (!out.flush()) return false;
+    }
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+}  // namespace job_trace
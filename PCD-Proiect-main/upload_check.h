@@ -0,0 +1,256 @@
+// Checks of uploaded files while their bytes arrive, so a file the sequencer would refuse is
+// rejected during the upload instead of failing in the worker once the job has been queued.
+// SoundCheck reads the RIFF/WAVE header up to the data chunk (or a FLAC STREAMINFO block),
+// ScoreCheck checks each score line as soon as it is complete. What they read is kept with
+// the job (TrackInfo in job_registry.h) for the scheduler and the cost model.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include "dsp_chain.h"
+#include "job_registry.h"
+
+// Bytes a sound may hold before its data chunk (fmt, LIST, bext, ... chunks)
+const std::size_t MAX_SOUND_HEADER_BYTES = 1024 * 1024;
+const unsigned int MAX_SOUND_CHANNELS = 64;
+const unsigned int MAX_SOUND_RATE = 768000;
+// Longest score line; a longer one is not a score
+const std::size_t MAX_SCORE_LINE_BYTES = 64 * 1024;
+
+class SoundCheck {
+public:
+    SoundCheck(uint64_t file_size = 0) : file_size_(file_size) {}
+
+    // Takes the next bytes of the file; false once it is known to be unusable (see error()).
+    // Bytes after the header are only counted
+    bool feed(const char* data, std::size_t size) {
+        received_ += size;
+        if (done_ || failed()) {
+            return !failed();
+        }
+        head_.append(data, std::min(size, MAX_SOUND_HEADER_BYTES + 64 - head_.size()));
+        if (parse() || failed()) {
+            head_.clear();
+            head_.shrink_to_fit();
+            return !failed();
+        }
+        if (head_.size() >= MAX_SOUND_HEADER_BYTES) {
+            error_ = "no data chunk in the first " + std::to_string(MAX_SOUND_HEADER_BYTES / 1024) + " KB";
+        } else if (received_ >= file_size_) {
+            error_ = "header cut short";
+        }
+        return !failed();
+    }
+
+    // True once the header has been read and accepted
+    bool done() const { return done_; }
+    bool failed() const { return !error_.empty(); }
+    const std::string& error() const { return error_; }
+    const TrackInfo& info() const { return info_; }
+
+private:
+    static uint32_t le32(const char* p) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        return u[0] | (u[1] << 8) | (u[2] << 16) | (uint32_t(u[3]) << 24);
+    }
+
+    static uint16_t le16(const char* p) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        return u[0] | (u[1] << 8);
+    }
+
+    // True when the header is complete and valid; sets error_ as soon as something is wrong
+    bool parse() {
+        if (head_.size() < 4) {
+            return false;
+        }
+        if (head_.compare(0, 4, "fLaC") == 0) {
+            return parse_flac();
+        }
+        if (head_.compare(0, 4, "RIFF") != 0 && head_.compare(0, 4, "RF64") != 0) {
+            error_ = "not a WAV or FLAC file";
+            return false;
+        }
+        if (head_.size() < 12) {
+            return false;
+        }
+        if (head_.compare(8, 4, "WAVE") != 0) {
+            error_ = "RIFF file is not WAVE";
+            return false;
+        }
+        unsigned int block_align = 0;
+        std::size_t position = 12;
+        while (position + 8 <= head_.size()) {
+            const char* chunk = head_.data() + position;
+            uint32_t size = le32(chunk + 4);
+            if (memcmp(chunk, "data", 4) == 0) {
+                if (block_align == 0) {
+                    error_ = "data chunk before the fmt chunk";
+                    return false;
+                }
+                // Streaming writers leave the size at 0 or 0xFFFFFFFF (RF64 keeps it in ds64);
+                // a short file is read up to its end
+                uint64_t available = file_size_ - std::min<uint64_t>(file_size_, position + 8);
+                uint64_t data_bytes = size == 0 || size == 0xFFFFFFFF ? available : std::min<uint64_t>(size, available);
+                info_.frames = data_bytes / block_align;
+                done_ = true;
+                return true;
+            }
+            if (memcmp(chunk, "fmt ", 4) == 0) {
+                if (size < 16) {
+                    error_ = "fmt chunk too short";
+                    return false;
+                }
+                if (position + 8 + std::min<uint32_t>(size, 40) > head_.size()) {
+                    return false;
+                }
+                if (!check_format(chunk + 8, size, block_align)) {
+                    return false;
+                }
+            }
+            position += 8 + uint64_t(size) + (size & 1);
+        }
+        if (position > MAX_SOUND_HEADER_BYTES) {
+            error_ = "no data chunk in the first " + std::to_string(MAX_SOUND_HEADER_BYTES / 1024) + " KB";
+        }
+        return false;
+    }
+
+    // The sample formats the sequencer reads (audio_file.h): integer PCM and IEEE float
+    bool check_format(const char* fmt, uint32_t size, unsigned int& block_align) {
+        unsigned int tag = le16(fmt);
+        info_.channels = le16(fmt + 2);
+        info_.sample_rate = le32(fmt + 4);
+        block_align = le16(fmt + 12);
+        unsigned int bits = le16(fmt + 14);
+        if (tag == 0xFFFE && size >= 40) {
+            // WAVE_FORMAT_EXTENSIBLE: the format is the first two bytes of the subformat GUID
+            tag = le16(fmt + 24);
+        }
+        bool pcm = tag == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32);
+        bool ieee_float = tag == 3 && (bits == 32 || bits == 64);
+        if (!pcm && !ieee_float) {
+            error_ = "unsupported sample format " + std::to_string(tag) + "/" + std::to_string(bits) + " bits";
+        } else if (info_.channels == 0 || info_.channels > MAX_SOUND_CHANNELS) {
+            error_ = "unsupported channel count " + std::to_string(info_.channels);
+        } else if (info_.sample_rate == 0 || info_.sample_rate > MAX_SOUND_RATE) {
+            error_ = "unsupported sample rate " + std::to_string(info_.sample_rate);
+        } else if (block_align != info_.channels * (bits / 8)) {
+            error_ = "block size " + std::to_string(block_align) + " does not match the format";
+        }
+        return !failed();
+    }
+
+    // fLaC, then the STREAMINFO block (always first, 34 bytes)
+    bool parse_flac() {
+        if (head_.size() < 8 + 34) {
+            return false;
+        }
+        const unsigned char* header = reinterpret_cast<const unsigned char*>(head_.data()) + 4;
+        if ((header[0] & 0x7f) != 0 || ((header[1] << 16) | (header[2] << 8) | header[3]) != 34) {
+            error_ = "FLAC file without STREAMINFO";
+            return false;
+        }
+        const unsigned char* s = header + 4;
+        info_.flac = true;
+        info_.sample_rate = (s[10] << 12) | (s[11] << 4) | (s[12] >> 4);
+        info_.channels = ((s[12] >> 1) & 0x07) + 1;
+        // 0 when the encoder did not know the length
+        info_.frames = (static_cast<uint64_t>(s[13] & 0x0f) << 32) | (static_cast<uint64_t>(s[14]) << 24) |
+                       (s[15] << 16) | (s[16] << 8) | s[17];
+        if (info_.sample_rate == 0) {
+            error_ = "FLAC sample rate missing";
+            return false;
+        }
+        done_ = true;
+        return true;
+    }
+
+    uint64_t file_size_;
+    uint64_t received_ = 0;
+    std::string head_;  // the first bytes, until the header is read
+    bool done_ = false;
+    std::string error_;
+    TrackInfo info_;
+};
+
+// The same rules as the sequencer's parseInstructions: "track" lines hold effects, other lines
+// five numbers (the silence before the slice not negative) and optional effects. Blank lines
+// are skipped
+class ScoreCheck {
+public:
+    // Takes the next bytes of the score; false at the first bad line (see error())
+    bool feed(const char* data, std::size_t size) {
+        bytes_ += size;
+        for (std::size_t i = 0; i < size && !failed(); ++i) {
+            if (data[i] == '\n') {
+                check_line();
+                line_.clear();
+            } else if (line_.size() < MAX_SCORE_LINE_BYTES) {
+                line_ += data[i];
+            } else {
+                error_ = "line " + std::to_string(line_number_ + 1) + " longer than " +
+                         std::to_string(MAX_SCORE_LINE_BYTES / 1024) + " KB";
+            }
+        }
+        return !failed();
+    }
+
+    // Checks a last line without a newline; call once every byte has arrived
+    bool finish() {
+        if (!failed() && !line_.empty()) {
+            check_line();
+            line_.clear();
+        }
+        return !failed();
+    }
+
+    bool failed() const { return !error_.empty(); }
+    const std::string& error() const { return error_; }
+    uint64_t bytes() const { return bytes_; }
+    int events() const { return events_; }
+
+private:
+    void check_line() {
+        ++line_number_;
+        std::istringstream in(line_);
+        std::string first, error;
+        if (!(in >> first)) {
+            return;
+        }
+        bool valid;
+        if (first == dsp::TRACK_KEYWORD) {
+            dsp::Effects effects;
+            valid = dsp::parse_effects(in, effects, error);
+        } else {
+            in.clear();
+            in.seekg(0);
+            int frames_until_played = 0, start_ms = 0, end_ms = 0;
+            float pitch = 1, volume = 1;
+            dsp::Effects effects;
+            valid = static_cast<bool>(in >> frames_until_played >> pitch >> volume >> start_ms >> end_ms);
+            if (!valid) {
+                error = "expected <frames> <pitch> <volume> <start ms> <end ms>";
+            } else if (frames_until_played < 0) {
+                valid = false;
+                error = "negative <frames>";
+            } else {
+                valid = dsp::parse_effects(in, effects, error);
+                ++events_;
+            }
+        }
+        if (!valid) {
+            error_ = "line " + std::to_string(line_number_) + ": " + error;
+        }
+    }
+
+    std::string line_;  // the line being received
+    int line_number_ = 0;
+    int events_ = 0;
+    uint64_t bytes_ = 0;
+    std::string error_;
+};
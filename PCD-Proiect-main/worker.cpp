@@ -7,10 +7,20 @@
 #include <vector>
 #include <string>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <cstring>
+#include <algorithm>
+#include <thread>
+#include <fstream>
+#include <set>
+#include <cstdio>
+#include <chrono>
+#include "sample_convert.h"
+#include "trace.h"
+#include "probes.h"
 
 const int MAX_ACTIVE_THREADS = 3; // Maximum number of active threads
 
@@ -21,6 +31,15 @@ std::vector<pthread_t> active_threads;
 std::string initial_working_directory;
 bool all_jobs_queued = false; // Indicates whether all jobs have been queued
 std::string all_sequenced_files; // Accumulator for sequenced file paths
+std::vector<std::pair<std::string, long long>> track_timings; // Per-track sequencer wall time in microseconds
+std::vector<std::pair<std::string, long>> track_peak_rss; // Per-track sequencer peak RSS in KB
+int progress_fd = -1; // The server reads "track <n> done" lines from here to journal finished tracks
+std::set<std::string> skipped_tracks; // Tracks already sequenced before the job was interrupted
+std::string job_id; // From the job folder name, for the probes (probes.h)
+
+long long elapsed_us(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
 
 void fixPaths(std::string& str, const std::string& working_folder) {
     // Replace double slashes with single slashes
@@ -40,7 +59,7 @@ void fixPaths(std::string& str, const std::string& working_folder) {
 
 
 // Function to process a job in a child process
-void processJob(const std::pair<std::string, std::string>& job) {
+void processJob(const std::pair<std::string, std::string>& job, char* const* environment) {
     const std::string& command = job.first;
     const std::string& directory = job.second;
 
@@ -73,7 +92,7 @@ void processJob(const std::pair<std::string, std::string>& job) {
     argv.push_back(nullptr);
 
     // Execute the command
-    execvp(argv[0], argv.data());
+    execvpe(argv[0], argv.data(), environment);
 
     // If execvp fails
     std::cerr << "execvp failed\n";
@@ -98,20 +117,38 @@ void* threadFunction(void* arg) {
         job_queue.pop();
         pthread_mutex_unlock(&mutex);
 
+        std::string track = job.second.substr(job.second.find_last_of('/') + 1);
+        job_trace::Span trace_span("sequence " + track);
+        job_trace::ChildEnvironment environment;
+        SOUNDSEQ_PROBE2(track_start, job_id.c_str(), track.c_str());
+        auto job_start = std::chrono::steady_clock::now();
         pid_t pid = fork();
         if (pid == -1) {
             std::cerr << "Fork failed\n";
         } else if (pid == 0) {
             // Child process
-            processJob(job);
+            processJob(job, environment.get());
         } else {
             // Parent process, wait for the child process to complete
             int status;
-            waitpid(pid, &status, 0);
+            struct rusage usage;
+            wait4(pid, &status, 0, &usage);
+            trace_span.args().add("pid", pid).add("peak_rss_kb", usage.ru_maxrss);
+            trace_span.end();
+
+            long long track_us = elapsed_us(job_start);
+            SOUNDSEQ_PROBE4(track_end, job_id.c_str(), track.c_str(), status, track_us);
+            pthread_mutex_lock(&mutex);
+            track_timings.emplace_back(track, track_us);
+            track_peak_rss.emplace_back(track, usage.ru_maxrss);
+            if (progress_fd != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                dprintf(progress_fd, "track %s done\n", track.c_str());
+            }
+            pthread_mutex_unlock(&mutex);
 
             // If the job was a sequencer command, append its output to sequenced_files
             if (job.first.find("./sequencer") != std::string::npos) {
-                std::string sequenced_file = job.second + "/sequenced.wav";
+                std::string sequenced_file = job.second + "/sequenced.sptk";
                 sequenced_files += " " + sequenced_file;
             }
         }
@@ -135,6 +172,22 @@ void startNewThread() {
     }
 }
 
+// Mixer options from <folder>/render.txt ("format <pcm16|pcm24|float>", "dither"), written by
+// the server for jobs that asked for another output format
+std::string readRenderOptions(const std::string& folder) {
+    std::ifstream file(folder + "/render.txt");
+    std::string options, word;
+    while (file >> word) {
+        OutputFormat format;
+        if (word == "format" && file >> word && parse_output_format(word, format)) {
+            options += " --format " + std::string(output_format_name(format));
+        } else if (word == "dither") {
+            options += " --dither";
+        }
+    }
+    return options;
+}
+
 void readJobsFromFolder(const std::string& folder) {
     DIR* dir = opendir(folder.c_str());
     if (!dir) {
@@ -148,9 +201,25 @@ void readJobsFromFolder(const std::string& folder) {
             std::string subfolder = entry->d_name;
             if (subfolder != "." && subfolder != "..") {
                 std::string subfolderPath = folder + "/" + subfolder;
+                std::string sequencedFile = subfolderPath + "/sequenced.sptk";
+                if (!std::ifstream(sequencedFile)) {
+                    sequencedFile = subfolderPath + "/sequenced.wav"; // rendered by an older sequencer
+                }
+                if (skipped_tracks.count(subfolder) && std::ifstream(sequencedFile)) {
+                    // Resumed job: reuse the track rendered before the interruption
+                    pthread_mutex_lock(&mutex);
+                    all_sequenced_files += " " + sequencedFile;
+                    pthread_mutex_unlock(&mutex);
+                    continue;
+                }
                 std::string soundFile = subfolderPath + "/sound.wav";
+                if (std::ifstream(subfolderPath + "/sound.flac")) {
+                    soundFile = subfolderPath + "/sound.flac"; // uploaded FLAC, decoded by the sequencer
+                }
                 std::string instructionsFile = subfolderPath + "/instructions.txt";
-                std::string command = "./sequencer " + soundFile + " " + instructionsFile;
+                // The cores are shared between the sequencers running at once
+                unsigned int threads = std::max(1u, std::thread::hardware_concurrency() / MAX_ACTIVE_THREADS);
+                std::string command = "./sequencer " + soundFile + " " + instructionsFile + " --threads " + std::to_string(threads);
                 pthread_mutex_lock(&mutex);
                 job_queue.emplace(command, subfolderPath);
                 pthread_cond_signal(&cond);
@@ -162,11 +231,46 @@ void readJobsFromFolder(const std::string& folder) {
     closedir(dir);
 }
 
+// Like system(), but returns the peak RSS in KB of the command (the shell and what it ran)
+long run_measured(const std::string& command) {
+    job_trace::ChildEnvironment environment;
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::cerr << "Fork failed\n";
+        return 0;
+    }
+    if (pid == 0) {
+        execle("/bin/sh", "sh", "-c", command.c_str(), (char*)nullptr, environment.get());
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <folder>" << std::endl;
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <folder> [--progress-fd <fd>] [--skip <track,track,...>]" << std::endl;
         return 1;
     }
+    for (int i = 2; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--progress-fd") {
+            progress_fd = atoi(argv[i + 1]);
+        } else if (option == "--skip") {
+            char* track = std::strtok(argv[i + 1], ",");
+            while (track != nullptr) {
+                skipped_tracks.insert(track);
+                track = std::strtok(nullptr, ",");
+            }
+        }
+    }
+
+    // Traced when the server passed the job in the environment (trace.h)
+    job_trace::init_child("worker");
 
     // Get the initial working directory
     char cwd[1024];
@@ -178,6 +282,10 @@ int main(int argc, char* argv[]) {
     }
 
     std::string job_folder = argv[1];
+    // Passed on to the sequencers and the mixer; set before any thread starts
+    size_t name_start = job_folder.rfind("job_");
+    job_id = name_start == std::string::npos ? job_folder : job_folder.substr(name_start + 4);
+    setenv(PROBE_JOB_VARIABLE, job_id.c_str(), 1);
 
     // Read jobs from the given folder
     readJobsFromFolder(job_folder);
@@ -200,7 +308,7 @@ int main(int argc, char* argv[]) {
     fixPaths(all_sequenced_files, initial_working_directory);
     std::cout<<all_sequenced_files<<'\n';
     // Mix sequenced sound files
-    std::string mixer_command = initial_working_directory + "/mixer ./done.wav" + all_sequenced_files;
+    std::string mixer_command = initial_working_directory + "/mixer" + readRenderOptions(job_folder) + " ./done.wav" + all_sequenced_files;
 
     // Change working directory to the job folder
     if (chdir(job_folder.c_str()) != 0) {
@@ -210,9 +318,35 @@ int main(int argc, char* argv[]) {
 
     // Execute mixer command
     std::cout << "Mixing sequenced sounds...\n";
-    system(mixer_command.c_str());
+    auto mix_start = std::chrono::steady_clock::now();
+    job_trace::Span mix_span("mix");
+    long mix_peak_rss = run_measured(mixer_command);
+    mix_span.args().add("tracks", static_cast<long long>(track_timings.size())).add("peak_rss_kb", mix_peak_rss);
+    mix_span.end();
+    long long mix_us = elapsed_us(mix_start);
     std::cout << "Mixing completed. Output saved as done.wav\n";
 
+    // Report stage timings to the server, which reads them back once the worker exits
+    std::ofstream timings("timings.txt");
+    for (const auto& timing : track_timings) {
+        timings << "sequence " << timing.first << " " << timing.second << "\n";
+    }
+    timings << "mix " << mix_us << "\n";
+    for (const auto& timing : track_timings) {
+        // Written by the sequencer: instructions copied from its slice memo, instructions rendered
+        std::ifstream memo(timing.first + "/slice_memo.txt");
+        unsigned long long hits = 0, misses = 0;
+        if (memo >> hits >> misses) {
+            timings << "slice_memo " << timing.first << " " << hits << " " << misses << "\n";
+        }
+    }
+    // Peak RSS in KB, compared by the server with its memory estimate
+    for (const auto& peak : track_peak_rss) {
+        timings << "peak_rss sequence " << peak.first << " " << peak.second << "\n";
+    }
+    timings << "peak_rss mix " << mix_peak_rss << "\n";
+    timings.close();
+
 
     // Change working directory back to the initial directory
     if (chdir(initial_working_directory.c_str()) != 0) {